@@ -0,0 +1,501 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "util.h"
+#include "cache.h"
+#include "postings.h"
+#include "database.h"
+
+/* キャッシュする1件の検索結果の最大文書数。これより多い検索結果は保存しない */
+#define QUERY_CACHE_MAX_RESULTS 4096
+
+/**
+ * インデックスの世代を取得する。
+ * インデックスが書き出されるたびに増えるので、世代が違う検索結果は使えない。
+ * 設定を読み直すのは、最初の1回と、他の接続による更新でdata_versionが
+ * 変わった場合だけ。この接続で書き出す場合は、書き出す側がenvの世代も進める。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @return インデックスの世代
+ */
+long long
+get_index_generation(wiser_env *env)
+{
+  int data_version = db_get_data_version(env);
+
+  /* data_versionを取得できない場合は、毎回読み直す */
+  if (!env->index_generation_loaded || data_version < 0 ||
+      data_version != env->data_version) {
+    int value_size = 0;
+    const char *value = NULL;
+    db_get_settings(env, INDEX_GENERATION_KEY,
+                    sizeof(INDEX_GENERATION_KEY) - 1, &value, &value_size);
+    env->index_generation = 0;
+    if (value && value_size) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%.*s", value_size, value);
+      env->index_generation = strtoll(buf, NULL, 10);
+    }
+    env->index_generation_loaded = TRUE;
+    env->data_version = data_version;
+  }
+  return env->index_generation;
+}
+
+/**
+ * クエリを正規化し、検索オプションと合わせてキャッシュのキーを作る。
+ * 前後の空白を取り除き、連続する空白を1つにまとめる。
+ * @param[in] a キーを切り出すアリーナ
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] query 検索クエリ
+ * @return キャッシュのキー。アリーナが所有する。失敗した場合はNULL
+ */
+char *
+make_query_cache_key(arena *a, const wiser_env *env, const char *query)
+{
+  char *key, *k;
+  int prefix_len, space = FALSE;
+  size_t query_len = strlen(query);
+
+  /* 検索オプションの接頭辞は高々160バイト */
+  if (!(key = arena_alloc(a, 160 + query_len + 1))) { return NULL; }
+  prefix_len = snprintf(key, 160, "%d:%d:%d:%d:%d:%d:%d:%d:%d:%d:%d:",
+                        env->enable_phrase_search,
+                        env->enable_two_phase_search, env->enable_or_search,
+                        env->scoring, env->search_top_k, env->fuzzy_distance,
+                        env->enable_snippets, env->enable_impact_search,
+                        env->count_only, env->search_offset,
+                        env->search_limit);
+  for (k = key + prefix_len; *query; query++) {
+    if (isspace((unsigned char)*query)) {
+      space = TRUE;
+      continue;
+    }
+    if (space && k > key + prefix_len) { *k++ = ' '; }
+    space = FALSE;
+    *k++ = *query;
+  }
+  *k = '\0';
+  return key;
+}
+
+/**
+ * キャッシュのエントリを開放する。
+ * @param[in] entry 開放するエントリ
+ */
+static void
+free_query_cache_entry(query_cache_entry *entry)
+{
+  free(entry->key);
+  if (entry->results) { free(entry->results); }
+  free(entry);
+}
+
+/**
+ * キャッシュから検索結果を取得する。
+ * 取得したエントリは、最も新しく参照されたものとして並べ直す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] key キャッシュのキー
+ * @param[in] generation 現在のインデックスの世代
+ * @return 検索結果のエントリ。キャッシュにない場合はNULL
+ */
+const query_cache_entry *
+get_query_cache(wiser_env *env, const char *key, long long generation)
+{
+  query_cache_entry *entry;
+
+  HASH_FIND_STR(env->query_cache, key, entry);
+  if (entry && entry->generation != generation) {
+    /* インデックスが更新されているので使わない */
+    HASH_DEL(env->query_cache, entry);
+    free_query_cache_entry(entry);
+    entry = NULL;
+  } else if (entry && entry->hh.next) {
+    /* 末尾のエントリは既に最も新しく参照されたものなので並べ直さない。
+       唯一のエントリを取り除くと、ハッシュ表まで開放されてしまう */
+    HASH_DEL(env->query_cache, entry);
+    HASH_ADD_KEYPTR(hh, env->query_cache, entry->key, strlen(entry->key),
+                    entry);
+  }
+  if (entry) {
+    env->query_cache_hits++;
+  } else {
+    env->query_cache_misses++;
+  }
+  return entry;
+}
+
+/**
+ * 検索結果をキャッシュに保存する。
+ * キャッシュがいっぱいの場合は、最も古く参照されたものを追い出す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] key キャッシュのキー。保存する場合は写しを作る
+ * @param[in] generation 検索時のインデックスの世代
+ * @param[in] results スコアの降順に並べた検索結果
+ * @param[in] results_count 検索結果の件数
+ * @param[in] total_count 検索条件に一致した文書数
+ * @param[in] count_is_lower_bound total_countが下限値かどうか
+ */
+void
+put_query_cache(wiser_env *env, const char *key, long long generation,
+                const search_result_entry *results, int results_count,
+                int total_count, int count_is_lower_bound)
+{
+  query_cache_entry *entry;
+
+  if (env->query_cache_size <= 0 ||
+      results_count > QUERY_CACHE_MAX_RESULTS ||
+      !(entry = calloc(1, sizeof(query_cache_entry)))) {
+    return;
+  }
+  if (!(entry->key = strdup(key)) ||
+      (results_count &&
+       !(entry->results = malloc(sizeof(search_result_entry) *
+                                 results_count)))) {
+    print_error("cannot allocate memory for query cache.");
+    free_query_cache_entry(entry);
+    return;
+  }
+  if (results_count) {
+    memcpy(entry->results, results,
+           sizeof(search_result_entry) * results_count);
+  }
+  entry->generation = generation;
+  entry->results_count = results_count;
+  entry->total_count = total_count;
+  entry->count_is_lower_bound = count_is_lower_bound;
+
+  while (HASH_COUNT(env->query_cache) >= env->query_cache_size) {
+    /* ハッシュの先頭が、最も古く参照されたエントリ */
+    query_cache_entry *oldest = env->query_cache;
+    HASH_DEL(env->query_cache, oldest);
+    free_query_cache_entry(oldest);
+  }
+  HASH_ADD_KEYPTR(hh, env->query_cache, entry->key, strlen(entry->key),
+                  entry);
+}
+
+/**
+ * キャッシュを破棄する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+void
+fin_query_cache(wiser_env *env)
+{
+  query_cache_entry *entry, *tmp;
+  HASH_ITER(hh, env->query_cache, entry, tmp) {
+    HASH_DEL(env->query_cache, entry);
+    free_query_cache_entry(entry);
+  }
+}
+
+/**
+ * count-min sketchの各行で用いる、トークンIDのハッシュ値を計算する。
+ * @param[in] token_id トークンID
+ * @param[in] row sketchの行
+ * @return sketchの列
+ */
+static inline unsigned int
+postings_cache_sketch_index(int token_id, int row)
+{
+  static const uint32_t seeds[POSTINGS_CACHE_SKETCH_DEPTH] = {
+    0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+  };
+  uint32_t h = (uint32_t)token_id * seeds[row];
+  return (h ^ (h >> 16)) % POSTINGS_CACHE_SKETCH_WIDTH;
+}
+
+/**
+ * トークンの参照頻度を数える。
+ * 一定回数数えるごとに全体を半減させ、最近の頻度を重視する。
+ * @param[in] cache ポスティングリストのキャッシュ
+ * @param[in] token_id トークンID
+ */
+static void
+postings_cache_count(postings_cache *cache, int token_id)
+{
+  int row;
+
+  for (row = 0; row < POSTINGS_CACHE_SKETCH_DEPTH; row++) {
+    unsigned char *c =
+      &cache->sketch[row][postings_cache_sketch_index(token_id, row)];
+    if (*c < UCHAR_MAX) { (*c)++; }
+  }
+  if (++cache->sketch_additions >= POSTINGS_CACHE_SKETCH_WIDTH * 10) {
+    int col;
+    for (row = 0; row < POSTINGS_CACHE_SKETCH_DEPTH; row++) {
+      for (col = 0; col < POSTINGS_CACHE_SKETCH_WIDTH; col++) {
+        cache->sketch[row][col] >>= 1;
+      }
+    }
+    cache->sketch_additions = 0;
+  }
+}
+
+/**
+ * トークンの参照頻度の推定値を取得する。
+ * @param[in] cache ポスティングリストのキャッシュ
+ * @param[in] token_id トークンID
+ * @return 参照頻度の推定値
+ */
+static int
+postings_cache_frequency(const postings_cache *cache, int token_id)
+{
+  int row, freq = UCHAR_MAX;
+
+  for (row = 0; row < POSTINGS_CACHE_SKETCH_DEPTH; row++) {
+    int c = cache->sketch[row][postings_cache_sketch_index(token_id, row)];
+    if (c < freq) { freq = c; }
+  }
+  return freq;
+}
+
+/**
+ * キャッシュのエントリを開放する。
+ * @param[in] entry 開放するエントリ
+ */
+static void
+free_postings_cache_entry(postings_cache_entry *entry)
+{
+  free_postings_list(entry->postings);
+  if (entry->entries) { free(entry->entries); }
+  if (entry->document_ids) { free(entry->document_ids); }
+  if (entry->blocks) { free(entry->blocks); }
+  free(entry);
+}
+
+/**
+ * キャッシュのエントリを取り除いて開放する。
+ * @param[in] cache ポスティングリストのキャッシュ
+ * @param[in] entry 開放するエントリ
+ */
+static void
+remove_postings_cache_entry(postings_cache *cache,
+                            postings_cache_entry *entry)
+{
+  HASH_DEL(cache->entries, entry);
+  cache->size -= entry->size;
+  free_postings_cache_entry(entry);
+}
+
+/**
+ * キャッシュのエントリを追い出す。
+ * 検索中のカーソルが参照しているかもしれないので、開放は次の検索まで待つ。
+ * @param[in] cache ポスティングリストのキャッシュ
+ * @param[in] entry 追い出すエントリ
+ */
+static void
+evict_postings_cache_entry(postings_cache *cache,
+                           postings_cache_entry *entry)
+{
+  HASH_DEL(cache->entries, entry);
+  cache->size -= entry->size;
+  LL_PREPEND(cache->evicted, entry);
+}
+
+/**
+ * 追い出されたエントリを開放する。
+ * @param[in] cache ポスティングリストのキャッシュ
+ */
+static void
+free_evicted_postings_cache_entries(postings_cache *cache)
+{
+  postings_cache_entry *entry, *tmp;
+  LL_FOREACH_SAFE(cache->evicted, entry, tmp) {
+    LL_DELETE(cache->evicted, entry);
+    free_postings_cache_entry(entry);
+  }
+}
+
+/**
+ * キャッシュのエントリをすべて開放する。
+ * @param[in] cache ポスティングリストのキャッシュ
+ */
+static void
+clear_postings_cache(postings_cache *cache)
+{
+  postings_cache_entry *entry, *tmp;
+  HASH_ITER(hh, cache->entries, entry, tmp) {
+    remove_postings_cache_entry(cache, entry);
+  }
+  free_evicted_postings_cache_entries(cache);
+}
+
+/**
+ * デコード済みのポスティングリストが使用するバイト数を計算する。
+ * @param[in] postings ポスティングリスト
+ * @param[in] postings_len ポスティングリストのエントリ数
+ * @param[in] blocks_count ブロックの数
+ * @return バイト数
+ */
+static size_t
+postings_cache_entry_size(const postings_list *postings, int postings_len,
+                          int blocks_count)
+{
+  size_t size = sizeof(postings_cache_entry) +
+                (sizeof(postings_list *) + sizeof(int)) * postings_len +
+                sizeof(postings_block) * blocks_count;
+  const postings_list *p;
+  LL_FOREACH(postings, p) {
+    size += sizeof(postings_list) + sizeof(UT_array) +
+            p->positions->n * p->positions->icd.sz;
+  }
+  return size;
+}
+
+/**
+ * 検索を始める前に、前回の検索中に追い出されたエントリを開放する。
+ * また、インデックスの世代が変わっていれば、キャッシュを空にする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] generation 現在のインデックスの世代
+ */
+void
+validate_postings_cache(wiser_env *env, long long generation)
+{
+  postings_cache *cache = &env->postings_cache;
+  free_evicted_postings_cache_entries(cache);
+  if (cache->generation != generation) {
+    clear_postings_cache(cache);
+    cache->generation = generation;
+  }
+}
+
+/**
+ * キャッシュを経由して、特定のトークンのポスティングリストを取得する。
+ * キャッシュにない場合はDBから取得し、TinyLFUにより、
+ * 追い出されるエントリより参照頻度が高いと推定される場合のみキャッシュする。
+ * キャッシュするポスティングリストは、各要素を指す配列と文書IDの配列も
+ * 合わせて保持し、検索のたびに作り直さずに済むようにする。
+ * キャッシュされたポスティングリストは、呼び出し側で変更・開放してはならない。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] token_id 取得するトークンのID
+ * @param[out] postings 取得したポスティングリスト
+ * @param[out] postings_len 取得したポスティングリストのエントリ数。NULL指定可。
+ * @param[out] entries ポスティングリストの各要素を指す配列。
+ *                     キャッシュされていない場合はNULL
+ * @param[out] document_ids ポスティングリストの各要素の文書IDの配列。
+ *                          キャッシュされていない場合はNULL
+ * @param[out] blocks 取得したブロックごとの情報
+ * @param[out] blocks_count 取得したブロックの数
+ * @param[out] cached 取得したものがキャッシュに所有されているかどうか
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+fetch_cached_postings(wiser_env *env, const int token_id,
+                      postings_list **postings, int *postings_len,
+                      postings_list ***entries, int **document_ids,
+                      postings_block **blocks, int *blocks_count,
+                      int *cached)
+{
+  int i, len, freq;
+  size_t size;
+  postings_cache *cache = &env->postings_cache;
+  postings_cache_entry *entry;
+  postings_list *p;
+
+  *cached = FALSE;
+  *entries = NULL;
+  *document_ids = NULL;
+  if (!cache->budget) {
+    return fetch_postings(env, token_id, postings, postings_len,
+                          blocks, blocks_count);
+  }
+
+  postings_cache_count(cache, token_id);
+  HASH_FIND_INT(cache->entries, &token_id, entry);
+  if (entry) {
+    /* 最も新しく参照されたエントリとして並べ直す */
+    HASH_DEL(cache->entries, entry);
+    HASH_ADD_INT(cache->entries, token_id, entry);
+    cache->hits++;
+    *postings = entry->postings;
+    if (postings_len) { *postings_len = entry->postings_len; }
+    *entries = entry->entries;
+    *document_ids = entry->document_ids;
+    *blocks = entry->blocks;
+    *blocks_count = entry->blocks_count;
+    *cached = TRUE;
+    return 0;
+  }
+  cache->misses++;
+
+  if (fetch_postings(env, token_id, postings, &len, blocks, blocks_count)) {
+    return -1;
+  }
+  if (postings_len) { *postings_len = len; }
+  if (!*postings) { return 0; }
+
+  size = postings_cache_entry_size(*postings, len, *blocks_count);
+  if (size > cache->budget) { return 0; }
+  freq = postings_cache_frequency(cache, token_id);
+  /* ハッシュの先頭から順に、最も古く参照されたエントリを追い出す。
+     追い出すエントリをすべて確かめてから追い出し、途中でキャッシュしないと
+     決まった場合に、エントリを無駄に追い出さないようにする */
+  {
+    size_t freed = 0;
+    postings_cache_entry *victim;
+    for (victim = cache->entries;
+         cache->size - freed + size > cache->budget;
+         victim = victim->hh.next) {
+      if (freq <= postings_cache_frequency(cache, victim->token_id)) {
+        /* 追い出すエントリの方がよく参照されているので、キャッシュしない */
+        return 0;
+      }
+      freed += victim->size;
+    }
+  }
+  while (cache->size + size > cache->budget) {
+    evict_postings_cache_entry(cache, cache->entries);
+  }
+  if (!(entry = malloc(sizeof(postings_cache_entry)))) { return 0; }
+  if (!(entry->entries = malloc(sizeof(postings_list *) * len)) ||
+      !(entry->document_ids = malloc(sizeof(int) * len))) {
+    if (entry->entries) { free(entry->entries); }
+    free(entry);
+    return 0;
+  }
+  i = 0;
+  LL_FOREACH(*postings, p) {
+    entry->entries[i] = p;
+    entry->document_ids[i] = p->document_id;
+    i++;
+  }
+  entry->token_id = token_id;
+  entry->postings = *postings;
+  entry->postings_len = len;
+  entry->blocks = *blocks;
+  entry->blocks_count = *blocks_count;
+  entry->size = size;
+  HASH_ADD_INT(cache->entries, token_id, entry);
+  cache->size += size;
+  *entries = entry->entries;
+  *document_ids = entry->document_ids;
+  *cached = TRUE;
+  return 0;
+}
+
+/**
+ * 特定のトークンのポスティングリストを、キャッシュから取り除く。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] token_id トークンID
+ */
+void
+invalidate_cached_postings(wiser_env *env, const int token_id)
+{
+  postings_cache_entry *entry;
+  HASH_FIND_INT(env->postings_cache.entries, &token_id, entry);
+  if (entry) {
+    remove_postings_cache_entry(&env->postings_cache, entry);
+  }
+}
+
+/**
+ * ポスティングリストのキャッシュを破棄する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+void
+fin_postings_cache(wiser_env *env)
+{
+  clear_postings_cache(&env->postings_cache);
+}
@@ -0,0 +1,26 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "wiser.h"
+
+/* インデックスの世代を保存する設定項目名 */
+#define INDEX_GENERATION_KEY "index_generation"
+
+long long get_index_generation(wiser_env *env);
+char *make_query_cache_key(arena *a, const wiser_env *env, const char *query);
+const query_cache_entry *get_query_cache(wiser_env *env, const char *key,
+                                         long long generation);
+void put_query_cache(wiser_env *env, const char *key, long long generation,
+                     const search_result_entry *results, int results_count,
+                     int total_count, int count_is_lower_bound);
+void fin_query_cache(wiser_env *env);
+void validate_postings_cache(wiser_env *env, long long generation);
+int fetch_cached_postings(wiser_env *env, const int token_id,
+                          postings_list **postings, int *postings_len,
+                          postings_list ***entries, int **document_ids,
+                          postings_block **blocks, int *blocks_count,
+                          int *cached);
+void invalidate_cached_postings(wiser_env *env, const int token_id);
+void fin_postings_cache(wiser_env *env);
+
+#endif /* __CACHE_H__ */
@@ -1,6 +1,9 @@
+#include <stdio.h>
 #include "util.h"
 #include "database.h"
 
+#define DATABASE_BUSY_TIMEOUT 10000 /* ロックの解放を待つ最大ミリ秒数 */
+
 /**
  * データーベースを初期化する
  * @param[in] env 環境
@@ -12,10 +15,15 @@ int
 init_database(wiser_env *env, const char *db_path)
 {
   int rc;
-  if ((rc = sqlite3_open(db_path, &env->db))) {
+  /* 書き出しスレッドと接続を共有するため、serializedモードで開く */
+  if ((rc = sqlite3_open_v2(db_path, &env->db,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                            SQLITE_OPEN_FULLMUTEX, NULL))) {
     print_error("cannot open databases.");
     return rc;
   }
+  /* 中断されたプロセスのロックが残っている間は、解放されるまで待つ */
+  sqlite3_busy_timeout(env->db, DATABASE_BUSY_TIMEOUT);
 
   sqlite3_exec(env->db,
                "CREATE TABLE settings (" \
@@ -37,7 +45,34 @@ init_database(wiser_env *env, const char *db_path)
                "  id         INTEGER PRIMARY KEY," \
                "  token      TEXT NOT NULL," \
                "  docs_count INT NOT NULL," \
-               "  postings   BLOB NOT NULL" \
+               "  postings   BLOB NOT NULL," \
+               "  blocks     BLOB" /* ブロックごとの情報と読み込み位置 */ \
+               ");",
+               NULL, NULL, NULL);
+  /* ブロックごとの情報を持たない古いデータベースには、列を追加する。
+     すでに列がある場合は、エラーとなり何もしない */
+  sqlite3_exec(env->db,
+               "ALTER TABLE tokens ADD COLUMN blocks BLOB;",
+               NULL, NULL, NULL);
+
+  sqlite3_exec(env->db,
+               "CREATE TABLE document_lengths (" \
+               "  id      INTEGER PRIMARY KEY," /* 文書IDをチャンクの大きさで割った値 */ \
+               "  lengths BLOB NOT NULL" /* 文書IDごとの文書長の配列 */ \
+               ");",
+               NULL, NULL, NULL);
+
+  sqlite3_exec(env->db,
+               "CREATE TABLE document_offsets (" \
+               "  id      INTEGER PRIMARY KEY," /* 文書ID */ \
+               "  offsets BLOB NOT NULL" /* 一定トークンごとのバイト位置の配列 */ \
+               ");",
+               NULL, NULL, NULL);
+
+  sqlite3_exec(env->db,
+               "CREATE TABLE impacts (" \
+               "  id       INTEGER PRIMARY KEY," /* トークンID */ \
+               "  segments BLOB NOT NULL" /* インパクト順のポスティングリスト */ \
                ");",
                NULL, NULL, NULL);
 
@@ -55,6 +90,20 @@ init_database(wiser_env *env, const char *db_path)
   sqlite3_prepare(env->db,
                   "SELECT title FROM documents WHERE id = ?;",
                   -1, &env->get_document_title_st, NULL);
+  {
+    /* IN句に、DOCUMENT_TITLES_BATCH_SIZE個のパラメータを並べる */
+    int i, len;
+    char sql[64 + DOCUMENT_TITLES_BATCH_SIZE * 2];
+    len = sprintf(sql, "SELECT id, title FROM documents WHERE id IN (?");
+    for (i = 1; i < DOCUMENT_TITLES_BATCH_SIZE; i++) {
+      len += sprintf(sql + len, ",?");
+    }
+    strcpy(sql + len, ");");
+    sqlite3_prepare(env->db, sql, -1, &env->get_document_titles_st, NULL);
+  }
+  sqlite3_prepare(env->db,
+                  "SELECT body FROM documents WHERE id = ?;",
+                  -1, &env->get_document_body_st, NULL);
   sqlite3_prepare(env->db,
                   "INSERT INTO documents (title, body) VALUES (?, ?);",
                   -1, &env->insert_document_st, NULL);
@@ -72,10 +121,11 @@ init_database(wiser_env *env, const char *db_path)
                   " VALUES (?, 0, ?);",
                   -1, &env->store_token_st, NULL);
   sqlite3_prepare(env->db,
-                  "SELECT docs_count, postings FROM tokens WHERE id = ?;",
+                  "SELECT docs_count, postings, blocks FROM tokens WHERE id = ?;",
                   -1, &env->get_postings_st, NULL);
   sqlite3_prepare(env->db,
-                  "UPDATE tokens SET docs_count = ?, postings = ? WHERE id = ?;",
+                  "UPDATE tokens SET docs_count = ?, postings = ?, blocks = ?"
+                  " WHERE id = ?;",
                   -1, &env->update_postings_st, NULL);
   sqlite3_prepare(env->db,
                   "SELECT value FROM settings WHERE key = ?;",
@@ -83,9 +133,32 @@ init_database(wiser_env *env, const char *db_path)
   sqlite3_prepare(env->db,
                   "INSERT OR REPLACE INTO settings (key, value) VALUES (?, ?);",
                   -1, &env->replace_settings_st, NULL);
+  sqlite3_prepare(env->db,
+                  "SELECT id, lengths FROM document_lengths;",
+                  -1, &env->get_document_lengths_st, NULL);
+  sqlite3_prepare(env->db,
+                  "INSERT OR REPLACE INTO document_lengths (id, lengths)"
+                  " VALUES (?, ?);",
+                  -1, &env->replace_document_lengths_st, NULL);
+  sqlite3_prepare(env->db,
+                  "SELECT offsets FROM document_offsets WHERE id = ?;",
+                  -1, &env->get_document_offsets_st, NULL);
+  sqlite3_prepare(env->db,
+                  "INSERT OR REPLACE INTO document_offsets (id, offsets)"
+                  " VALUES (?, ?);",
+                  -1, &env->replace_document_offsets_st, NULL);
+  sqlite3_prepare(env->db,
+                  "INSERT OR REPLACE INTO impacts (id, segments) VALUES (?, ?);",
+                  -1, &env->replace_impacts_st, NULL);
+  sqlite3_prepare(env->db,
+                  "SELECT MAX(id) FROM tokens;",
+                  -1, &env->get_max_token_id_st, NULL);
   sqlite3_prepare(env->db,
                   "SELECT COUNT(*) FROM documents;",
                   -1, &env->get_document_count_st, NULL);
+  sqlite3_prepare(env->db,
+                  "PRAGMA data_version;",
+                  -1, &env->get_data_version_st, NULL);
   sqlite3_prepare(env->db,
                   "BEGIN;",
                   -1, &env->begin_st, NULL);
@@ -107,6 +180,8 @@ fin_database(wiser_env *env)
 {
   sqlite3_finalize(env->get_document_id_st);
   sqlite3_finalize(env->get_document_title_st);
+  sqlite3_finalize(env->get_document_titles_st);
+  sqlite3_finalize(env->get_document_body_st);
   sqlite3_finalize(env->insert_document_st);
   sqlite3_finalize(env->update_document_st);
   sqlite3_finalize(env->get_token_id_st);
@@ -116,7 +191,14 @@ fin_database(wiser_env *env)
   sqlite3_finalize(env->update_postings_st);
   sqlite3_finalize(env->get_settings_st);
   sqlite3_finalize(env->replace_settings_st);
+  sqlite3_finalize(env->get_document_lengths_st);
+  sqlite3_finalize(env->replace_document_lengths_st);
+  sqlite3_finalize(env->get_document_offsets_st);
+  sqlite3_finalize(env->replace_document_offsets_st);
+  sqlite3_finalize(env->replace_impacts_st);
+  sqlite3_finalize(env->get_max_token_id_st);
   sqlite3_finalize(env->get_document_count_st);
+  sqlite3_finalize(env->get_data_version_st);
   sqlite3_finalize(env->begin_st);
   sqlite3_finalize(env->commit_st);
   sqlite3_finalize(env->rollback_st);
@@ -176,6 +258,79 @@ db_get_document_title(const wiser_env *env, int document_id,
   return 0;
 }
 
+/**
+ * 複数の文書のタイトルを、1回の問い合わせでまとめて取得する。
+ * @param[in] env 環境
+ * @param[in] document_ids 文書IDの配列
+ * @param[in] n 文書IDの数。DOCUMENT_TITLES_BATCH_SIZE以下
+ * @param[out] titles document_idsと同じ順の、文書のタイトル。
+ *                    見つからない文書はNULL。呼び出し側で開放する
+ * @param[out] title_sizes タイトルのバイト数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_get_document_titles(const wiser_env *env, const int *document_ids,
+                       int n, char **titles, int *title_sizes)
+{
+  int i, rc;
+  sqlite3_stmt *st = env->get_document_titles_st;
+
+  sqlite3_reset(st);
+  /* 使わないパラメータはNULLとなり、どの文書にも一致しない */
+  sqlite3_clear_bindings(st);
+  for (i = 0; i < n; i++) {
+    titles[i] = NULL;
+    title_sizes[i] = 0;
+    sqlite3_bind_int(st, i + 1, document_ids[i]);
+  }
+  while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+    int id = sqlite3_column_int(st, 0);
+    const char *title = (const char *)sqlite3_column_text(st, 1);
+    int title_size = sqlite3_column_bytes(st, 1);
+    for (i = 0; i < n; i++) {
+      if (document_ids[i] == id && !titles[i] &&
+          (titles[i] = malloc(title_size + 1))) {
+        memcpy(titles[i], title, title_size);
+        titles[i][title_size] = '\0';
+        title_sizes[i] = title_size;
+      }
+    }
+  }
+  return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/**
+ * 指定の文書IDを持つ文書の本文を取得する。
+ * @param[in] env 環境
+ * @param[in] document_id 文書ID
+ * @param[out] body 文書の本文
+ * @param[out] body_size 文書の本文のバイト長
+ */
+int
+db_get_document_body(const wiser_env *env, int document_id,
+                     const char **body, int *body_size)
+{
+  int rc;
+
+  sqlite3_reset(env->get_document_body_st);
+  sqlite3_bind_int(env->get_document_body_st, 1, document_id);
+
+  rc = sqlite3_step(env->get_document_body_st);
+  if (rc == SQLITE_ROW) {
+    if (body) {
+      *body = (const char *)sqlite3_column_text(env->get_document_body_st, 0);
+    }
+    if (body_size) {
+      *body_size = (int)sqlite3_column_bytes(env->get_document_body_st, 0);
+    }
+    return 0;
+  }
+  if (body) { *body = NULL; }
+  if (body_size) { *body_size = 0; }
+  return -1;
+}
+
 /**
  * documentsテーブルに、文書を登録する。
  * @param[in] env 環境
@@ -290,10 +445,13 @@ db_get_token(const wiser_env *env,
  * @param[out] docs_count 文書数
  * @param[out] postings 取得されたpostings list
  * @param[out] postings_size postings listのバイト長
+ * @param[out] blocks 取得されたブロックごとの情報
+ * @param[out] blocks_size ブロックごとの情報のバイト長
  */
 int
 db_get_postings(const wiser_env *env, int token_id,
-                int *docs_count, void **postings, int *postings_size)
+                int *docs_count, void **postings, int *postings_size,
+                void **blocks, int *blocks_size)
 {
   int rc;
   sqlite3_reset(env->get_postings_st);
@@ -309,16 +467,123 @@ db_get_postings(const wiser_env *env, int token_id,
     if (postings_size) {
       *postings_size = (int)sqlite3_column_bytes(env->get_postings_st, 1);
     }
+    if (blocks) {
+      *blocks = (void *)sqlite3_column_blob(env->get_postings_st, 2);
+    }
+    if (blocks_size) {
+      *blocks_size = (int)sqlite3_column_bytes(env->get_postings_st, 2);
+    }
     rc = 0;
   } else {
     if (docs_count) { *docs_count = 0; }
     if (postings) { *postings = NULL; }
     if (postings_size) { *postings_size = 0; }
+    if (blocks) { *blocks = NULL; }
+    if (blocks_size) { *blocks_size = 0; }
     if (rc == SQLITE_DONE) { rc = 0; } /* no record found */
   }
   return rc;
 }
 
+/**
+ * postings listを、全体を読み込まずに少しずつ読み出すために開く。
+ * @param[in] env 環境
+ * @param[in] token_id トークンID
+ * @param[out] blob 開いたpostings list。db_close_postingsで閉じる
+ * @param[out] size postings listのバイト長
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_open_postings(const wiser_env *env, int token_id,
+                 sqlite3_blob **blob, int *size)
+{
+  if (sqlite3_blob_open(env->db, "main", "tokens", "postings", token_id, 0,
+                        blob) != SQLITE_OK) {
+    print_error("cannot open postings: %d", token_id);
+    *blob = NULL;
+    return -1;
+  }
+  *size = sqlite3_blob_bytes(*blob);
+  return 0;
+}
+
+/**
+ * ブロックごとの情報と読み込み位置を、少しずつ読み出すために開く。
+ * @param[in] env 環境
+ * @param[in] token_id トークンID
+ * @param[out] blob 開いたバイト列。db_close_postingsで閉じる
+ * @param[out] size バイト列のバイト長
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_open_postings_blocks(const wiser_env *env, int token_id,
+                        sqlite3_blob **blob, int *size)
+{
+  if (sqlite3_blob_open(env->db, "main", "tokens", "blocks", token_id, 0,
+                        blob) != SQLITE_OK) {
+    *blob = NULL;
+    return -1;
+  }
+  *size = sqlite3_blob_bytes(*blob);
+  return 0;
+}
+
+/**
+ * 開いたpostings listの一部を読み出す。
+ * @param[in] blob db_open_postingsかdb_open_postings_blocksで開いたバイト列
+ * @param[in] offset 読み出しを始めるバイト位置
+ * @param[in] size 読み出すバイト数
+ * @param[out] buf 読み出した内容を格納するバッファ
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_read_postings(sqlite3_blob *blob, int offset, int size, void *buf)
+{
+  return (sqlite3_blob_read(blob, buf, size, offset) == SQLITE_OK) ? 0 : -1;
+}
+
+/**
+ * db_open_postingsかdb_open_postings_blocksで開いたバイト列を閉じる。
+ * @param[in] blob 閉じるバイト列
+ */
+void
+db_close_postings(sqlite3_blob *blob)
+{
+  sqlite3_blob_close(blob);
+}
+
+/**
+ * トークンのブロックごとの情報を、postings listを読み込まずに取得する。
+ * @param[in] env 環境
+ * @param[in] token_id トークンID
+ * @param[out] buf 取得した内容を格納するバッファ
+ * @param[in] size ブロックごとの情報のバイト長
+ * @retval 0 成功
+ * @retval -1 ブロックごとの情報がないか、バイト長が足りない
+ */
+int
+db_read_postings_blocks(const wiser_env *env, int token_id, void *buf,
+                        int size)
+{
+  int rc = -1;
+  sqlite3_blob *blob;
+
+  if (sqlite3_blob_open(env->db, "main", "tokens", "blocks", token_id, 0,
+                        &blob) != SQLITE_OK) {
+    return -1;
+  }
+  /* 後ろに続く読み込み位置は読まない */
+  if (size <= sqlite3_blob_bytes(blob) &&
+      sqlite3_blob_read(blob, buf, size, 0) == SQLITE_OK) {
+    rc = 0;
+  }
+  sqlite3_blob_close(blob);
+  return rc;
+}
+
 /**
  * データベースにpostings listを保存する。
  * @param[in] env 環境
@@ -326,17 +591,22 @@ db_get_postings(const wiser_env *env, int token_id,
  * @param[in] docs_count 文書数
  * @param[in] postings 保存するpostings list
  * @param[in] postings_size postings listのバイト長
+ * @param[in] blocks 保存するブロックごとの情報
+ * @param[in] blocks_size ブロックごとの情報のバイト長
  */
 int
 db_update_postings(const wiser_env *env, int token_id, int docs_count,
-                   void *postings, int postings_size)
+                   void *postings, int postings_size,
+                   void *blocks, int blocks_size)
 {
   int rc;
   sqlite3_reset(env->update_postings_st);
   sqlite3_bind_int(env->update_postings_st, 1, docs_count);
   sqlite3_bind_blob(env->update_postings_st, 2, postings,
                     (unsigned int)postings_size, SQLITE_STATIC);
-  sqlite3_bind_int(env->update_postings_st, 3, token_id);
+  sqlite3_bind_blob(env->update_postings_st, 3, blocks,
+                    (unsigned int)blocks_size, SQLITE_STATIC);
+  sqlite3_bind_int(env->update_postings_st, 4, token_id);
 query:
   rc = sqlite3_step(env->update_postings_st);
 
@@ -417,6 +687,278 @@ query:
   return rc;
 }
 
+/**
+ * データベースから、文書IDごとの文書長の配列を取得する。
+ * @param[in] env 環境
+ * @param[out] lengths 文書IDを添字とする文書長の配列。呼び出し側で開放する。
+ * @param[out] lengths_count 配列の要素数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_get_document_lengths(const wiser_env *env,
+                        int **lengths, int *lengths_count)
+{
+  int rc;
+
+  *lengths = NULL;
+  *lengths_count = 0;
+  sqlite3_reset(env->get_document_lengths_st);
+  while ((rc = sqlite3_step(env->get_document_lengths_st)) == SQLITE_ROW) {
+    int chunk_id, size, count;
+    const void *chunk;
+
+    chunk_id = sqlite3_column_int(env->get_document_lengths_st, 0);
+    chunk = sqlite3_column_blob(env->get_document_lengths_st, 1);
+    size = sqlite3_column_bytes(env->get_document_lengths_st, 1);
+    if (chunk_id < 0 || size > sizeof(int) * DOCUMENT_LENGTHS_CHUNK_SIZE) {
+      print_error("invalid document lengths chunk(%d).", chunk_id);
+      continue;
+    }
+    count = (chunk_id + 1) * DOCUMENT_LENGTHS_CHUNK_SIZE;
+    if (count > *lengths_count) {
+      int *l;
+      if (!(l = realloc(*lengths, sizeof(int) * count))) {
+        print_error("cannot allocate memory for document lengths.");
+        free(*lengths);
+        *lengths = NULL;
+        *lengths_count = 0;
+        return -1;
+      }
+      memset(l + *lengths_count, 0, sizeof(int) * (count - *lengths_count));
+      *lengths = l;
+      *lengths_count = count;
+    }
+    memcpy(*lengths + chunk_id * DOCUMENT_LENGTHS_CHUNK_SIZE, chunk, size);
+  }
+  return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/**
+ * データベースに、文書IDごとの文書長の配列の1チャンク分を上書き保存する。
+ * @param[in] env 環境
+ * @param[in] chunk_id 文書IDをDOCUMENT_LENGTHS_CHUNK_SIZEで割った値
+ * @param[in] lengths チャンクの先頭の文書から始まる文書長の配列
+ * @param[in] lengths_count 配列の要素数
+ */
+int
+db_replace_document_lengths(const wiser_env *env, int chunk_id,
+                            const int *lengths, int lengths_count)
+{
+  int rc;
+  sqlite3_reset(env->replace_document_lengths_st);
+  sqlite3_bind_int(env->replace_document_lengths_st, 1, chunk_id);
+  sqlite3_bind_blob(env->replace_document_lengths_st, 2, lengths,
+                    sizeof(int) * lengths_count, SQLITE_STATIC);
+query:
+  rc = sqlite3_step(env->replace_document_lengths_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc;
+}
+
+/**
+ * 文書中のトークンの位置とバイト位置の対応を保存する。
+ * @param[in] env 環境
+ * @param[in] document_id 文書ID
+ * @param[in] offsets POSITION_CHECKPOINT_INTERVALトークンごとのバイト位置の配列
+ * @param[in] offsets_count offsetsの要素数
+ * @return sqlite3のエラーコード
+ */
+int
+db_replace_document_offsets(const wiser_env *env, int document_id,
+                            const int *offsets, int offsets_count)
+{
+  int rc;
+  sqlite3_reset(env->replace_document_offsets_st);
+  sqlite3_bind_int(env->replace_document_offsets_st, 1, document_id);
+  sqlite3_bind_blob(env->replace_document_offsets_st, 2, offsets,
+                    sizeof(int) * offsets_count, SQLITE_STATIC);
+query:
+  rc = sqlite3_step(env->replace_document_offsets_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc;
+}
+
+/**
+ * 文書中のトークンの位置とバイト位置の対応を取得する。
+ * 取得した配列は、次にこの関数を呼ぶまで有効。
+ * @param[in] env 環境
+ * @param[in] document_id 文書ID
+ * @param[out] offsets POSITION_CHECKPOINT_INTERVALトークンごとのバイト位置の配列
+ * @param[out] offsets_count offsetsの要素数
+ * @retval 0 成功
+ * @retval -1 文書の記録がない
+ */
+int
+db_get_document_offsets(const wiser_env *env, int document_id,
+                        const int **offsets, int *offsets_count)
+{
+  sqlite3_reset(env->get_document_offsets_st);
+  sqlite3_bind_int(env->get_document_offsets_st, 1, document_id);
+  if (sqlite3_step(env->get_document_offsets_st) != SQLITE_ROW) {
+    *offsets = NULL;
+    *offsets_count = 0;
+    return -1;
+  }
+  *offsets = sqlite3_column_blob(env->get_document_offsets_st, 0);
+  *offsets_count = sqlite3_column_bytes(env->get_document_offsets_st, 0) /
+                   sizeof(int);
+  return 0;
+}
+
+/**
+ * 文書の本文の一部を、本文全体を読み込まずに取得する。
+ * @param[in] env 環境
+ * @param[in] document_id 文書ID
+ * @param[in] offset 取得を始めるバイト位置
+ * @param[in] size 取得するバイト数。負の場合は本文の末尾まで
+ * @param[out] body 取得した本文。呼び出し側で開放する
+ * @param[out] body_size 取得した本文のバイト数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+db_read_document_body(const wiser_env *env, int document_id, int offset,
+                      int size, char **body, int *body_size)
+{
+  int rc = -1, total;
+  sqlite3_blob *blob;
+
+  *body = NULL;
+  if (sqlite3_blob_open(env->db, "main", "documents", "body", document_id, 0,
+                        &blob) != SQLITE_OK) {
+    return -1;
+  }
+  total = sqlite3_blob_bytes(blob);
+  if (offset > total) { offset = total; }
+  if (size < 0 || size > total - offset) { size = total - offset; }
+  if (!(*body = malloc(size + 1))) {
+    print_error("cannot allocate memory for document body.");
+  } else if (sqlite3_blob_read(blob, *body, size, offset) != SQLITE_OK) {
+    print_error("cannot read document body: %d", document_id);
+    free(*body);
+    *body = NULL;
+  } else {
+    (*body)[size] = '\0';
+    *body_size = size;
+    rc = 0;
+  }
+  sqlite3_blob_close(blob);
+  return rc;
+}
+
+/**
+ * トークンのインパクト順のポスティングリストを保存する。
+ * @param[in] env 環境
+ * @param[in] token_id トークンID
+ * @param[in] segments 保存するインパクト順のポスティングリスト
+ * @param[in] segments_size segmentsのバイト長
+ * @return sqlite3のエラーコード
+ */
+int
+db_replace_impacts(const wiser_env *env, int token_id,
+                   const void *segments, int segments_size)
+{
+  int rc;
+  sqlite3_reset(env->replace_impacts_st);
+  sqlite3_bind_int(env->replace_impacts_st, 1, token_id);
+  sqlite3_bind_blob(env->replace_impacts_st, 2, segments,
+                    (unsigned int)segments_size, SQLITE_STATIC);
+query:
+  rc = sqlite3_step(env->replace_impacts_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc;
+}
+
+/**
+ * トークンのインパクト順のポスティングリストの一部を、全体を読み込まずに取得する。
+ * @param[in] env 環境
+ * @param[in] token_id トークンID
+ * @param[in] offset 取得を始めるバイト位置
+ * @param[in] size 取得するバイト数
+ * @param[out] buf 取得した内容を格納するバッファ
+ * @retval 0 成功
+ * @retval -1 インパクト順のポスティングリストがないか、範囲外
+ */
+int
+db_read_impacts(const wiser_env *env, int token_id, int offset, int size,
+                void *buf)
+{
+  int rc = -1;
+  sqlite3_blob *blob;
+
+  if (sqlite3_blob_open(env->db, "main", "impacts", "segments", token_id, 0,
+                        &blob) != SQLITE_OK) {
+    return -1;
+  }
+  if (offset + size <= sqlite3_blob_bytes(blob) &&
+      sqlite3_blob_read(blob, buf, size, offset) == SQLITE_OK) {
+    rc = 0;
+  }
+  sqlite3_blob_close(blob);
+  return rc;
+}
+
+/**
+ * すべてのインパクト順のポスティングリストを削除する。
+ * @param[in] env 環境
+ * @return sqlite3のエラーコード
+ */
+int
+db_clear_impacts(const wiser_env *env)
+{
+  return sqlite3_exec(env->db, "DELETE FROM impacts;", NULL, NULL, NULL);
+}
+
+/**
+ * データベースに登録されたトークンIDの最大値を取得する。
+ * @param[in] env 環境
+ * @return トークンIDの最大値。トークンがない場合は0
+ */
+int
+db_get_max_token_id(const wiser_env *env)
+{
+  int rc;
+
+  sqlite3_reset(env->get_max_token_id_st);
+  rc = sqlite3_step(env->get_max_token_id_st);
+  if (rc == SQLITE_ROW) {
+    return sqlite3_column_int(env->get_max_token_id_st, 0);
+  } else {
+    return -1;
+  }
+}
+
 /**
  * データベースに登録された文書数を取得する。
  * @param[in] env 環境
@@ -435,6 +977,43 @@ db_get_document_count(const wiser_env *env)
   }
 }
 
+/**
+ * データベースのdata_versionを取得する。
+ * 他の接続がデータベースを更新してcommitするたびに値が変わる。
+ * @param[in] env 環境
+ * @return data_version。取得できなかった場合は-1
+ */
+int
+db_get_data_version(const wiser_env *env)
+{
+  int rc;
+
+  sqlite3_reset(env->get_data_version_st);
+  rc = sqlite3_step(env->get_data_version_st);
+  if (rc == SQLITE_ROW) {
+    return sqlite3_column_int(env->get_data_version_st, 0);
+  } else {
+    return -1;
+  }
+}
+
+/**
+ * 実行中のままのステートメントをすべてリセットする。
+ * 読み込み途中のステートメントが残っていると、読み込みのトランザクションが
+ * 続き、他の接続による更新が見えない。
+ * ステートメントから取得した値は、これ以降使えなくなる。
+ * @param[in] env 環境
+ */
+void
+db_reset_statements(const wiser_env *env)
+{
+  sqlite3_stmt *st = NULL;
+
+  while ((st = sqlite3_next_stmt(env->db, st))) {
+    if (sqlite3_stmt_busy(st)) { sqlite3_reset(st); }
+  }
+}
+
 /**
  * トランザクションを開始する。
  * @param[in] env 環境
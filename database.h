@@ -11,6 +11,8 @@ int db_get_document_id(const wiser_env *env,
                        const char *title, unsigned int title_size);
 int db_get_document_title(const wiser_env *env, int document_id,
                           const char **const title, int *title_size);
+int db_get_document_body(const wiser_env *env, int document_id,
+                         const char **body, int *body_size);
 int db_add_document(const wiser_env *env,
                     const char *title, unsigned int title_size,
                     const char *body, unsigned int body_size);
@@ -21,17 +23,47 @@ int db_get_token(const wiser_env *env,
                  const int token_id,
                  const char **const token, int *token_size);
 int db_get_postings(const wiser_env *env, int token_id,
-                    int *docs_count, void **postings, int *postings_size);
+                    int *docs_count, void **postings, int *postings_size,
+                    void **blocks, int *blocks_size);
+int db_open_postings(const wiser_env *env, int token_id,
+                     sqlite3_blob **blob, int *size);
+int db_open_postings_blocks(const wiser_env *env, int token_id,
+                            sqlite3_blob **blob, int *size);
+int db_read_postings(sqlite3_blob *blob, int offset, int size, void *buf);
+void db_close_postings(sqlite3_blob *blob);
+int db_get_document_titles(const wiser_env *env, const int *document_ids,
+                           int n, char **titles, int *title_sizes);
+int db_read_postings_blocks(const wiser_env *env, int token_id, void *buf,
+                            int size);
 int db_update_postings(const wiser_env *env, int token_id,
                        int docs_count,
-                       void *postings, int postings_size);
+                       void *postings, int postings_size,
+                       void *blocks, int blocks_size);
 int db_get_settings(const wiser_env *env, const char *key,
                     int key_size,
                     const char **value, int *value_size);
 int db_replace_settings(const wiser_env *env, const char *key,
                         int key_size,
                         const char *value, int value_size);
+int db_get_document_lengths(const wiser_env *env,
+                            int **lengths, int *lengths_count);
+int db_replace_document_lengths(const wiser_env *env, int chunk_id,
+                                const int *lengths, int lengths_count);
+int db_replace_document_offsets(const wiser_env *env, int document_id,
+                                const int *offsets, int offsets_count);
+int db_get_document_offsets(const wiser_env *env, int document_id,
+                            const int **offsets, int *offsets_count);
+int db_read_document_body(const wiser_env *env, int document_id, int offset,
+                          int size, char **body, int *body_size);
+int db_replace_impacts(const wiser_env *env, int token_id,
+                       const void *segments, int segments_size);
+int db_read_impacts(const wiser_env *env, int token_id, int offset, int size,
+                    void *buf);
+int db_clear_impacts(const wiser_env *env);
+int db_get_max_token_id(const wiser_env *env);
 int db_get_document_count(const wiser_env *env);
+int db_get_data_version(const wiser_env *env);
+void db_reset_statements(const wiser_env *env);
 int begin(const wiser_env *env);
 int commit(const wiser_env *env);
 int rollback(const wiser_env *env);
@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "util.h"
+#include "cache.h"
+#include "postings.h"
 #include "database.h"
 
 /**
@@ -17,6 +21,7 @@ decode_postings_none(const char *postings_e, int postings_e_size,
                      postings_list **postings, int *postings_len)
 {
   const int *p, *pend;
+  postings_list **tail = postings;
 
   *postings = NULL;
   *postings_len = 0;
@@ -31,8 +36,11 @@ decode_postings_none(const char *postings_e, int postings_e_size,
       int i;
       pl->document_id = document_id;
       pl->positions_count = positions_count;
+      pl->next = NULL;
       utarray_new(pl->positions, &ut_int_icd);
-      LL_APPEND(*postings, pl);
+      /* 末尾へのポインタを保持して、追加をO(1)で行う */
+      *tail = pl;
+      tail = &pl->next;
       (*postings_len)++;
 
       /* decode positions */
@@ -52,16 +60,26 @@ decode_postings_none(const char *postings_e, int postings_e_size,
  * @param[in] postings ポスティングリスト
  * @param[in] postings_len ポスティングリストのエントリ数
  * @param[out] postings_e 変換されたポスティングリスト
+ * @param[out] offsets ブロックごとの読み込み位置。NULL指定可
  * @retval 0 成功
  */
 static int
 encode_postings_none(const postings_list *postings,
                      const int postings_len,
-                     buffer *postings_e)
+                     buffer *postings_e, postings_block_offset *offsets)
 {
+  int n = 0;
   const postings_list *p;
   LL_FOREACH(postings, p) {
     int *pos = NULL;
+    /* 文書IDと位置情報は、文書ごとに並べて置く */
+    if (offsets && !(n % POSTINGS_BLOCK_SIZE)) {
+      offsets[n / POSTINGS_BLOCK_SIZE].docs_offset =
+        BUFFER_SIZE(postings_e) * 8;
+      offsets[n / POSTINGS_BLOCK_SIZE].positions_offset =
+        BUFFER_SIZE(postings_e);
+    }
+    n++;
     append_buffer(postings_e, (void *)&p->document_id, sizeof(int));
     append_buffer(postings_e, (void *)&p->positions_count, sizeof(int));
     while ((pos = (int *)utarray_next(p->positions, pos))) {
@@ -196,6 +214,7 @@ decode_postings_golomb(const char *postings_e, int postings_e_size,
 {
   const char *pend;
   unsigned char bit;
+  postings_list **tail = postings;
 
   pend = postings_e + postings_e_size;
   bit = 0x80;
@@ -216,8 +235,10 @@ decode_postings_golomb(const char *postings_e, int postings_e_size,
         int gap = golomb_decoding(m, b, t, &postings_e, pend, &bit);
         if ((pl = malloc(sizeof(postings_list)))) {
           pl->document_id = pre_document_id + gap + 1;
+          pl->next = NULL;
           utarray_new(pl->positions, &ut_int_icd);
-          LL_APPEND(*postings, pl);
+          *tail = pl;
+          tail = &pl->next;
           (*postings_len)++;
           pre_document_id = pl->document_id;
         } else {
@@ -251,13 +272,15 @@ decode_postings_golomb(const char *postings_e, int postings_e_size,
  * @param[in] postings 符号化するポスティングリスト
  * @param[in] postings_len 符号化するポスティングリストのエントリ数
  * @param[in] postings_e 符号化されたポスティングリスト
+ * @param[out] offsets ブロックごとの読み込み位置
  * @retval 0 成功
  */
 static int
 encode_postings_golomb(int documents_count,
                        const postings_list *postings, const int postings_len,
-                       buffer *postings_e)
+                       buffer *postings_e, postings_block_offset *offsets)
 {
+  int n = 0;
   const postings_list *p;
 
   append_buffer(postings_e, &postings_len, sizeof(int));
@@ -271,13 +294,25 @@ encode_postings_golomb(int documents_count,
 
       LL_FOREACH(postings, p) {
         int gap = p->document_id - pre_document_id - 1;
+        if (!(n % POSTINGS_BLOCK_SIZE)) {
+          offsets[n / POSTINGS_BLOCK_SIZE].docs_offset =
+            BUFFER_SIZE(postings_e) * 8 + postings_e->bit;
+        }
+        n++;
         golomb_encoding(m, b, t, gap, postings_e);
         pre_document_id = p->document_id;
       }
     }
     append_buffer(postings_e, NULL, 0);
   }
+  n = 0;
   LL_FOREACH(postings, p) {
+    /* 文書ごとの位置情報は、バイト境界から始まる */
+    if (!(n % POSTINGS_BLOCK_SIZE)) {
+      offsets[n / POSTINGS_BLOCK_SIZE].positions_offset =
+        BUFFER_SIZE(postings_e);
+    }
+    n++;
     append_buffer(postings_e, &p->positions_count, sizeof(int));
     if (p->positions && p->positions_count) {
       const int *pp;
@@ -326,27 +361,79 @@ decode_postings(const wiser_env *env,
 }
 
 /**
- * ポスティングリストを変換または符号化する。
+ * ポスティングリストを、POSTINGS_BLOCK_SIZE件ごとのブロックに区切り、
+ * ブロックごとの情報を作成する。
+ * その後に、ブロックごとの読み込み位置を続ける。
+ * @param[in] postings ポスティングリスト
+ * @param[in] offsets ブロックごとの読み込み位置
+ * @param[in] blocks_count ブロックの数
+ * @param[out] blocks ブロックごとの情報
+ * @retval 0 成功
+ */
+static int
+encode_postings_blocks(const postings_list *postings,
+                       const postings_block_offset *offsets,
+                       const int blocks_count, buffer *blocks)
+{
+  int n = 0;
+  postings_block block;
+  const postings_list *p;
+
+  block.max_positions_count = 0;
+  LL_FOREACH(postings, p) {
+    if (p->positions_count > block.max_positions_count) {
+      block.max_positions_count = p->positions_count;
+    }
+    if (++n == POSTINGS_BLOCK_SIZE || !p->next) {
+      block.last_document_id = p->document_id;
+      append_buffer(blocks, &block, sizeof(postings_block));
+      block.max_positions_count = 0;
+      n = 0;
+    }
+  }
+  append_buffer(blocks, offsets, sizeof(postings_block_offset) * blocks_count);
+  return 0;
+}
+
+/**
+ * ポスティングリストを変換または符号化し、ブロックごとの情報を作成する。
  * @param[in] env アプリケーション環境
+ * @param[in] documents_count 総ドキュメント数
  * @param[in] postings 変換または符号化するポスティングリスト
  * @param[in] postings_len 変換または符号化するポスティングリストのエントリ数
  * @param[out] postings_e 変換または符号化されたポスティングリスト
+ * @param[out] blocks ブロックごとの情報と読み込み位置
  * @retval 0 成功
+ * @retval -1 失敗
  */
 static int
-encode_postings(const wiser_env *env,
+encode_postings(const wiser_env *env, int documents_count,
                 const postings_list *postings, const int postings_len,
-                buffer *postings_e)
+                buffer *postings_e, buffer *blocks)
 {
+  int rc, blocks_count = POSTINGS_BLOCKS_COUNT(postings_len);
+  postings_block_offset *offsets;
+
+  if (!(offsets = calloc(blocks_count + 1, sizeof(postings_block_offset)))) {
+    print_error("cannot allocate memory for postings blocks.");
+    return -1;
+  }
   switch (env->compress) {
   case compress_none:
-    return encode_postings_none(postings, postings_len, postings_e);
+    rc = encode_postings_none(postings, postings_len, postings_e, offsets);
+    break;
   case compress_golomb:
-    return encode_postings_golomb(db_get_document_count(env),
-                                  postings, postings_len, postings_e);
+    rc = encode_postings_golomb(documents_count,
+                                postings, postings_len, postings_e, offsets);
+    break;
   default:
     abort();
   }
+  if (!rc) {
+    rc = encode_postings_blocks(postings, offsets, blocks_count, blocks);
+  }
+  free(offsets);
+  return rc;
 }
 
 /**
@@ -355,18 +442,40 @@ encode_postings(const wiser_env *env,
  * @param[in] token_id 取得するtokenのID
  * @param[out] postings 取得したポスティングリスト
  * @param[out] postings_len 取得したポスティングリストのエントリ数
+ * @param[out] blocks 取得したブロックごとの情報。NULL指定可。
+ *                    呼び出し側で開放する。
+ * @param[out] blocks_count 取得したブロックの数。NULL指定可。
  * @retval 0 成功
  * @retval -1 失敗
  */
 int
 fetch_postings(const wiser_env *env, const int token_id,
-               postings_list **postings, int *postings_len)
+               postings_list **postings, int *postings_len,
+               postings_block **blocks, int *blocks_count)
 {
   char *postings_e;
-  int postings_e_size, docs_count, rc;
+  void *blocks_e;
+  int postings_e_size, blocks_e_size, docs_count, rc;
 
   rc = db_get_postings(env, token_id, &docs_count, (void **)&postings_e,
-                       &postings_e_size);
+                       &postings_e_size, &blocks_e, &blocks_e_size);
+  if (blocks) {
+    *blocks = NULL;
+    /* ブロックごとの情報の後に続く、読み込み位置は取得しない */
+    if (!rc && blocks_e_size > (int)sizeof(postings_block) *
+                               POSTINGS_BLOCKS_COUNT(docs_count)) {
+      blocks_e_size = sizeof(postings_block) *
+                      POSTINGS_BLOCKS_COUNT(docs_count);
+    }
+    if (!rc && blocks_e_size && (*blocks = malloc(blocks_e_size))) {
+      memcpy(*blocks, blocks_e, blocks_e_size);
+    } else {
+      blocks_e_size = 0;
+    }
+    if (blocks_count) {
+      *blocks_count = blocks_e_size / sizeof(postings_block);
+    }
+  }
   if (!rc && postings_e_size) {
     /* 空ではない場合、復号する */
     int decoded_len;
@@ -376,7 +485,7 @@ fetch_postings(const wiser_env *env, const int token_id,
       rc = -1;
     } else if (docs_count != decoded_len) {
       print_error("postings list decode error: stored:%d decoded:%d.\n",
-                  *postings_len, decoded_len);
+                  docs_count, decoded_len);
       rc = -1;
     }
     if (postings_len) { *postings_len = decoded_len; }
@@ -387,6 +496,470 @@ fetch_postings(const wiser_env *env, const int token_id,
   return rc;
 }
 
+/**
+ * バイト列を読み進める位置を、指定のバイト位置に設定する。
+ * 内容は、次に読み出すときに読み込む。
+ * @param[out] r 読み進める位置
+ * @param[in] blob 読み込むバイト列
+ * @param[in] size バイト列全体のバイト数
+ * @param[in] offset 読み始めるバイト位置
+ */
+static void
+init_postings_reader(postings_reader *r, sqlite3_blob *blob, int size,
+                     int offset)
+{
+  r->blob = blob;
+  r->size = size;
+  r->base = offset;
+  r->len = 0;
+  r->pos = 0;
+  r->bit = 0x80;
+}
+
+/**
+ * 読み進める位置がbufの末尾に達したので、バイト列の続きを読み込む。
+ * @param[in,out] r 読み進める位置
+ * @retval 0 成功
+ * @retval -1 バイト列の終端に達したか、読み込みに失敗した
+ */
+static int
+fill_postings_reader(postings_reader *r)
+{
+  int size;
+
+  r->base += r->len;
+  r->pos = 0;
+  r->len = 0;
+  size = r->size - r->base;
+  if (size > POSTINGS_READER_BUFFER_SIZE) {
+    size = POSTINGS_READER_BUFFER_SIZE;
+  }
+  if (size <= 0 || db_read_postings(r->blob, r->base, size, r->buf)) {
+    return -1;
+  }
+  r->len = size;
+  return 0;
+}
+
+/**
+ * バイト列から1ビットを読み出す。
+ * @param[in,out] r 読み進める位置
+ * @return 読み出したビットの値。終端に達した場合は-1
+ */
+static inline int
+read_postings_reader_bit(postings_reader *r)
+{
+  int v;
+  if (r->pos >= r->len && fill_postings_reader(r)) { return -1; }
+  v = (r->buf[r->pos] & r->bit) ? 1 : 0;
+  r->bit >>= 1;
+  if (!r->bit) {
+    r->bit = 0x80;
+    r->pos++;
+  }
+  return v;
+}
+
+/**
+ * 読み途中のバイトがあれば読み飛ばし、次のバイトの先頭から読むようにする。
+ * @param[in,out] r 読み進める位置
+ */
+static inline void
+align_postings_reader(postings_reader *r)
+{
+  if (r->bit != 0x80) {
+    r->pos++;
+    r->bit = 0x80;
+  }
+}
+
+/**
+ * バイト列から、バイト境界に置かれたint値を1つ読み出す。
+ * @param[in,out] r 読み進める位置
+ * @param[out] value 読み出した値
+ * @retval 0 成功
+ * @retval -1 終端に達した
+ */
+static int
+read_postings_reader_int(postings_reader *r, int *value)
+{
+  int i;
+  char *p = (char *)value;
+
+  align_postings_reader(r);
+  for (i = 0; i < (int)sizeof(int); i++) {
+    if (r->pos >= r->len && fill_postings_reader(r)) { return -1; }
+    p[i] = r->buf[r->pos++];
+  }
+  return 0;
+}
+
+/**
+ * 読み進める位置を、バイト列全体でのバイト位置に移す。
+ * @param[in,out] r 読み進める位置
+ * @param[in] offset 移動先のバイト位置
+ */
+static void
+seek_postings_reader(postings_reader *r, int offset)
+{
+  r->bit = 0x80;
+  if (offset >= r->base && offset < r->base + r->len) {
+    r->pos = offset - r->base;
+  } else {
+    r->base = offset;
+    r->len = 0;
+    r->pos = 0;
+  }
+}
+
+/**
+ * Golomb符号で1つの数値を、読み進める位置から復号する。
+ * @param[in] m Golomb符号のmパラメータ
+ * @param[in] b Golomb符号のbパラメータ。ceil(log2(m))
+ * @param[in] t pow2(b) - m
+ * @param[in,out] r 読み進める位置
+ * @return 復号された値
+ */
+static inline int
+golomb_decoding_reader(int m, int b, int t, postings_reader *r)
+{
+  int n = 0;
+
+  while (read_postings_reader_bit(r) == 1) {
+    n += m;
+  }
+  if (m > 1) {
+    int i, z, v = 0;
+    for (i = 0; i < b - 1; i++) {
+      if ((z = read_postings_reader_bit(r)) == -1) {
+        print_error("invalid golomb code");
+        break;
+      }
+      v = (v << 1) | z;
+    }
+    if (v >= t) {
+      if ((z = read_postings_reader_bit(r)) == -1) {
+        print_error("invalid golomb code");
+      } else {
+        v = (v << 1) | z;
+        v -= t;
+      }
+    }
+    n += v;
+  }
+  return n;
+}
+
+/**
+ * ポスティングリストの文書IDの列を、先頭から必要な分だけ復号する
+ * ストリームを開く。
+ * DBのバイト列は一部ずつ読み込むため、リストの長さによらず
+ * 使うメモリは一定となる。
+ * ブロックごとの読み込み位置が保存されていれば、
+ * postings_stream_advance_toは読まなくてよいブロックを飛ばす。
+ * 最初の文書へは、postings_stream_nextで進める。
+ * @param[in] env アプリケーション環境
+ * @param[in] token_id 取得するtokenのID
+ * @param[in] docs_count トークンの文書数。圧縮なしの場合はバイト列に含まれない
+ * @param[in] need_positions postings_stream_positionsで位置情報を読むか
+ * @param[out] stream 開いたストリーム。close_postings_streamで閉じる
+ * @retval 0 成功
+ * @retval 1 位置情報を読むための読み込み位置が保存されていない
+ * @retval -1 失敗
+ */
+int
+open_postings_stream(const wiser_env *env, const int token_id,
+                     const int docs_count, int need_positions,
+                     postings_stream *stream)
+{
+  int size, blocks_size;
+  sqlite3_blob *blob;
+
+  stream->entry.positions = NULL;
+  stream->blocks.blob = NULL;
+  if (db_open_postings(env, token_id, &blob, &size)) { return -1; }
+  init_postings_reader(&stream->docs, blob, size, 0);
+  init_postings_reader(&stream->positions, blob, size, 0);
+  stream->compress = env->compress;
+  stream->docs_count = docs_count;
+  stream->index = -1;
+  stream->positions_index = -1;
+  stream->entry_offset = 0;
+  stream->entry.document_id = 0;
+  stream->entry.positions_count = 0;
+  stream->entry.next = NULL;
+  if (stream->compress == compress_golomb) {
+    stream->docs_count = 0;
+    if (size && (read_postings_reader_int(&stream->docs,
+                                          &stream->docs_count) ||
+                 (stream->docs_count &&
+                  read_postings_reader_int(&stream->docs, &stream->m)))) {
+      print_error("postings list decode error: %d", token_id);
+      close_postings_stream(stream);
+      return -1;
+    }
+    if (stream->docs_count) {
+      calc_golomb_params(stream->m, &stream->b, &stream->t);
+    }
+  }
+  /* 古いデータベースでは、ブロックごとの情報の後に読み込み位置がない */
+  stream->blocks_count = POSTINGS_BLOCKS_COUNT(stream->docs_count);
+  stream->blocks_read = 0;
+  stream->block_last_document_id = 0;
+  stream->prev_last_document_id = 0;
+  if (stream->blocks_count &&
+      !db_open_postings_blocks(env, token_id, &blob, &blocks_size)) {
+    init_postings_reader(&stream->blocks, blob, blocks_size, 0);
+    if (blocks_size != stream->blocks_count *
+                       (int)(sizeof(postings_block) +
+                             sizeof(postings_block_offset))) {
+      db_close_postings(blob);
+      stream->blocks.blob = NULL;
+    }
+  }
+  if (!stream->blocks.blob) {
+    stream->blocks_count = 0;
+    /* Golomb符号の場合、位置情報の始まる位置は読み込み位置からしか分からない */
+    if (need_positions && stream->compress == compress_golomb &&
+        stream->docs_count) {
+      close_postings_stream(stream);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * ストリームを次の文書に進める。位置情報は読まない。
+ * @param[in,out] stream ストリーム
+ * @return 次の文書。終端に達した場合はNULL
+ */
+postings_list *
+postings_stream_next(postings_stream *stream)
+{
+  if (stream->index + 1 >= stream->docs_count) {
+    stream->index = stream->docs_count;
+    return NULL;
+  }
+  stream->index++;
+  if (stream->compress == compress_golomb) {
+    stream->entry.document_id +=
+      golomb_decoding_reader(stream->m, stream->b, stream->t,
+                             &stream->docs) + 1;
+    /* 出現数は位置情報と一緒に読む */
+    stream->entry.positions_count = 0;
+  } else {
+    postings_reader *r = &stream->docs;
+    align_postings_reader(r);
+    stream->entry_offset = r->base + r->pos;
+    if (read_postings_reader_int(r, &stream->entry.document_id) ||
+        read_postings_reader_int(r, &stream->entry.positions_count)) {
+      stream->index = stream->docs_count;
+      return NULL;
+    }
+    /* 位置情報は読み飛ばす */
+    seek_postings_reader(r, r->base + r->pos +
+                         sizeof(int) * stream->entry.positions_count);
+  }
+  return &stream->entry;
+}
+
+/**
+ * 指定したブロックの読み込み位置を取得する。
+ * @param[in] stream ストリーム
+ * @param[in] block ブロックの添字
+ * @param[out] offset 取得した読み込み位置
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+read_postings_block_offset(const postings_stream *stream, int block,
+                           postings_block_offset *offset)
+{
+  return db_read_postings(stream->blocks.blob,
+                          sizeof(postings_block) * stream->blocks_count +
+                          sizeof(postings_block_offset) * block,
+                          sizeof(postings_block_offset), offset);
+}
+
+/**
+ * 指定した文書IDを含みうる最初のブロックまで、ブロックごとの情報を読み進める。
+ * @param[in,out] stream ストリーム
+ * @param[in] document_id 探す文書ID
+ * @return 見つかったブロックの添字。どのブロックにも含まれない場合は-1
+ */
+static int
+find_postings_block(postings_stream *stream, const int document_id)
+{
+  while (stream->blocks_read < stream->blocks_count &&
+         (!stream->blocks_read ||
+          stream->block_last_document_id < document_id)) {
+    postings_block block;
+    if (read_postings_reader_int(&stream->blocks, &block.last_document_id) ||
+        read_postings_reader_int(&stream->blocks,
+                                 &block.max_positions_count)) {
+      return -1;
+    }
+    stream->prev_last_document_id = stream->block_last_document_id;
+    stream->block_last_document_id = block.last_document_id;
+    stream->blocks_read++;
+  }
+  if (stream->block_last_document_id < document_id) { return -1; }
+  return stream->blocks_read - 1;
+}
+
+/**
+ * ストリームを、指定した文書ID以上の文書まで進める。
+ * ブロックごとの読み込み位置があれば、読まなくてよいブロックは飛ばす。
+ * 飛ばさずに読む文書は、文書IDだけを復号する。
+ * @param[in,out] stream ストリーム
+ * @param[in] document_id 進める先の文書ID
+ * @return 進めた先の文書。終端に達した場合はNULL
+ */
+postings_list *
+postings_stream_advance_to(postings_stream *stream, const int document_id)
+{
+  postings_list *p = (stream->index >= 0 &&
+                      stream->index < stream->docs_count) ?
+                     &stream->entry : NULL;
+  if (stream->index >= stream->docs_count) { return NULL; }
+  if (p && p->document_id >= document_id) { return p; }
+  if (stream->blocks_count) {
+    int block = find_postings_block(stream, document_id);
+    postings_block_offset offset;
+    if (block < 0) {
+      stream->index = stream->docs_count;
+      return NULL;
+    }
+    /* 現在のブロックより後のブロックへは、読み込み位置から読み始める */
+    if (block > 0 && block * POSTINGS_BLOCK_SIZE > stream->index + 1) {
+      if (read_postings_block_offset(stream, block, &offset)) {
+        print_error("cannot read postings block offset.");
+        stream->index = stream->docs_count;
+        return NULL;
+      }
+      seek_postings_reader(&stream->docs, offset.docs_offset / 8);
+      stream->docs.bit = 0x80 >> (offset.docs_offset % 8);
+      stream->index = block * POSTINGS_BLOCK_SIZE - 1;
+      stream->entry.document_id = stream->prev_last_document_id;
+    }
+  }
+  do {
+    p = postings_stream_next(stream);
+  } while (p && p->document_id < document_id);
+  return p;
+}
+
+/**
+ * Golomb符号で圧縮された、1文書分の位置情報を読み出す。
+ * @param[in,out] r 文書の位置情報の先頭を指している読み進める位置
+ * @param[out] positions_count 位置情報の数
+ * @param[out] positions 読み出した位置情報を追加する配列。NULLなら読み飛ばす
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+read_postings_reader_positions(postings_reader *r, int *positions_count,
+                               UT_array *positions)
+{
+  int i, m, b, t, position = -1;
+
+  if (read_postings_reader_int(r, positions_count)) { return -1; }
+  if (!*positions_count) { return 0; }
+  if (read_postings_reader_int(r, &m)) { return -1; }
+  calc_golomb_params(m, &b, &t);
+  for (i = 0; i < *positions_count; i++) {
+    position += golomb_decoding_reader(m, b, t, r) + 1;
+    if (positions) { utarray_push_back(positions, &position); }
+  }
+  align_postings_reader(r);
+  return 0;
+}
+
+/**
+ * ストリームの現在の文書の位置情報を読み、
+ * 現在の文書のpositionsとpositions_countに格納する。
+ * open_postings_streamで位置情報を読むと指定した場合にだけ使える。
+ * @param[in,out] stream ストリーム
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+postings_stream_positions(postings_stream *stream)
+{
+  int block;
+  postings_reader *r = &stream->positions;
+
+  if (stream->index < 0 || stream->index >= stream->docs_count) {
+    return -1;
+  }
+  /* 現在の文書の位置情報は読み込み済み */
+  if (stream->compress == compress_golomb &&
+      stream->positions_index == stream->index + 1) {
+    return 0;
+  }
+  if (!stream->entry.positions) {
+    utarray_new(stream->entry.positions, &ut_int_icd);
+  }
+  utarray_clear(stream->entry.positions);
+  if (stream->compress == compress_none) {
+    int i, position;
+    seek_postings_reader(r, stream->entry_offset + sizeof(int) * 2);
+    for (i = 0; i < stream->entry.positions_count; i++) {
+      if (read_postings_reader_int(r, &position)) { return -1; }
+      utarray_push_back(stream->entry.positions, &position);
+    }
+    return 0;
+  }
+  /* 位置情報は、現在のブロックの最初の文書から順に読むしかない */
+  block = stream->index / POSTINGS_BLOCK_SIZE;
+  if (stream->positions_index < 0 ||
+      stream->positions_index > stream->index ||
+      stream->positions_index / POSTINGS_BLOCK_SIZE < block) {
+    postings_block_offset offset;
+    if (read_postings_block_offset(stream, block, &offset)) {
+      print_error("cannot read postings block offset.");
+      return -1;
+    }
+    seek_postings_reader(r, offset.positions_offset);
+    stream->positions_index = block * POSTINGS_BLOCK_SIZE;
+  }
+  for (; stream->positions_index < stream->index;
+       stream->positions_index++) {
+    int positions_count;
+    if (read_postings_reader_positions(r, &positions_count, NULL)) {
+      return -1;
+    }
+  }
+  if (read_postings_reader_positions(r, &stream->entry.positions_count,
+                                     stream->entry.positions)) {
+    return -1;
+  }
+  stream->positions_index++;
+  return 0;
+}
+
+/**
+ * ストリームを閉じる。
+ * @param[in] stream ストリーム
+ */
+void
+close_postings_stream(postings_stream *stream)
+{
+  if (stream->docs.blob) {
+    db_close_postings(stream->docs.blob);
+    stream->docs.blob = NULL;
+  }
+  if (stream->blocks.blob) {
+    db_close_postings(stream->blocks.blob);
+    stream->blocks.blob = NULL;
+  }
+  if (stream->entry.positions) {
+    utarray_free(stream->entry.positions);
+    stream->entry.positions = NULL;
+  }
+}
+
 /**
  * 二つのポスティングリストをマージしたポスティングリストを取得する。
  * @param[in] pa マージ対象のポスティングリスト
@@ -428,24 +1001,39 @@ merge_postings(postings_list *pa, postings_list *pb)
  * データベース上のポスティングリストと更新用の転置インデックスをマージし保存する。
  * @param[in] env アプリケーション環境
  * @param[in] p ポスティングリストを含んだinverted_indexのエントリ
+ * @param[in] documents_count 総ドキュメント数
  */
 void
-update_postings(const wiser_env *env, inverted_index_value *p)
+update_postings(wiser_env *env, inverted_index_value *p,
+                int documents_count)
 {
-  int old_postings_len;
+  int rc, old_postings_len;
   postings_list *old_postings;
 
-  if (!fetch_postings(env, p->token_id, &old_postings,
-                      &old_postings_len)) {
-    buffer *buf;
+  /* 書き出しスレッドから呼ばれた場合に、取得したBLOBを復号し終えるまで
+     他のスレッドに同じ接続でデータベースを変更させない */
+  sqlite3_mutex_enter(sqlite3_db_mutex(env->db));
+  rc = fetch_postings(env, p->token_id, &old_postings, &old_postings_len,
+                      NULL, NULL);
+  sqlite3_mutex_leave(sqlite3_db_mutex(env->db));
+  if (!rc) {
+    buffer *buf, *blocks;
     if (old_postings_len) {
       p->postings_list = merge_postings(old_postings, p->postings_list);
       p->docs_count += old_postings_len;
     }
     if ((buf = alloc_buffer())) {
-      encode_postings(env, p->postings_list, p->docs_count, buf);
-      db_update_postings(env, p->token_id, p->docs_count,
-                         BUFFER_PTR(buf), BUFFER_SIZE(buf));
+      if ((blocks = alloc_buffer())) {
+        if (!encode_postings(env, documents_count,
+                             p->postings_list, p->docs_count, buf, blocks)) {
+          db_update_postings(env, p->token_id, p->docs_count,
+                             BUFFER_PTR(buf), BUFFER_SIZE(buf),
+                             BUFFER_PTR(blocks), BUFFER_SIZE(blocks));
+        }
+        /* 書き換えたトークンのデコード済みのポスティングリストは使えない */
+        invalidate_cached_postings(env, p->token_id);
+        free_buffer(blocks);
+      }
       free_buffer(buf);
     }
   } else {
@@ -458,12 +1046,13 @@ update_postings(const wiser_env *env, inverted_index_value *p)
  * 二つのinverted indexをマージし、片方を解放する。
  * @param[in] base マージされて要素が増えるinverted index
  * @param[in] to_be_added マージされて解放されるinverted index
- *
+ * @return baseに新たに追加されたエントリ数
  */
-void
+int
 merge_inverted_index(inverted_index_hash *base,
                      inverted_index_hash *to_be_added)
 {
+  int added = 0;
   inverted_index_value *p, *temp;
 
   HASH_ITER(hh, to_be_added, p, temp) {
@@ -476,8 +1065,469 @@ merge_inverted_index(inverted_index_hash *base,
       free(p);
     } else {
       HASH_ADD_INT(base, token_id, p);
+      added++;
+    }
+  }
+  return added;
+}
+
+/* bulk build時に一度にマージするランファイルの最大数 */
+#define POSTINGS_RUNS_MERGE_FANIN 128
+
+/* ランファイルを読み込む際の状態 */
+typedef struct {
+  FILE *fp;          /* ランファイル */
+  int run_no;        /* ランの番号 */
+  int token_id;      /* 読み込んだレコードのトークンID */
+  int docs_count;    /* 読み込んだレコードの文書数 */
+  int postings_size; /* 読み込んだレコードのポスティングリストのバイト数 */
+  int postings_capa; /* postings_eに確保されているバイト数 */
+  char *postings_e;  /* 読み込んだレコードのポスティングリスト(無圧縮) */
+} postings_run;
+
+/**
+ * ランファイルのパスを取得する。
+ * @param[in] env アプリケーション環境
+ * @param[in] run_no ランの番号
+ * @param[out] path パスを格納するバッファ
+ * @param[in] path_size pathのバイト数
+ */
+static void
+get_run_path(const wiser_env *env, int run_no, char *path, int path_size)
+{
+  snprintf(path, path_size, "%s.run.%d", env->db_path, run_no);
+}
+
+/**
+ * ランファイルに1レコードを書き出す。
+ * @param[in] fp ランファイル
+ * @param[in] token_id トークンID
+ * @param[in] docs_count 文書数
+ * @param[in] postings_e ポスティングリスト(無圧縮)
+ * @param[in] postings_size ポスティングリストのバイト数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+write_run_record(FILE *fp, int token_id, int docs_count,
+                 const void *postings_e, int postings_size)
+{
+  if (fwrite(&token_id, sizeof(int), 1, fp) != 1 ||
+      fwrite(&docs_count, sizeof(int), 1, fp) != 1 ||
+      fwrite(&postings_size, sizeof(int), 1, fp) != 1 ||
+      (postings_size &&
+       fwrite(postings_e, postings_size, 1, fp) != 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * ランファイルから次のレコードを読み込む。
+ * @param[in,out] run ランの読み込み状態
+ * @retval 0 成功
+ * @retval 1 ランの終端に達した
+ * @retval -1 失敗
+ */
+static int
+read_run_record(postings_run *run)
+{
+  int header[3];
+  size_t n;
+
+  if ((n = fread(header, sizeof(int), 3, run->fp)) != 3) {
+    return (!n && feof(run->fp)) ? 1 : -1;
+  }
+  run->token_id = header[0];
+  run->docs_count = header[1];
+  run->postings_size = header[2];
+  if (run->postings_size > run->postings_capa) {
+    char *p;
+    if (!(p = realloc(run->postings_e, run->postings_size))) {
+      return -1;
+    }
+    run->postings_e = p;
+    run->postings_capa = run->postings_size;
+  }
+  if (run->postings_size &&
+      fread(run->postings_e, run->postings_size, 1, run->fp) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * ランをトークンIDの昇順、同じトークンIDなら先頭の文書IDの昇順で比較する。
+ * 段階的なマージで作られたランは番号と文書IDの順序が一致しないため、
+ * ランの番号ではなく文書IDで順序を決める。
+ * @param[in] a ランの読み込み状態
+ * @param[in] b ランの読み込み状態
+ * @return aの方が小さければ真
+ */
+static inline int
+postings_run_less(const postings_run *a, const postings_run *b)
+{
+  return a->token_id < b->token_id ||
+         (a->token_id == b->token_id &&
+          *(const int *)a->postings_e < *(const int *)b->postings_e);
+}
+
+/**
+ * ランの最小ヒープで、指定位置の要素を下方に移動させる。
+ * @param[in,out] heap ランの最小ヒープ
+ * @param[in] heap_len ヒープの要素数
+ * @param[in] i 移動させる要素の位置
+ */
+static void
+postings_run_heap_down(postings_run **heap, int heap_len, int i)
+{
+  for (;;) {
+    int l = i * 2 + 1, r = l + 1, m = i;
+    postings_run *t;
+    if (l < heap_len && postings_run_less(heap[l], heap[m])) { m = l; }
+    if (r < heap_len && postings_run_less(heap[r], heap[m])) { m = r; }
+    if (m == i) { break; }
+    t = heap[i];
+    heap[i] = heap[m];
+    heap[m] = t;
+    i = m;
+  }
+}
+
+/**
+ * 1つのトークンについて、複数のランから集めたポスティングリストを
+ * データベースのポスティングリストとマージして保存する。
+ * @param[in] env アプリケーション環境
+ * @param[in] token_id トークンID
+ * @param[in] buf 連結されたポスティングリスト(無圧縮)
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+store_merged_postings(wiser_env *env, int token_id, buffer *buf)
+{
+  inverted_index_value ii;
+
+  memset(&ii, 0, sizeof(inverted_index_value));
+  ii.token_id = token_id;
+  if (decode_postings_none(BUFFER_PTR(buf), BUFFER_SIZE(buf),
+                           &ii.postings_list, &ii.docs_count)) {
+    return -1;
+  }
+  update_postings(env, &ii, env->indexed_count);
+  free_postings_list(ii.postings_list);
+  return 0;
+}
+
+/**
+ * ランファイル群をk-wayマージする。
+ * 各ランは重ならない文書IDの範囲を受け持ち、その中では文書IDの昇順に
+ * 並んでいる。そのため同一トークンのポスティングリストは、
+ * postings_run_lessの通り先頭の文書IDの昇順に連結すれば、全体でも昇順になる。
+ * 段階的なマージで作られたランでは、番号順と文書IDの順が一致しない。
+ * @param[in] env アプリケーション環境
+ * @param[in] first_run マージする最初のランの番号
+ * @param[in] last_run マージする最後のランの番号の次
+ * @param[in] out マージ結果を書き出すランファイル。
+ *                NULLの場合はデータベースに保存する
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+merge_run_group(wiser_env *env, int first_run, int last_run,
+                FILE *out)
+{
+  int i, rc = 0, heap_len = 0, runs_len = last_run - first_run;
+  char path[PATH_MAX];
+  postings_run *runs, **heap;
+
+  if (!(runs = calloc(runs_len, sizeof(postings_run)))) { return -1; }
+  if (!(heap = calloc(runs_len, sizeof(postings_run *)))) {
+    free(runs);
+    return -1;
+  }
+  for (i = 0; i < runs_len; i++) {
+    runs[i].run_no = first_run + i;
+    get_run_path(env, runs[i].run_no, path, sizeof(path));
+    if (!(runs[i].fp = fopen(path, "rb"))) {
+      print_error("cannot open run file(%s).", path);
+      rc = -1;
+      goto exit;
+    }
+    switch (read_run_record(&runs[i])) {
+    case 0:
+      heap[heap_len++] = &runs[i];
+      break;
+    case 1:
+      break;
+    default:
+      print_error("cannot read run file(%s).", path);
+      rc = -1;
+      goto exit;
+    }
+  }
+  for (i = heap_len / 2 - 1; i >= 0; i--) {
+    postings_run_heap_down(heap, heap_len, i);
+  }
+  while (heap_len) {
+    int token_id = heap[0]->token_id, docs_count = 0;
+    buffer *buf;
+
+    if (!(buf = alloc_buffer())) {
+      rc = -1;
+      goto exit;
+    }
+    /* 同一トークンのポスティングリストを文書IDの順に連結する */
+    while (heap_len && heap[0]->token_id == token_id) {
+      postings_run *run = heap[0];
+      append_buffer(buf, run->postings_e, run->postings_size);
+      docs_count += run->docs_count;
+      switch (read_run_record(run)) {
+      case 0:
+        break;
+      case 1:
+        heap[0] = heap[--heap_len];
+        break;
+      default:
+        print_error("cannot read run file(%d).", run->run_no);
+        rc = -1;
+        break;
+      }
+      postings_run_heap_down(heap, heap_len, 0);
+    }
+    if (!rc) {
+      if (out) {
+        if (write_run_record(out, token_id, docs_count,
+                             BUFFER_PTR(buf), BUFFER_SIZE(buf))) {
+          print_error("cannot write run file.");
+          rc = -1;
+        }
+      } else if (store_merged_postings(env, token_id, buf)) {
+        print_error("cannot merge postings list of token(%d).", token_id);
+        rc = -1;
+      }
+    }
+    free_buffer(buf);
+    if (rc) { goto exit; }
+  }
+exit:
+  for (i = 0; i < runs_len; i++) {
+    if (runs[i].fp) { fclose(runs[i].fp); }
+    if (runs[i].postings_e) { free(runs[i].postings_e); }
+  }
+  free(heap);
+  free(runs);
+  return rc;
+}
+
+/**
+ * 更新用の転置インデックスを、ランファイルとして書き出す。
+ * ランファイルには、トークンIDの昇順に無圧縮のポスティングリストを格納する。
+ * @param[in] env アプリケーション環境
+ * @param[in] ii トークンIDの昇順にソートされた転置インデックス
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+write_postings_run(wiser_env *env, inverted_index_hash *ii)
+{
+  int rc = 0;
+  FILE *fp;
+  char path[PATH_MAX];
+  inverted_index_value *p;
+
+  get_run_path(env, env->runs_count, path, sizeof(path));
+  if (!(fp = fopen(path, "wb"))) {
+    print_error("cannot create run file(%s).", path);
+    return -1;
+  }
+  for (p = ii; p && !rc; p = p->hh.next) {
+    buffer *buf;
+    if ((buf = alloc_buffer())) {
+      encode_postings_none(p->postings_list, p->docs_count, buf, NULL);
+      if (write_run_record(fp, p->token_id, p->docs_count,
+                           BUFFER_PTR(buf), BUFFER_SIZE(buf))) {
+        print_error("cannot write run file(%s).", path);
+        rc = -1;
+      }
+      free_buffer(buf);
+    } else {
+      rc = -1;
+    }
+  }
+  /* チェックポイントから再開できるように、ディスクに書き込んでおく */
+  if (fflush(fp) || fsync(fileno(fp))) { rc = -1; }
+  if (fclose(fp)) { rc = -1; }
+  if (!rc) { env->runs_count++; }
+  return rc;
+}
+
+/**
+ * 書き出されたランファイルをすべてマージし、データベースに保存する。
+ * ランファイルの数が多い場合は、段階的にマージする。
+ * マージ元のランファイルは、commitするまで削除しない。
+ * @param[in] env アプリケーション環境
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+merge_postings_runs(wiser_env *env)
+{
+  int first_run = 0;
+
+  while (env->runs_count - first_run > POSTINGS_RUNS_MERGE_FANIN) {
+    int last_run = first_run + POSTINGS_RUNS_MERGE_FANIN, rc;
+    char path[PATH_MAX];
+    FILE *out;
+
+    get_run_path(env, env->runs_count, path, sizeof(path));
+    if (!(out = fopen(path, "wb"))) {
+      print_error("cannot create run file(%s).", path);
+      return -1;
+    }
+    rc = merge_run_group(env, first_run, last_run, out);
+    if (fclose(out) || rc) { return -1; }
+    env->runs_count++;
+    first_run = last_run;
+  }
+  return merge_run_group(env, first_run, env->runs_count, NULL);
+}
+
+/**
+ * 書き出されたランファイルをすべて削除する。
+ * @param[in] env アプリケーション環境
+ */
+void
+remove_postings_runs(wiser_env *env)
+{
+  int i;
+  char path[PATH_MAX];
+
+  for (i = 0; i < env->runs_count; i++) {
+    get_run_path(env, i, path, sizeof(path));
+    remove(path);
+  }
+  env->runs_count = 0;
+}
+
+/* インパクト順のポスティングリストで、出現数を量子化した値の種類の数 */
+#define IMPACT_BUCKETS 32
+
+/**
+ * トークンの出現数を、2のべき乗で量子化する。
+ * @param[in] positions_count トークンの出現数
+ * @return 量子化した値。出現数の2進数での桁数-1
+ */
+static int
+impact_bucket(int positions_count)
+{
+  int b = 0;
+  while (positions_count >>= 1) { b++; }
+  return b;
+}
+
+/**
+ * ポスティングリストを、量子化した出現数の降順のセグメントに並べ替えた、
+ * インパクト順のポスティングリストを作成する。
+ * セグメント数、impact_segmentの配列、impact_postingの配列の順に並べる。
+ * @param[in] postings ポスティングリスト
+ * @param[in] postings_len ポスティングリストのエントリ数
+ * @param[in] lengths 文書IDを添字とする文書長の配列。NULL指定可
+ * @param[in] lengths_count lengthsの要素数
+ * @param[out] buf インパクト順のポスティングリスト
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+encode_impact_postings(const postings_list *postings, int postings_len,
+                       const int *lengths, int lengths_count, buffer *buf)
+{
+  int b, offset = 0, segments_count = 0, offsets[IMPACT_BUCKETS];
+  impact_segment segments[IMPACT_BUCKETS];
+  impact_posting *ps;
+  const postings_list *p;
+
+  if (!postings_len) { return 0; }
+  memset(segments, 0, sizeof(segments));
+  LL_FOREACH(postings, p) {
+    impact_segment *seg = &segments[impact_bucket(p->positions_count)];
+    /* 文書長が不明な文書があれば、セグメントの最小の文書長も不明とする */
+    int length = (lengths && p->document_id < lengths_count) ?
+                 lengths[p->document_id] : 0;
+    if (p->positions_count > seg->max_positions_count) {
+      seg->max_positions_count = p->positions_count;
+    }
+    if (!seg->postings_count || length < seg->min_document_length) {
+      seg->min_document_length = length;
     }
+    seg->postings_count++;
   }
+  if (!(ps = malloc(sizeof(impact_posting) * postings_len))) {
+    print_error("cannot allocate memory for impact postings.");
+    return -1;
+  }
+  /* 量子化した値の大きいセグメントから順に並べる */
+  for (b = IMPACT_BUCKETS - 1; b >= 0; b--) {
+    offsets[b] = offset;
+    offset += segments[b].postings_count;
+    if (segments[b].postings_count) { segments_count++; }
+  }
+  /* セグメント内では文書IDの昇順を保つ */
+  LL_FOREACH(postings, p) {
+    impact_posting *ip = &ps[offsets[impact_bucket(p->positions_count)]++];
+    ip->document_id = p->document_id;
+    ip->positions_count = p->positions_count;
+  }
+  append_buffer(buf, &segments_count, sizeof(int));
+  for (b = IMPACT_BUCKETS - 1; b >= 0; b--) {
+    if (segments[b].postings_count) {
+      append_buffer(buf, &segments[b], sizeof(impact_segment));
+    }
+  }
+  append_buffer(buf, ps, sizeof(impact_posting) * postings_len);
+  free(ps);
+  return 0;
+}
+
+/**
+ * 文書数がIMPACT_POSTINGS_MIN_DOCS以上のすべてのトークンについて、
+ * インパクト順のポスティングリストを作り直してデータベースに保存する。
+ * @param[in] env アプリケーション環境
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+build_impact_postings(wiser_env *env)
+{
+  int token_id, max_token_id;
+
+  db_clear_impacts(env);
+  max_token_id = db_get_max_token_id(env);
+  for (token_id = 1; token_id <= max_token_id; token_id++) {
+    buffer *buf = NULL;
+    postings_list *postings = NULL;
+    int postings_len = 0;
+
+    if (fetch_postings(env, token_id, &postings, &postings_len,
+                       NULL, NULL)) {
+      print_error("cannot fetch postings: %d", token_id);
+      return -1;
+    }
+    if (postings_len >= IMPACT_POSTINGS_MIN_DOCS) {
+      if (!(buf = alloc_buffer()) ||
+          encode_impact_postings(postings, postings_len,
+                                 env->document_lengths,
+                                 env->document_lengths_count, buf)) {
+        if (buf) { free_buffer(buf); }
+        free_postings_list(postings);
+        return -1;
+      }
+      db_replace_impacts(env, token_id, BUFFER_PTR(buf), BUFFER_SIZE(buf));
+      free_buffer(buf);
+    }
+    free_postings_list(postings);
+  }
+  return 0;
 }
 
 /**
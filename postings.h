@@ -4,10 +4,27 @@
 #include "wiser.h"
 
 int fetch_postings(const wiser_env *env, const int token_id,
-                   postings_list **postings, int *postings_len);
-void merge_inverted_index(inverted_index_hash *base,
-                          inverted_index_hash *to_be_added);
-void update_postings(const wiser_env *env, inverted_index_hash *p);
+                   postings_list **postings, int *postings_len,
+                   postings_block **blocks, int *blocks_count);
+int open_postings_stream(const wiser_env *env, const int token_id,
+                         const int docs_count, int need_positions,
+                         postings_stream *stream);
+postings_list *postings_stream_next(postings_stream *stream);
+postings_list *postings_stream_advance_to(postings_stream *stream,
+                                          const int document_id);
+int postings_stream_positions(postings_stream *stream);
+void close_postings_stream(postings_stream *stream);
+int merge_inverted_index(inverted_index_hash *base,
+                         inverted_index_hash *to_be_added);
+void update_postings(wiser_env *env, inverted_index_hash *p,
+                     int documents_count);
+int write_postings_run(wiser_env *env, inverted_index_hash *ii);
+int merge_postings_runs(wiser_env *env);
+void remove_postings_runs(wiser_env *env);
+int encode_impact_postings(const postings_list *postings, int postings_len,
+                           const int *lengths, int lengths_count,
+                           buffer *buf);
+int build_impact_postings(wiser_env *env);
 void dump_postings_list(const postings_list *postings);
 void free_postings_list(postings_list *pl);
 void dump_inverted_index(wiser_env *env, inverted_index_hash *ii);
@@ -0,0 +1,829 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "util.h"
+#include "token.h"
+#include "query.h"
+
+/* 検索クエリの字句の種類 */
+typedef enum {
+  query_lexeme_end,    /* クエリの終端 */
+  query_lexeme_lparen, /* ( */
+  query_lexeme_rparen, /* ) */
+  query_lexeme_word,   /* 空白で区切られた語 */
+  query_lexeme_phrase, /* 引用符で囲まれたフレーズ */
+  query_lexeme_and,    /* AND */
+  query_lexeme_or,     /* OR */
+  query_lexeme_not,    /* NOTか、語の直前の- */
+  query_lexeme_error   /* 閉じられていない引用符 */
+} query_lexeme_type;
+
+/* 検索クエリの構文解析の状態 */
+typedef struct {
+  const char *p;          /* 次に読む位置 */
+  const char *end;        /* クエリの終端 */
+  query_lexeme_type type; /* 先読みした字句の種類 */
+  const char *text;       /* 先読みした語やフレーズの先頭 */
+  int size;               /* 先読みした語やフレーズのバイト数 */
+  arena *a;               /* 演算子木を切り出すアリーナ */
+} query_parser;
+
+static query_node *parse_query_or(query_parser *p);
+
+/**
+ * 指定位置にある空白のバイト数を返す。全角スペースも空白とする。
+ * @param[in] p 調べる位置
+ * @param[in] end クエリの終端
+ * @return 空白のバイト数。空白でなければ0
+ */
+static int
+query_space_size(const char *p, const char *end)
+{
+  switch (*p) {
+  case ' ': case '\f': case '\n': case '\r': case '\t': case '\v':
+    return 1;
+  }
+  /* U+3000(全角スペース)のUTF-8表現 */
+  if (end - p >= 3 && (unsigned char)p[0] == 0xe3 &&
+      (unsigned char)p[1] == 0x80 && (unsigned char)p[2] == 0x80) {
+    return 3;
+  }
+  return 0;
+}
+
+/**
+ * 次の字句を先読みする。
+ * @param[in,out] p 構文解析の状態
+ */
+static void
+next_query_lexeme(query_parser *p)
+{
+  int n;
+  const char *s;
+
+  while (p->p < p->end && (n = query_space_size(p->p, p->end))) {
+    p->p += n;
+  }
+  if (p->p >= p->end) {
+    p->type = query_lexeme_end;
+    return;
+  }
+  switch (*p->p) {
+  case '(':
+    p->type = query_lexeme_lparen;
+    p->p++;
+    return;
+  case ')':
+    p->type = query_lexeme_rparen;
+    p->p++;
+    return;
+  case '"':
+    for (s = ++p->p; p->p < p->end && *p->p != '"'; p->p++) {}
+    if (p->p >= p->end) {
+      p->type = query_lexeme_error;
+      return;
+    }
+    p->type = query_lexeme_phrase;
+    p->text = s;
+    p->size = p->p++ - s;
+    return;
+  case '-':
+    /* 語の直前の-は、その語を含まないことを表す */
+    if (p->p + 1 < p->end && !query_space_size(p->p + 1, p->end)) {
+      p->type = query_lexeme_not;
+      p->p++;
+      return;
+    }
+    break;
+  }
+  for (s = p->p; p->p < p->end && !query_space_size(p->p, p->end) &&
+       *p->p != '(' && *p->p != ')' && *p->p != '"'; p->p++) {}
+  p->text = s;
+  p->size = p->p - s;
+  if (p->size == 3 && !memcmp(s, "AND", 3)) {
+    p->type = query_lexeme_and;
+  } else if (p->size == 2 && !memcmp(s, "OR", 2)) {
+    p->type = query_lexeme_or;
+  } else if (p->size == 3 && !memcmp(s, "NOT", 3)) {
+    p->type = query_lexeme_not;
+  } else {
+    p->type = query_lexeme_word;
+  }
+}
+
+/**
+ * 演算子木のノードを作成する。
+ * @param[in] a ノードを切り出すアリーナ
+ * @param[in] type ノードの種類
+ * @return 作成されたノード。失敗した場合はNULL
+ */
+static query_node *
+new_query_node(arena *a, query_node_type type)
+{
+  query_node *node;
+  if (!(node = arena_alloc(a, sizeof(query_node)))) { return NULL; }
+  memset(node, 0, sizeof(query_node));
+  node->type = type;
+  return node;
+}
+
+/**
+ * 演算子木のノードに子ノードを加える。
+ * @param[in] a 子ノードの配列を切り出すアリーナ
+ * @param[in,out] node 親ノード
+ * @param[in] child 加える子ノード
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+add_query_child(arena *a, query_node *node, query_node *child)
+{
+  query_node **children;
+  if (!(children = arena_realloc(
+          a, node->children, sizeof(query_node *) * node->children_count,
+          sizeof(query_node *) * (node->children_count + 1)))) {
+    return -1;
+  }
+  node->children = children;
+  children[node->children_count++] = child;
+  return 0;
+}
+
+/**
+ * 子ノードを1つ持つ、指定した種類のノードを作成する。
+ * @param[in] a ノードを切り出すアリーナ
+ * @param[in] type ノードの種類
+ * @param[in] child 子ノード
+ * @return 作成されたノード。失敗した場合はNULL
+ */
+static query_node *
+new_query_parent(arena *a, query_node_type type, query_node *child)
+{
+  query_node *node;
+  if (!(node = new_query_node(a, type)) || add_query_child(a, node, child)) {
+    return NULL;
+  }
+  return node;
+}
+
+/**
+ * 語のノードを作成する。
+ * @param[in] a ノードを切り出すアリーナ
+ * @param[in] term 語(UTF-8)
+ * @param[in] term_size 語のバイト数
+ * @param[in] is_phrase フレーズかどうか
+ * @return 作成されたノード。失敗した場合はNULL
+ */
+static query_node *
+new_query_term(arena *a, const char *term, const int term_size,
+               const int is_phrase)
+{
+  query_node *node;
+  if (!(node = new_query_node(a, query_node_term)) ||
+      !(node->term = arena_alloc(a, term_size + 1))) {
+    return NULL;
+  }
+  memcpy(node->term, term, term_size);
+  node->term[term_size] = '\0';
+  node->term_size = term_size;
+  node->is_phrase = is_phrase;
+  return node;
+}
+
+/**
+ * 字句が、否定や語などの単項の始まりかどうかを調べる
+ * @param[in] type 字句の種類
+ * @return 単項の始まりであれば真
+ */
+static int
+query_lexeme_starts_unary(query_lexeme_type type)
+{
+  return type == query_lexeme_word || type == query_lexeme_phrase ||
+         type == query_lexeme_lparen || type == query_lexeme_not;
+}
+
+/**
+ * 語、フレーズ、括弧で囲まれた式を解析する。
+ * @param[in,out] p 構文解析の状態
+ * @return 演算子木のノード。失敗した場合はNULL
+ */
+static query_node *
+parse_query_primary(query_parser *p)
+{
+  query_node *node;
+
+  switch (p->type) {
+  case query_lexeme_lparen:
+    next_query_lexeme(p);
+    if (!(node = parse_query_or(p))) { return NULL; }
+    if (p->type != query_lexeme_rparen) {
+      print_error("missing ')' in query.");
+      return NULL;
+    }
+    next_query_lexeme(p);
+    return node;
+  case query_lexeme_word:
+  case query_lexeme_phrase:
+    if (!(node = new_query_term(p->a, p->text, p->size,
+                                p->type == query_lexeme_phrase))) {
+      return NULL;
+    }
+    next_query_lexeme(p);
+    return node;
+  case query_lexeme_error:
+    print_error("missing '\"' in query.");
+    return NULL;
+  default:
+    print_error("missing term before or after operator in query.");
+    return NULL;
+  }
+}
+
+/**
+ * NOTや-による否定を解析する。
+ * @param[in,out] p 構文解析の状態
+ * @return 演算子木のノード。失敗した場合はNULL
+ */
+static query_node *
+parse_query_unary(query_parser *p)
+{
+  query_node *child;
+
+  if (p->type != query_lexeme_not) {
+    return parse_query_primary(p);
+  }
+  next_query_lexeme(p);
+  if (!(child = parse_query_unary(p))) { return NULL; }
+  return new_query_parent(p->a, query_node_not, child);
+}
+
+/**
+ * ANDか、空白で並べた項を解析する。
+ * @param[in,out] p 構文解析の状態
+ * @return 演算子木のノード。失敗した場合はNULL
+ */
+static query_node *
+parse_query_and(query_parser *p)
+{
+  query_node *node;
+
+  if (!(node = parse_query_unary(p))) { return NULL; }
+  if (p->type != query_lexeme_and && !query_lexeme_starts_unary(p->type)) {
+    return node;
+  }
+  if (!(node = new_query_parent(p->a, query_node_and, node))) {
+    return NULL;
+  }
+  while (p->type == query_lexeme_and || query_lexeme_starts_unary(p->type)) {
+    query_node *child;
+    if (p->type == query_lexeme_and) { next_query_lexeme(p); }
+    if (!(child = parse_query_unary(p)) ||
+        add_query_child(p->a, node, child)) {
+      return NULL;
+    }
+  }
+  return node;
+}
+
+/**
+ * ORで並べた項を解析する。
+ * @param[in,out] p 構文解析の状態
+ * @return 演算子木のノード。失敗した場合はNULL
+ */
+static query_node *
+parse_query_or(query_parser *p)
+{
+  query_node *node;
+
+  if (!(node = parse_query_and(p))) { return NULL; }
+  if (p->type != query_lexeme_or) { return node; }
+  if (!(node = new_query_parent(p->a, query_node_or, node))) {
+    return NULL;
+  }
+  while (p->type == query_lexeme_or) {
+    query_node *child;
+    next_query_lexeme(p);
+    if (!(child = parse_query_and(p)) ||
+        add_query_child(p->a, node, child)) {
+      return NULL;
+    }
+  }
+  return node;
+}
+
+/**
+ * 検索クエリを解析し、演算子木を作成する。
+ * 空白で区切った語はすべてを含む文書に、引用符で囲んだフレーズは
+ * そのままの並びを含む文書に一致する。
+ * 演算子はAND・OR・NOT(語の直前の-も同じ)と括弧で、優先順位は
+ * NOT、AND(空白)、ORの順に高い。
+ * @param[in] a 演算子木を切り出すアリーナ
+ * @param[in] query 検索クエリ(UTF-8)
+ * @param[in] query_size 検索クエリのバイト数
+ * @param[out] root 演算子木の根。アリーナが所有する
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+parse_query(arena *a, const char *query, const int query_size,
+            query_node **root)
+{
+  query_parser p;
+
+  *root = NULL;
+  p.p = query;
+  p.end = query + query_size;
+  p.a = a;
+  next_query_lexeme(&p);
+  if (p.type == query_lexeme_end) {
+    print_error("empty query.");
+    return -1;
+  }
+  if (!(*root = parse_query_or(&p))) { return -1; }
+  if (p.type != query_lexeme_end) {
+    if (p.type == query_lexeme_error) {
+      print_error("missing '\"' in query.");
+    } else {
+      print_error("unmatched ')' in query.");
+    }
+    *root = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* 正規表現から、一致する文書が必ず含む文字列の条件を取り出す解析の状態 */
+typedef struct {
+  const char *p;   /* 次に読む位置 */
+  const char *end; /* 正規表現の終端 */
+  int n;           /* N-gramのN */
+  arena *a;        /* 演算子木を切り出すアリーナ */
+} regex_parser;
+
+/* 正規表現の中で、続けて現れることが分かっている文字列 */
+typedef struct {
+  char *buf;    /* 文字列(UTF-8) */
+  int size;     /* 文字列のバイト数 */
+  int capacity; /* bufのバイト数 */
+} regex_literal;
+
+/* 正規表現の要素の繰り返し指定 */
+typedef enum {
+  regex_once,     /* 1回だけ現れる */
+  regex_repeated, /* 1回以上現れる */
+  regex_optional  /* 現れないことがある */
+} regex_quantifier;
+
+static int parse_regex_alt(regex_parser *r, query_node **node);
+
+/**
+ * UTF-8の1文字のバイト数を、先頭のバイトから求める。
+ * @param[in] p 文字の先頭
+ * @param[in] end 文字列の終端
+ * @return 文字のバイト数
+ */
+static int
+utf8_char_size(const char *p, const char *end)
+{
+  unsigned char c = *p;
+  int size = (c < 0x80) ? 1 : (c < 0xe0) ? 2 : (c < 0xf0) ? 3 : 4;
+  return (end - p < size) ? end - p : size;
+}
+
+/**
+ * 文字列から、N-gramのトークンが1つ以上取り出せるかを調べる。
+ * @param[in] a 変換した文字列を切り出すアリーナ
+ * @param[in] str 文字列(UTF-8)
+ * @param[in] str_size 文字列のバイト数
+ * @param[in] n N-gramのN
+ * @return トークンを取り出せれば真
+ */
+static int
+regex_literal_has_token(arena *a, const char *str, const int str_size,
+                        const int n)
+{
+  int i, run = 0, str32_len;
+  UTF32Char *str32;
+
+  if (utf8toutf32_arena(a, str, str_size, &str32, &str32_len)) {
+    return FALSE;
+  }
+  for (i = 0; i < str32_len && run < n; i++) {
+    run = wiser_is_ignored_char(str32[i]) ? 0 : run + 1;
+  }
+  return run >= n;
+}
+
+/**
+ * 要素の後にある繰り返し指定を読み飛ばす。
+ * @param[in,out] r 解析の状態
+ * @return 要素が現れる回数の種類
+ */
+static regex_quantifier
+skip_regex_quantifier(regex_parser *r)
+{
+  regex_quantifier q = regex_once;
+
+  while (r->p < r->end) {
+    int min = 0, max = 0;
+    const char *p = r->p;
+    switch (*p) {
+    case '?': case '*':
+      q = regex_optional;
+      r->p++;
+      continue;
+    case '+':
+      if (q == regex_once) { q = regex_repeated; }
+      r->p++;
+      continue;
+    case '{':
+      /* {m}, {m,}, {m,n} の形のみ繰り返し指定とみなす */
+      for (p++; p < r->end && isdigit((unsigned char)*p); p++) {
+        min = min * 10 + (*p - '0');
+      }
+      if (p == r->p + 1) { return q; }
+      max = min;
+      if (p < r->end && *p == ',') {
+        for (p++, max = INT_MAX; p < r->end && isdigit((unsigned char)*p);
+             p++) {
+          max = (max == INT_MAX ? 0 : max) * 10 + (*p - '0');
+        }
+      }
+      if (p >= r->end || *p != '}') { return q; }
+      r->p = p + 1;
+      if (!min) {
+        q = regex_optional;
+      } else if (max > 1 && q == regex_once) {
+        q = regex_repeated;
+      }
+      continue;
+    }
+    break;
+  }
+  return q;
+}
+
+/**
+ * 角括弧で囲まれた文字クラスを読み飛ばす。
+ * @param[in,out] r 解析の状態
+ */
+static void
+skip_regex_bracket(regex_parser *r)
+{
+  const char *p = r->p + 1;
+
+  if (p < r->end && *p == '^') { p++; }
+  if (p < r->end && *p == ']') { p++; }
+  while (p < r->end && *p != ']') {
+    if (*p == '[' && p + 1 < r->end &&
+        (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+      /* [:alpha:] などを読み飛ばす */
+      char close = p[1];
+      for (p += 2; p + 1 < r->end && !(p[0] == close && p[1] == ']'); p++) {}
+      p += 2;
+    } else {
+      p++;
+    }
+  }
+  r->p = (p < r->end) ? p + 1 : r->end;
+}
+
+/**
+ * 続けて現れる文字列に1文字を加える。
+ * @param[in] r 解析の状態
+ * @param[in,out] lit 続けて現れる文字列
+ * @param[in] c 加える文字(UTF-8)
+ * @param[in] c_size 加える文字のバイト数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+append_regex_literal(const regex_parser *r, regex_literal *lit,
+                     const char *c, const int c_size)
+{
+  if (lit->size + c_size > lit->capacity) {
+    int capacity = lit->capacity ? lit->capacity * 2 : 64;
+    char *buf;
+    while (capacity < lit->size + c_size) { capacity *= 2; }
+    if (!(buf = arena_realloc(r->a, lit->buf, lit->capacity, capacity))) {
+      return -1;
+    }
+    lit->buf = buf;
+    lit->capacity = capacity;
+  }
+  memcpy(lit->buf + lit->size, c, c_size);
+  lit->size += c_size;
+  return 0;
+}
+
+/**
+ * 連接の条件に、子ノードを加える。ANDのノードは必要になった時点で作る。
+ * @param[in] r 解析の状態
+ * @param[in,out] and 連接の条件となるANDのノード
+ * @param[in] cond 加える子ノード
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+add_regex_condition(const regex_parser *r, query_node **and,
+                    query_node *cond)
+{
+  if (!*and && !(*and = new_query_node(r->a, query_node_and))) {
+    return -1;
+  }
+  return add_query_child(r->a, *and, cond);
+}
+
+/**
+ * 続けて現れる文字列から、トークンが取り出せればフレーズの条件を作る。
+ * @param[in] r 解析の状態
+ * @param[in,out] lit 続けて現れる文字列。空にする
+ * @param[in,out] and 連接の条件となるANDのノード
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+flush_regex_literal(const regex_parser *r, regex_literal *lit,
+                    query_node **and)
+{
+  query_node *term;
+
+  if (lit->size &&
+      regex_literal_has_token(r->a, lit->buf, lit->size, r->n)) {
+    if (!(term = new_query_term(r->a, lit->buf, lit->size, TRUE)) ||
+        add_regex_condition(r, and, term)) {
+      return -1;
+    }
+  }
+  lit->size = 0;
+  return 0;
+}
+
+/**
+ * 正規表現の連接を解析し、一致する文書が必ず含む文字列の条件を作る。
+ * @param[in,out] r 解析の状態
+ * @param[out] node 条件のノード。条件がない場合はNULL
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+parse_regex_concat(regex_parser *r, query_node **node)
+{
+  int rc = 0;
+  query_node *and = NULL, *sub;
+  regex_literal lit = {NULL, 0, 0};
+
+  while (!rc && r->p < r->end && *r->p != '|' && *r->p != ')') {
+    const char *c = r->p;
+    int c_size;
+    switch (*r->p) {
+    case '(':
+      /* グループは、省略できない場合のみ条件として使う */
+      r->p++;
+      if ((rc = flush_regex_literal(r, &lit, &and)) ||
+          (rc = parse_regex_alt(r, &sub))) {
+        continue;
+      }
+      if (r->p < r->end && *r->p == ')') { r->p++; }
+      if (skip_regex_quantifier(r) != regex_optional && sub) {
+        rc = add_regex_condition(r, &and, sub);
+      }
+      continue;
+    case '[':
+      skip_regex_bracket(r);
+      skip_regex_quantifier(r);
+      rc = flush_regex_literal(r, &lit, &and);
+      continue;
+    case '.': case '^': case '$':
+    case '*': case '+': case '?': case '{':
+      r->p++;
+      skip_regex_quantifier(r);
+      rc = flush_regex_literal(r, &lit, &and);
+      continue;
+    case '\\':
+      /* \d や \1 などは文字列の条件にしない。それ以外は続く文字そのもの */
+      if (r->p + 1 >= r->end || isalnum((unsigned char)r->p[1])) {
+        r->p = (r->p + 2 < r->end) ? r->p + 2 : r->end;
+        skip_regex_quantifier(r);
+        rc = flush_regex_literal(r, &lit, &and);
+        continue;
+      }
+      c = r->p + 1;
+      break;
+    }
+    c_size = utf8_char_size(c, r->end);
+    r->p = c + c_size;
+    switch (skip_regex_quantifier(r)) {
+    case regex_once:
+      rc = append_regex_literal(r, &lit, c, c_size);
+      break;
+    case regex_repeated:
+      /* 1回は必ず現れるが、その後に続く文字とは離れることがある */
+      if (!(rc = append_regex_literal(r, &lit, c, c_size))) {
+        rc = flush_regex_literal(r, &lit, &and);
+      }
+      break;
+    case regex_optional:
+      rc = flush_regex_literal(r, &lit, &and);
+      break;
+    }
+  }
+  if (!rc) { rc = flush_regex_literal(r, &lit, &and); }
+  if (rc) { return -1; }
+  if (and && and->children_count == 1) {
+    /* 条件が1つだけなら、ANDのノードは使わない */
+    *node = and->children[0];
+  } else {
+    *node = and;
+  }
+  return 0;
+}
+
+/**
+ * 正規表現の選択を解析し、一致する文書が必ず含む文字列の条件を作る。
+ * いずれかの選択肢に条件がなければ、全体としても条件はない。
+ * @param[in,out] r 解析の状態
+ * @param[out] node 条件のノード。条件がない場合はNULL
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+parse_regex_alt(regex_parser *r, query_node **node)
+{
+  int unconstrained = FALSE;
+  query_node *or, *branch;
+
+  *node = NULL;
+  if (parse_regex_concat(r, &branch)) { return -1; }
+  if (r->p >= r->end || *r->p != '|') {
+    *node = branch;
+    return 0;
+  }
+  if (!(or = new_query_node(r->a, query_node_or))) { return -1; }
+  for (;;) {
+    if (!branch) {
+      unconstrained = TRUE;
+    } else if (add_query_child(r->a, or, branch)) {
+      return -1;
+    }
+    if (r->p >= r->end || *r->p != '|') { break; }
+    r->p++;
+    if (parse_regex_concat(r, &branch)) { return -1; }
+  }
+  if (!unconstrained) { *node = or; }
+  return 0;
+}
+
+/**
+ * POSIX拡張正規表現から、一致する文書が必ず含む文字列の条件を
+ * AND/ORとフレーズの演算子木として取り出す。
+ * 省略できない部分にあるN文字以上の続いた文字列がフレーズの条件となり、
+ * 連接はAND、選択はORとなる。文字クラスや省略できる要素は条件にしない。
+ * @param[in] a 演算子木を切り出すアリーナ
+ * @param[in] regex 正規表現(UTF-8)。構文が正しいことは確認済みであること
+ * @param[in] regex_size 正規表現のバイト数
+ * @param[in] n N-gramのN
+ * @param[out] root 演算子木の根。アリーナが所有する。
+ *                  条件が取り出せない場合はNULL
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+parse_regex_query(arena *a, const char *regex, const int regex_size,
+                  const int n, query_node **root)
+{
+  regex_parser r;
+
+  r.p = regex;
+  r.end = regex + regex_size;
+  r.n = n;
+  r.a = a;
+  return parse_regex_alt(&r, root);
+}
+
+/**
+ * 子ノードのうち、親と同じ種類のものを取り除き、その子ノードを直接持たせる。
+ * @param[in] a 子ノードの配列を切り出すアリーナ
+ * @param[in,out] node ANDかORのノード
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+flatten_query_node(arena *a, query_node *node)
+{
+  int i, j, n = 0;
+  query_node **children;
+
+  for (i = 0; i < node->children_count; i++) {
+    const query_node *child = node->children[i];
+    n += (child->type == node->type) ? child->children_count : 1;
+  }
+  if (n == node->children_count) { return 0; }
+  if (!(children = arena_alloc(a, sizeof(query_node *) * n))) { return -1; }
+  for (i = 0, n = 0; i < node->children_count; i++) {
+    query_node *child = node->children[i];
+    if (child->type == node->type) {
+      for (j = 0; j < child->children_count; j++) {
+        children[n++] = child->children[j];
+      }
+    } else {
+      children[n++] = child;
+    }
+  }
+  node->children = children;
+  node->children_count = n;
+  return 0;
+}
+
+/**
+ * ANDの子ノードを、一致する文書数の見積もりの昇順に並べるために比較する。
+ * NOTは、候補の文書を読み飛ばすための条件として最後に置く。
+ * @param[in] a 子ノード
+ * @param[in] b 子ノード
+ * @return 順序の大小関係
+ */
+static int
+query_node_cost_cmp(const void *a, const void *b)
+{
+  const query_node *na = *(query_node * const *)a,
+                    *nb = *(query_node * const *)b;
+  if ((na->type == query_node_not) != (nb->type == query_node_not)) {
+    return (na->type == query_node_not) ? 1 : -1;
+  }
+  return (na->cost > nb->cost) - (na->cost < nb->cost);
+}
+
+/**
+ * 演算子木のノードを書き換え、一致する文書数を見積もる。
+ * @param[in] a 書き換えたノードを切り出すアリーナ
+ * @param[in,out] node 演算子木のノード
+ * @param[in] in_and 親ノードがANDかどうか
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+plan_query_node(arena *a, query_node *node, const int in_and)
+{
+  int i;
+  long long cost = 0;
+
+  switch (node->type) {
+  case query_node_term:
+    return 0;
+  case query_node_not:
+    /* 二重の否定は取り除く */
+    if (node->children[0]->type == query_node_not) {
+      *node = *node->children[0]->children[0];
+      return plan_query_node(a, node, in_and);
+    }
+    if (!in_and) {
+      print_error("NOT must be combined with other terms by AND.");
+      return -1;
+    }
+    if (plan_query_node(a, node->children[0], FALSE)) { return -1; }
+    node->cost = node->children[0]->cost;
+    return 0;
+  case query_node_and:
+  case query_node_or:
+    for (i = 0; i < node->children_count; i++) {
+      if (plan_query_node(a, node->children[i],
+                          node->type == query_node_and)) {
+        return -1;
+      }
+    }
+    if (flatten_query_node(a, node)) { return -1; }
+    qsort(node->children, node->children_count, sizeof(query_node *),
+          query_node_cost_cmp);
+    if (node->type == query_node_and) {
+      if (node->children[0]->type == query_node_not) {
+        print_error("NOT must be combined with other terms by AND.");
+        return -1;
+      }
+      node->cost = node->children[0]->cost;
+    } else {
+      for (i = 0; i < node->children_count; i++) {
+        cost += node->children[i]->cost;
+      }
+      node->cost = (cost > INT_MAX) ? INT_MAX : cost;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+/**
+ * 語のノードごとのcostを元に、演算子木を検索に適した形に書き換える。
+ * 入れ子になった同じ種類のAND/ORを平らにし、二重の否定を取り除く。
+ * ANDの子ノードは一致する文書数の見積もりが少ないものから並べ、
+ * NOTは最後に置いて候補の文書を読み飛ばすための条件として使う。
+ * @param[in] a 書き換えたノードを切り出すアリーナ
+ * @param[in,out] node 演算子木の根。語のノードのcostは設定済みであること
+ * @retval 0 成功
+ * @retval -1 失敗。NOTがANDの子ノードになっていない場合など
+ */
+int
+plan_query(arena *a, query_node *node)
+{
+  return plan_query_node(a, node, FALSE);
+}
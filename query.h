@@ -0,0 +1,12 @@
+#ifndef __QUERY_H__
+#define __QUERY_H__
+
+#include "wiser.h"
+
+int parse_query(arena *a, const char *query, const int query_size,
+                query_node **root);
+int parse_regex_query(arena *a, const char *regex, const int regex_size,
+                      const int n, query_node **root);
+int plan_query(arena *a, query_node *node);
+
+#endif /* __QUERY_H__ */
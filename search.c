@@ -1,32 +1,225 @@
 #include <math.h>
+#include <regex.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "util.h"
+
+/* 検索クエリから作る連想配列は、検索の実行状態のアリーナから切り出す。
+   uthash.hより前に定義し、検索の間に連想配列の領域を開放することはない */
+static arena *query_hash_arena;
+#define uthash_malloc(sz) arena_alloc(query_hash_arena, sz)
+#define uthash_free(ptr, sz)
+
 #include "token.h"
 #include "database.h"
 #include "postings.h"
+#include "cache.h"
+#include "query.h"
 
 /* inverted_index_hash/value型とpostings_list型を検索にも流用する */
 typedef inverted_index_hash query_token_hash;
 typedef inverted_index_value query_token_value;
 typedef postings_list token_positions_list;
 
+/* 文書IDの列を配列として読み進めるカーソル */
 typedef struct {
   token_positions_list *documents; /* 文書IDの列 */
   token_positions_list *current;   /* 現在参照している文書ID */
+  token_positions_list **entries;  /* 文書IDの列の各要素を指す配列 */
+  int *document_ids;               /* 文書IDの列の各要素の文書ID */
+  int count;                       /* 文書IDの列の要素数 */
+  int index;                       /* 現在参照している要素の添字 */
+  int gallop;                      /* galloping searchで読み進めるかどうか */
+  int cached;                      /* 文書IDの列をキャッシュが所有しているか */
+  postings_stream *stream;         /* 文書IDの列を必要な分だけ復号する場合 */
+  const query_token_value *token;  /* 検索クエリのトークン */
+  double idf;                      /* トークンのIDF */
 } doc_search_cursor;
 
+/* 2段階評価で、フレーズの確認を後回しにする候補の配列の要素 */
+static const UT_icd search_candidate_icd = {
+  sizeof(search_result_entry), NULL, NULL, NULL
+};
+
+/* 他のカーソルより何倍以上長い文書IDの列を、galloping searchで読み進めるか */
+#define SEARCH_GALLOP_RATIO 4
+
+/* 2段階評価で、上位k件の何倍の候補の文書を保持するか */
+#define SEARCH_CANDIDATES_RATIO 4
+
+/* フレーズ検索で、トークンを後回しにして本文で確かめる候補の文書数の上限 */
+#define SEARCH_DEFER_MAX_CANDIDATES 256
+
+/* OR検索(Block-Max WAND)でのカーソル */
+typedef struct {
+  doc_search_cursor docs;          /* 文書IDの列のカーソル */
+  postings_block *blocks;          /* ブロックごとの情報 */
+  int blocks_count;                /* ブロックの数 */
+  int blocks_owned;                /* blocksをカーソルが所有しているか */
+  int block;                       /* 現在参照しているブロック */
+  double max_score;                /* トークンのスコアの上限 */
+} wand_cursor;
+
+/* 文書数の見積もりで、本文を確かめる標本の最大の文書数 */
+#define ESTIMATE_SAMPLE_DOCS 256
+/* 95%信頼区間を求める、標準正規分布の両側5%点 */
+#define ESTIMATE_Z 1.96
+
+/* インパクト順のポスティングリストで検索する、クエリの最大のトークン数 */
+#define IMPACT_SEARCH_MAX_TOKENS 2
+
+/* インパクト順のポスティングリストの、検索時に読むセグメント */
+typedef struct {
+  int offset;                     /* セグメントの文書の並びのバイト位置 */
+  int postings_count;             /* セグメント内の文書数 */
+  double bound;                   /* セグメント内の文書のスコアの上限 */
+} impact_segment_ref;
+
+/* インパクト順のポスティングリストを、セグメントごとに読み進めるカーソル */
+typedef struct {
+  const query_token_value *token; /* 検索クエリのトークン */
+  double idf;                     /* トークンのIDF */
+  int segments_count;             /* セグメントの数 */
+  impact_segment_ref *segments;   /* スコアの上限の降順に並べたセグメント */
+  int segment;                    /* 次に読むセグメント */
+  impact_posting *postings;       /* 最後に読んだセグメントの文書 */
+  int postings_count;             /* postingsの要素数 */
+  int postings_capacity;          /* postingsに確保した要素数 */
+  buffer *memory;                 /* メモリ上で作成した場合の、全体の内容 */
+  double bound;                   /* 読んでいないセグメントのスコアの上限。0で終わり */
+} impact_cursor;
+
+/* 検索クエリ中のトークンの出現位置 */
+typedef struct {
+  int position;              /* クエリ内でのトークンの位置 */
+  query_token_value *token;  /* トークン */
+} query_token_position;
+
+/* 候補の文書の本文で出現を確かめる、検索クエリのトークン */
+typedef struct {
+  UTF32Char *text;            /* トークンの文字列 */
+  int text_len;               /* トークンの文字長 */
+  token_positions_list entry; /* 候補の文書中での出現位置 */
+} deferred_token;
+
 typedef struct {
   const UT_array *positions; /* 位置情報 */
   int base;                  /* クエリ内でのトークンの位置 */
   int *current;              /* 現在参照している位置情報 */
 } phrase_search_cursor;
 
+/* スニペットの位置を選ぶための、文書中でのトークンの出現 */
+typedef struct {
+  int position;              /* 文書中でのトークンの位置 */
+  double weight;             /* トークンのIDF */
+} snippet_hit;
+
+static const UT_icd snippet_hit_icd = {
+  sizeof(snippet_hit), NULL, NULL, NULL
+};
+
+/* UTF-32に変換した文書の本文の配列の要素 */
+static const UT_icd utf32_char_icd = {
+  sizeof(UTF32Char), NULL, NULL, NULL
+};
+
+/**
+ * 出現位置の配列を初期化する。
+ * @param[out] p 初期化する配列
+ */
+static void
+init_positions_array(void *p)
+{
+  utarray_init((UT_array *)p, &ut_int_icd);
+}
+
+/**
+ * 出現位置の配列が確保した領域を開放する。
+ * @param[in] p 開放する配列
+ */
+static void
+done_positions_array(void *p)
+{
+  utarray_done((UT_array *)p);
+}
+
+/* 後回しにしたトークンごとの出現位置の配列を、使い回す配列の要素 */
+static const UT_icd positions_array_icd = {
+  sizeof(UT_array), init_positions_array, NULL, done_positions_array
+};
+
+/* スニペットとして表示するトークンの位置の数 */
+#define SNIPPET_LENGTH 40
+/* スニペットで、最初の出現より前に表示するトークンの位置の数 */
+#define SNIPPET_CONTEXT 10
+
+/* BM25のパラメータ */
+#define BM25_K1 1.2  /* 出現回数の影響の飽和の度合い */
+#define BM25_B  0.75 /* 文書長による正規化の度合い */
+
+/* 1回の検索の間、共通して用いるスコア計算の定数 */
+typedef struct {
+  scoring_method method;         /* スコアの計算方法 */
+  int indexed_count;             /* インデックス化された全文書数 */
+  const int *document_lengths;   /* 文書IDを添字とする文書長の配列 */
+  int document_lengths_count;    /* document_lengthsの要素数 */
+  double norm_base;              /* BM25の正規化項のうち文書長によらない部分 */
+  double norm_per_length;        /* BM25の正規化項の文書長1あたりの値 */
+  double norm_default;           /* 文書長が不明な文書の正規化項 */
+} search_scorer;
+
+/* 検索結果を集める */
+typedef struct {
+  int k;                       /* 上位何件を保持するか。0以下の場合は無制限 */
+  int total_count;             /* 検索条件に一致した文書数 */
+  int count_is_lower_bound;    /* 枝刈りによりtotal_countが下限値となったか */
+  int count_only;              /* 文書数だけを数えるかどうか */
+  int candidates_dropped;      /* 2段階評価で、上限を超えた候補を捨てたか */
+  score_accumulators *accumulators; /* kが無制限の場合の、文書ごとのスコア */
+  UT_array *documents;         /* kが無制限の場合の、スコアを加えた文書IDの列 */
+  arena *arena;                /* heapを確保するアリーナ */
+  int heap_len;                /* heapに保持している件数 */
+  search_result_entry *heap;   /* 上位k件を保持する、スコアの最小ヒープ。
+                                  並べ替えた後は、スコアの降順の検索結果 */
+} search_results_collector;
+
+/* ブール検索クエリの語ごとの検索状態 */
+typedef struct {
+  wiser_env *env;             /* 後回しにしたトークンを確かめる環境 */
+  query_token_hash *tokens;   /* 語から取り出したトークン */
+  doc_search_cursor *cursors; /* トークンごとのカーソル群。後回しにした
+                                 トークンのカーソルは、tokensの分の後に置く */
+  int n_cursors;              /* 作成したカーソルの数 */
+  deferred_token *deferred;   /* 後回しにしたトークン */
+  int n_deferred;             /* 後回しにしたトークンの数 */
+  phrase_search_cursor *phrase_cursors; /* フレーズ検索での作業用のカーソル群 */
+  int empty;                  /* 語に一致する文書がないことが分かっているか */
+  int phrase;                 /* トークンの位置を確かめるかどうか */
+} query_term_cursor;
+
+/* 文書IDの範囲ごとに文書検索を行うための情報 */
 typedef struct {
-  int document_id;           /* 検索された文書ID */
-  double score;              /* 検索スコア */
-  UT_hash_handle hh;         /* ハッシュの要素 */
-} search_results;
+  wiser_env *env;                    /* アプリケーション環境 */
+  const search_scorer *scorer;       /* スコア計算の定数 */
+  doc_search_cursor *cursors;        /* 文書検索でのカーソル群 */
+  int n_tokens;                      /* 候補の文書を絞り込むトークンの数 */
+  deferred_token *deferred;          /* 後回しにしたトークン */
+  int n_deferred;                    /* 後回しにしたトークンの数 */
+  int end;                           /* cursors[0]のこの添字の手前で止める */
+  search_results_collector *results; /* 検索結果を集める構造体 */
+  UT_array *candidates;              /* 2段階評価での候補の文書 */
+  phrase_search_cursor *phrase_cursors; /* フレーズ検索での作業用のカーソル群 */
+  int check_phrase;                  /* 数える際にフレーズを確かめるか */
+  UT_array *snippet_hits;            /* スニペットの位置を選ぶ作業用の配列 */
+  search_results_collector collector; /* 並列実行時の、範囲ごとの検索結果 */
+  pthread_t thread;                  /* 並列実行時のスレッド */
+  int started;                       /* スレッドを開始したかどうか */
+} search_range;
+
+/* 並列に検索する場合に、ひとつの範囲が最低限含む文書数 */
+#define SEARCH_PARALLEL_MIN_DOCS 1024
 
 /**
  * ふたつのtokenについて、それぞれが出現する文書数を比較する
@@ -35,78 +228,491 @@ typedef struct {
  * @return 文書数の大小関係
  */
 static int
-query_token_value_docs_count_desc_sort(query_token_value *a,
-                                       query_token_value *b)
+query_token_value_docs_count_asc_sort(query_token_value *a,
+                                      query_token_value *b)
+{
+  return a->docs_count - b->docs_count;
+}
+
+/**
+ * 上位k件の検索結果の２エントリを比較する。
+ * スコアが同じ場合は、文書IDが小さい方を上位とする。
+ * @param[in] a 検索結果のエントリ
+ * @param[in] b 検索結果のエントリ
+ * @return aがbより下位であれば真
+ */
+static inline int
+search_result_entry_lower(const search_result_entry *a,
+                          const search_result_entry *b)
 {
-  return b->docs_count - a->docs_count;
+  return a->score < b->score ||
+         (a->score == b->score && a->document_id > b->document_id);
 }
 
 /**
- * 検索結果の２エントリを、スコアで比較する
+ * 上位k件の検索結果の２エントリを、スコアの降順に並べるために比較する
  * @param[in] a 検索結果のエントリ
  * @param[in] b 検索結果のエントリ
- * @return スコアの大小関係
+ * @return 順序の大小関係
+ */
+static int
+search_result_entry_desc_cmp(const void *a, const void *b)
+{
+  const search_result_entry *ea = a, *eb = b;
+  if (search_result_entry_lower(ea, eb)) { return 1; }
+  if (search_result_entry_lower(eb, ea)) { return -1; }
+  return 0;
+}
+
+/**
+ * 最小ヒープで、指定位置の要素を下方に移動させる。
+ * @param[in,out] heap 最小ヒープ
+ * @param[in] heap_len ヒープの要素数
+ * @param[in] i 移動させる要素の位置
+ */
+static void
+search_result_heap_down(search_result_entry *heap, int heap_len, int i)
+{
+  search_result_entry e = heap[i];
+  for (;;) {
+    int c = i * 2 + 1;
+    if (c >= heap_len) { break; }
+    if (c + 1 < heap_len &&
+        search_result_entry_lower(&heap[c + 1], &heap[c])) {
+      c++;
+    }
+    if (!search_result_entry_lower(&heap[c], &e)) { break; }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = e;
+}
+
+/**
+ * 最小ヒープで、指定位置の要素を上方に移動させる。
+ * @param[in,out] heap 最小ヒープ
+ * @param[in] i 移動させる要素の位置
+ */
+static void
+search_result_heap_up(search_result_entry *heap, int i)
+{
+  search_result_entry e = heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!search_result_entry_lower(&e, &heap[parent])) { break; }
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = e;
+}
+
+/**
+ * 2段階評価の候補の文書を、スコアの最小ヒープに加える。
+ * 上位k件のSEARCH_CANDIDATES_RATIO倍を超える分は、スコアの低いものから捨てる。
+ * @param[in,out] results 検索結果を集める構造体
+ * @param[in,out] candidates 候補の文書のスコアの最小ヒープ
+ * @param[in] e 加える候補の文書
+ */
+static void
+add_search_candidate(search_results_collector *results, UT_array *candidates,
+                     const search_result_entry *e)
+{
+  int n = utarray_len(candidates);
+  search_result_entry *heap;
+
+  if (n < (long long)results->k * SEARCH_CANDIDATES_RATIO) {
+    utarray_push_back(candidates, e);
+    search_result_heap_up((search_result_entry *)utarray_front(candidates), n);
+    return;
+  }
+  results->candidates_dropped = TRUE;
+  heap = (search_result_entry *)utarray_front(candidates);
+  if (search_result_entry_lower(&heap[0], e)) {
+    heap[0] = *e;
+    search_result_heap_down(heap, n, 0);
+  }
+}
+
+/**
+ * アキュムレータの要素数を、指定の文書IDまで扱えるように増やす。
+ * @param[in,out] acc アキュムレータ
+ * @param[in] capacity 必要な要素数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+reserve_score_accumulators(score_accumulators *acc, int capacity)
+{
+  search_result_entry *entries;
+  unsigned int *seen, *stamps;
+
+  if (capacity <= acc->capacity) { return 0; }
+  if (capacity < acc->capacity * 2) { capacity = acc->capacity * 2; }
+  if (!(entries = realloc(acc->entries,
+                          sizeof(search_result_entry) * capacity))) {
+    goto error;
+  }
+  acc->entries = entries;
+  if (!(seen = realloc(acc->seen, sizeof(unsigned int) * capacity))) {
+    goto error;
+  }
+  acc->seen = seen;
+  if (!(stamps = realloc(acc->stamps, sizeof(unsigned int) * capacity))) {
+    goto error;
+  }
+  acc->stamps = stamps;
+  /* 増やした要素は、どの検索でも書き込まれていないものとする */
+  memset(acc->stamps + acc->capacity, 0,
+         sizeof(unsigned int) * (capacity - acc->capacity));
+  acc->capacity = capacity;
+  return 0;
+error:
+  print_error("cannot allocate memory for score accumulators.");
+  return -1;
+}
+
+/**
+ * アキュムレータを、新しい検索で使えるようにする。
+ * 要素は消去せず、検索の番号を進めて古い内容を無効にする。
+ * @param[in,out] acc アキュムレータ
+ */
+static void
+reset_score_accumulators(score_accumulators *acc)
+{
+  if (!++acc->stamp) {
+    /* 番号が一巡したので、古い番号が残らないように消去する */
+    if (acc->stamps) {
+      memset(acc->stamps, 0, sizeof(unsigned int) * acc->capacity);
+    }
+    acc->stamp = 1;
+  }
+}
+
+/**
+ * 作業用の配列を取得する。初めて使う場合は作成する。
+ * 配列の内容は、使う側で消去する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] i 作業用の配列の番号。0は範囲に分けない検索、
+ *              1以降は並列に検索する範囲ごとに使う
+ * @return 作業用の配列。失敗した場合はNULL。
+ *         別の番号を取得するとアドレスが変わりうるので、保持しないこと
+ */
+static query_scratch *
+get_query_scratch(wiser_env *env, int i)
+{
+  query_context *ctx = &env->query;
+  query_scratch *scratch;
+
+  if (i >= ctx->scratches_count) {
+    if (!(scratch = realloc(ctx->scratches, sizeof(query_scratch) * (i + 1)))) {
+      print_error("cannot allocate memory for query scratch.");
+      return NULL;
+    }
+    memset(scratch + ctx->scratches_count, 0,
+           sizeof(query_scratch) * (i + 1 - ctx->scratches_count));
+    ctx->scratches = scratch;
+    ctx->scratches_count = i + 1;
+  }
+  scratch = &ctx->scratches[i];
+  if (!scratch->documents) {
+    utarray_new(scratch->documents, &ut_int_icd);
+    utarray_new(scratch->candidates, &search_candidate_icd);
+    utarray_new(scratch->snippet_hits, &snippet_hit_icd);
+    utarray_new(scratch->body, &utf32_char_icd);
+    utarray_new(scratch->deferred_positions, &positions_array_icd);
+  }
+  return scratch;
+}
+
+/**
+ * 検索の実行状態を、新しい検索で使えるようにする。
+ * 前の検索でアリーナから切り出した領域は、すべて再利用される。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+static void
+reset_query_context(wiser_env *env)
+{
+  arena_reset(&env->query.arena);
+  query_hash_arena = &env->query.arena;
+}
+
+/**
+ * 検索の実行状態が使った領域を解放する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+void
+fin_query_context(wiser_env *env)
+{
+  int i;
+  query_context *ctx = &env->query;
+  score_accumulators *acc = &ctx->accumulators;
+
+  fin_arena(&ctx->arena);
+  if (acc->entries) { free(acc->entries); }
+  if (acc->seen) { free(acc->seen); }
+  if (acc->stamps) { free(acc->stamps); }
+  for (i = 0; i < ctx->scratches_count; i++) {
+    query_scratch *scratch = &ctx->scratches[i];
+    if (scratch->documents) { utarray_free(scratch->documents); }
+    if (scratch->candidates) { utarray_free(scratch->candidates); }
+    if (scratch->snippet_hits) { utarray_free(scratch->snippet_hits); }
+    if (scratch->body) { utarray_free(scratch->body); }
+    if (scratch->deferred_positions) {
+      utarray_free(scratch->deferred_positions);
+    }
+  }
+  if (ctx->scratches) { free(ctx->scratches); }
+  memset(ctx, 0, sizeof(query_context));
+}
+
+/**
+ * 検索結果の収集を開始する。
+ * kが無制限の場合、スコアは文書IDを添字とするアキュムレータに集める。
+ * アキュムレータは検索の間で使い回すため、同時に収集できるのは1つだけとなる。
+ * heapはアリーナから確保するので、解放は不要となる。
+ * @param[out] collector 検索結果を集める構造体
+ * @param[in] a heapを確保するアリーナ
+ * @param[in] accumulators kが無制限の場合に使うアキュムレータ。
+ *                         NULLの場合は、呼び出し側で共有するものを設定する
+ * @param[in] documents kが無制限の場合に、文書IDの列を集める作業用の配列
+ * @param[in] k 上位何件を保持するか。0以下の場合は無制限
+ * @retval 0 成功
+ * @retval -1 失敗
  */
 static int
-search_results_score_desc_sort(search_results *a, search_results *b)
+init_search_results_collector(search_results_collector *collector, arena *a,
+                              score_accumulators *accumulators,
+                              UT_array *documents, int k)
 {
-  return (b->score > a->score) ? 1 : (b->score < a->score) ? -1 : 0;
+  memset(collector, 0, sizeof(search_results_collector));
+  collector->k = k;
+  collector->arena = a;
+  if (k > 0) {
+    if (!(collector->heap = arena_alloc(a, sizeof(search_result_entry) * k))) {
+      print_error("cannot allocate memory for search results.");
+      return -1;
+    }
+  } else {
+    utarray_clear(documents);
+    collector->documents = documents;
+    if ((collector->accumulators = accumulators)) {
+      reset_score_accumulators(accumulators);
+    }
+  }
+  return 0;
 }
 
 /**
  * 検索結果に文書を追加する。
- * @param[in] results 検索結果へのポインタ
+ * kが指定されている場合は、上位k件に入る文書だけを保持する。
+ * kが無制限の場合は、同じ文書のスコアを加算する。
+ * 文書数だけを数える場合は、同じ文書を重複して数えないためだけに使う。
+ * @param[in] collector 検索結果を集める構造体
  * @param[in] document_id 追加する文書のID
  * @param[in] score スコア
+ * @param[in] snippet_position スニペットを始めるトークンの位置。-1で文書の先頭
  */
 static void
-add_search_result(search_results **results, const int document_id,
-                  const double score)
+add_search_result(search_results_collector *collector,
+                  const int document_id, const double score,
+                  const int snippet_position)
 {
-  search_results *r;
-  if (*results) {
-    HASH_FIND_INT(*results, &document_id, r);
-  } else {
-    r = NULL;
+  score_accumulators *acc = collector->accumulators;
+  search_result_entry *r;
+
+  if (collector->k > 0) {
+    search_result_entry e;
+    e.document_id = document_id;
+    e.score = score;
+    e.snippet_position = snippet_position;
+    collector->total_count++;
+    if (collector->heap_len < collector->k) {
+      collector->heap[collector->heap_len] = e;
+      search_result_heap_up(collector->heap, collector->heap_len++);
+    } else if (search_result_entry_lower(&collector->heap[0], &e)) {
+      /* 上位k件の最下位と入れ替える */
+      collector->heap[0] = e;
+      search_result_heap_down(collector->heap, collector->heap_len, 0);
+    }
+    return;
+  }
+
+  if (document_id >= acc->capacity &&
+      reserve_score_accumulators(acc, document_id + 1)) {
+    return;
+  }
+  r = &acc->entries[document_id];
+  if (acc->stamps[document_id] != acc->stamp) {
+    /* この検索で初めて現れた文書 */
+    acc->stamps[document_id] = acc->stamp;
+    acc->seen[document_id] = 0;
+    r->document_id = document_id;
+    r->score = 0;
+    r->snippet_position = snippet_position;
+    if (!collector->count_only) {
+      utarray_push_back(collector->documents, &document_id);
+    }
+    collector->total_count++;
+  }
+  r->score += score;
+}
+
+/**
+ * 集めた検索結果を、スコアの降順に並べる。
+ * kが無制限の場合は、アキュムレータから文書を取り出してheapに並べる。
+ * @param[in] collector 検索結果を集める構造体
+ */
+static void
+sort_search_results(search_results_collector *collector)
+{
+  if (collector->count_only) { return; }
+  if (collector->k <= 0) {
+    int i, n = utarray_len(collector->documents);
+    const int *ids = (const int *)utarray_front(collector->documents);
+    search_result_entry *heap;
+    if (!(heap = arena_alloc(collector->arena,
+                             sizeof(search_result_entry) * n))) {
+      print_error("cannot allocate memory for search results.");
+      return;
+    }
+    collector->heap = heap;
+    for (i = 0; i < n; i++) {
+      heap[i] = collector->accumulators->entries[ids[i]];
+    }
+    collector->heap_len = n;
+  }
+  qsort(collector->heap, collector->heap_len, sizeof(search_result_entry),
+        search_result_entry_desc_cmp);
+}
+
+/**
+ * カーソルが指す文書中での、トークンの出現位置を加える。
+ * 出現位置は昇順なので、位置の順に並んでいる配列と末尾から併合する。
+ * @param[in,out] hits 位置の順に並んだトークンの出現の配列
+ * @param[in] cur 文書検索でのカーソル
+ */
+static void
+add_snippet_hits(UT_array *hits, const doc_search_cursor *cur)
+{
+  int i, j, k;
+  const int *positions;
+  snippet_hit *h;
+
+  if (!cur->current || !cur->current->positions ||
+      !(j = utarray_len(cur->current->positions))) {
+    return;
+  }
+  i = utarray_len(hits);
+  k = i + j;
+  utarray_resize(hits, k);
+  h = (snippet_hit *)utarray_front(hits);
+  positions = (const int *)utarray_front(cur->current->positions);
+  while (j > 0) {
+    if (i > 0 && h[i - 1].position > positions[j - 1]) {
+      h[--k] = h[--i];
+    } else {
+      h[--k].position = positions[--j];
+      h[k].weight = cur->idf;
+    }
   }
-  if (!r) {
-    if ((r = malloc(sizeof(search_results)))) {
-      r->document_id = document_id;
-      r->score = 0;
-      HASH_ADD_INT(*results, document_id, r);
+}
+
+/**
+ * スニペットとして表示する範囲に含まれるトークンのIDFの和が
+ * 最大となるように、スニペットを始めるトークンの位置を選ぶ。
+ * @param[in] hits 位置の順に並んだトークンの出現の配列
+ * @return スニペットを始めるトークンの位置。出現がない場合は-1
+ */
+static int
+choose_snippet_position(const UT_array *hits)
+{
+  int i, j = 0, n = utarray_len(hits), best = -1;
+  double weight = 0, best_weight = 0;
+  snippet_hit *h;
+
+  if (!n) { return -1; }
+  h = (snippet_hit *)utarray_front(hits);
+  /* h[j]からh[i]までが、表示する範囲に収まる出現となる窓を動かす */
+  for (i = 0; i < n; i++) {
+    weight += h[i].weight;
+    while (h[i].position - h[j].position >=
+           SNIPPET_LENGTH - SNIPPET_CONTEXT) {
+      weight -= h[j++].weight;
     }
+    if (best < 0 || weight > best_weight) {
+      best = h[j].position;
+      best_weight = weight;
+    }
+  }
+  best -= SNIPPET_CONTEXT;
+  return (best > 0) ? best : 0;
+}
+
+/**
+ * カーソル群が指す文書について、スニペットを始めるトークンの位置を求める。
+ * @param[in,out] hits 作業用のトークンの出現の配列。NULLの場合は求めない
+ * @param[in] cursors 文書検索でのカーソル群
+ * @param[in] n_cursors 文書検索でのカーソル数
+ * @return スニペットを始めるトークンの位置。求めない場合は-1
+ */
+static int
+find_snippet_position(UT_array *hits, const doc_search_cursor *cursors,
+                      const int n_cursors)
+{
+  int i;
+
+  if (!hits) { return -1; }
+  utarray_clear(hits);
+  for (i = 0; i < n_cursors; i++) {
+    add_snippet_hits(hits, &cursors[i]);
   }
-  if (r) {
-    r->score += score;
+  return choose_snippet_position(hits);
+}
+
+/**
+ * フレーズ検索で使うカーソル群を、アリーナから確保する。
+ * 候補の文書ごとに確保し直さないよう、検索の初めに1度だけ確保する。
+ * @param[in] a 確保するアリーナ
+ * @param[in] doc_cursors 文書検索でのカーソル群
+ * @param[in] n_doc_cursors 文書検索でのカーソル数
+ * @return フレーズ検索でのカーソル群。失敗した場合はNULL
+ */
+static phrase_search_cursor *
+alloc_phrase_search_cursors(arena *a, const doc_search_cursor *doc_cursors,
+                            const int n_doc_cursors)
+{
+  int i, n_positions = 0;
+
+  for (i = 0; i < n_doc_cursors; i++) {
+    n_positions += doc_cursors[i].token->positions_count;
   }
+  return arena_alloc(a, sizeof(phrase_search_cursor) * n_positions);
 }
 
 /**
  * フレーズ検索を行う。
- * @param[in] query_tokens 検索クエリから作ったトークン情報
  * @param[in] doc_cursors 文書検索でのカーソル群
+ * @param[in] n_doc_cursors 文書検索でのカーソル数
+ * @param[out] cursors alloc_phrase_search_cursorsで確保した作業用のカーソル群
  * @return 検索されたフレーズ数
  */
 static int
-search_phrase(const query_token_hash *query_tokens,
-              doc_search_cursor *doc_cursors)
+search_phrase(doc_search_cursor *doc_cursors, const int n_doc_cursors,
+              phrase_search_cursor *cursors)
 {
-  int n_positions = 0;
-  const query_token_value *qt;
-  phrase_search_cursor *cursors;
+  int i, n_positions = 0;
 
   /* クエリの総トークン数を取得する。 */
-  for (qt = query_tokens; qt; qt = qt->hh.next) {
-    n_positions += qt->positions_count;
+  for (i = 0; i < n_doc_cursors; i++) {
+    n_positions += doc_cursors[i].token->positions_count;
   }
 
-  if ((cursors = (phrase_search_cursor *)malloc(sizeof(
-                   phrase_search_cursor) * n_positions))) {
-    int i, phrase_count = 0;
+  if (cursors) {
+    int phrase_count = 0;
     phrase_search_cursor *cur;
     /* カーソルを初期化する */
-    for (i = 0, cur = cursors, qt = query_tokens; qt;
-         i++, qt = qt->hh.next) {
+    for (i = 0, cur = cursors; i < n_doc_cursors; i++) {
+      const query_token_value *qt = doc_cursors[i].token;
       int *pos = NULL;
       while ((pos = (int *)utarray_next(qt->postings_list->positions,
                                         pos))) {
@@ -149,35 +755,140 @@ search_phrase(const query_token_hash *query_tokens,
       }
     }
 exit:
-    free(cursors);
     return phrase_count;
   }
   return 0;
 }
 
 /**
- * TF-IDFでスコアを計算する
- * @param[in] query_tokens 検索クエリ
+ * 検索ごとに共通のスコア計算の定数を求める。
+ * BM25の場合は、文書長の配列を初回のみデータベースから読み込む。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[out] scorer スコア計算の定数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+init_search_scorer(wiser_env *env, search_scorer *scorer)
+{
+  memset(scorer, 0, sizeof(search_scorer));
+  scorer->method = env->scoring;
+  scorer->indexed_count = env->indexed_count;
+  if (scorer->method != scoring_bm25) { return 0; }
+
+  if (!env->document_lengths) {
+    int i, n = 0;
+    long long total = 0;
+    if (db_get_document_lengths(env, &env->document_lengths,
+                                &env->document_lengths_count)) {
+      print_error("cannot load document lengths.");
+      return -1;
+    }
+    for (i = 0; i < env->document_lengths_count; i++) {
+      if (env->document_lengths[i]) {
+        total += env->document_lengths[i];
+        n++;
+      }
+    }
+    env->avg_document_length = n ? (double)total / n : 0;
+  }
+  scorer->document_lengths = env->document_lengths;
+  scorer->document_lengths_count = env->document_lengths_count;
+  scorer->norm_base = BM25_K1 * (1 - BM25_B);
+  if (env->avg_document_length > 0) {
+    scorer->norm_per_length = BM25_K1 * BM25_B / env->avg_document_length;
+  }
+  /* 文書長が不明な文書は、平均的な長さの文書として扱う */
+  scorer->norm_default = BM25_K1;
+  return 0;
+}
+
+/**
+ * トークンのIDFを計算する
+ * @param[in] scorer スコア計算の定数
+ * @param[in] docs_count トークンを含む文書数
+ * @return IDF
+ */
+static double
+calc_idf(const search_scorer *scorer, const int docs_count)
+{
+  if (scorer->method == scoring_bm25) {
+    return log((scorer->indexed_count - docs_count + 0.5) /
+               (docs_count + 0.5) + 1);
+  }
+  return log2((double)scorer->indexed_count / docs_count);
+}
+
+/**
+ * 文書ごとのBM25の正規化項を計算する
+ * @param[in] scorer スコア計算の定数
+ * @param[in] document_id 文書ID
+ * @return 正規化項。TF-IDFの場合は0
+ */
+static double
+calc_document_norm(const search_scorer *scorer, const int document_id)
+{
+  int length;
+  if (scorer->method != scoring_bm25) { return 0; }
+  if (document_id >= scorer->document_lengths_count ||
+      !(length = scorer->document_lengths[document_id])) {
+    return scorer->norm_default;
+  }
+  return scorer->norm_base + scorer->norm_per_length * length;
+}
+
+/**
+ * 1トークン分のスコアを計算する
+ * @param[in] scorer スコア計算の定数
+ * @param[in] tf 文書中のトークンの出現回数
+ * @param[in] idf トークンのIDF
+ * @param[in] norm 文書の正規化項
+ * @return スコア
+ */
+static inline double
+calc_term_score(const search_scorer *scorer, const int tf,
+                const double idf, const double norm)
+{
+  if (scorer->method == scoring_bm25) {
+    return idf * tf * (BM25_K1 + 1) / (tf + norm);
+  }
+  return (double)tf * idf;
+}
+
+/**
+ * 1トークン分のスコアの上限を計算する。
+ * BM25の場合は、文書長を0とみなした値を上限とする。
+ * @param[in] scorer スコア計算の定数
+ * @param[in] max_tf 文書中のトークンの出現回数の上限
+ * @param[in] idf トークンのIDF
+ * @return スコアの上限
+ */
+static double
+calc_term_score_upper_bound(const search_scorer *scorer, const int max_tf,
+                            const double idf)
+{
+  return calc_term_score(scorer, max_tf, idf, scorer->norm_base);
+}
+
+/**
+ * 文書のスコアを計算する
+ * @param[in] scorer スコア計算の定数
  * @param[in] doc_cursors 文書検索でのカーソル群
  * @param[in] n_query_tokens 検索クエリでのトークン数
- * @param[in] indexed_count インデックス化された全文書数
+ * @param[in] document_id 文書ID
  * @return スコア
  */
 static double
-calc_tf_idf(
-  const query_token_hash *query_tokens,
-  doc_search_cursor *doc_cursors, const int n_query_tokens,
-  const int indexed_count)
+calc_score(const search_scorer *scorer,
+           doc_search_cursor *doc_cursors, const int n_query_tokens,
+           const int document_id)
 {
   int i;
-  const query_token_value *qt;
   doc_search_cursor *dcur;
-  double score = 0;
-  for (qt = query_tokens, dcur = doc_cursors, i = 0;
-       i < n_query_tokens;
-       qt = qt->hh.next, dcur++, i++) {
-    double idf = log2((double)indexed_count / qt->docs_count);
-    score += (double)dcur->current->positions_count * idf;
+  double score = 0, norm = calc_document_norm(scorer, document_id);
+  for (dcur = doc_cursors, i = 0; i < n_query_tokens; dcur++, i++) {
+    score += calc_term_score(scorer, dcur->current->positions_count,
+                             dcur->idf, norm);
   }
   return score;
 }
@@ -193,145 +904,2766 @@ free_token_positions_list(token_positions_list *list)
 }
 
 /**
- * 文書検索を行う。
- * @param[in] env アプリケーション環境を保存する構造体
- * @param[in,out] results 検索結果
- * @param[in] tokens 検索クエリから作ったトークン情報
+ * 文書IDの列から、配列として読み進めるカーソルを作成する。
+ * キャッシュが所有していない文書IDの列は、fin_doc_search_cursorで開放する。
+ * キャッシュが配列も保持している場合はそれを使い、そうでない場合は
+ * アリーナから確保した配列に展開するので、検索の間で使い回される。
+ * @param[out] cur 初期化するカーソル
+ * @param[in] documents 文書IDの列
+ * @param[in] count 文書IDの列の要素数
+ * @param[in] entries キャッシュが保持する、各要素を指す配列。NULL指定可
+ * @param[in] document_ids キャッシュが保持する、各要素の文書ID。NULL指定可
+ * @param[in] cached 文書IDの列をキャッシュが所有しているか
+ * @param[in] a 配列を確保するアリーナ
+ * @retval 0 成功
+ * @retval -1 失敗
  */
-void
-search_docs(wiser_env *env, search_results **results,
-            query_token_hash *tokens)
+static int
+init_doc_search_cursor(doc_search_cursor *cur,
+                       token_positions_list *documents, int count,
+                       token_positions_list **entries, int *document_ids,
+                       int cached, arena *a)
 {
-  int n_tokens;
-  doc_search_cursor *cursors;
+  cur->documents = documents;
+  cur->cached = cached;
+  cur->count = count;
+  if (entries && document_ids) {
+    cur->entries = entries;
+    cur->document_ids = document_ids;
+  } else {
+    int i = 0;
+    token_positions_list *p;
+    if (!(cur->entries = arena_alloc(a, sizeof(token_positions_list *) *
+                                     count)) ||
+        !(cur->document_ids = arena_alloc(a, sizeof(int) * count))) {
+      print_error("cannot allocate memory for search cursor.");
+      return -1;
+    }
+    LL_FOREACH(documents, p) {
+      cur->entries[i] = p;
+      cur->document_ids[i] = p->document_id;
+      i++;
+    }
+  }
+  cur->index = 0;
+  cur->current = documents;
+  return 0;
+}
 
-  if (!tokens) { return; }
+/**
+ * ポスティングリストを、先頭から必要な分だけ復号しながら読み進める
+ * カーソルを作成する。文書IDの列を配列に展開しないため、前には戻れない。
+ * @param[out] cur 初期化するカーソル
+ * @param[in] env アプリケーション環境
+ * @param[in] token 検索クエリのトークン
+ * @param[in] need_positions 文書の位置情報を読むか
+ * @param[in] a ストリームを確保するアリーナ
+ * @retval 0 成功
+ * @retval 1 位置情報を読めないため、ストリームは使えない
+ * @retval -1 失敗
+ */
+static int
+init_doc_search_stream(doc_search_cursor *cur, const wiser_env *env,
+                       const query_token_value *token, int need_positions,
+                       arena *a)
+{
+  int rc;
+
+  if (!(cur->stream = arena_alloc(a, sizeof(postings_stream)))) {
+    print_error("cannot allocate memory for search cursor.");
+    return -1;
+  }
+  if ((rc = open_postings_stream(env, token->token_id, token->docs_count,
+                                 need_positions, cur->stream))) {
+    cur->stream = NULL;
+    return rc;
+  }
+  cur->count = cur->stream->docs_count;
+  cur->current = postings_stream_next(cur->stream);
+  cur->index = 0;
+  return 0;
+}
+
+/**
+ * カーソルを開放する。
+ * @param[in] cur 開放するカーソル
+ */
+static void
+fin_doc_search_cursor(doc_search_cursor *cur)
+{
+  if (cur->stream) {
+    close_postings_stream(cur->stream);
+  }
+  if (cur->documents && !cur->cached) {
+    free_token_positions_list(cur->documents);
+  }
+}
+
+/**
+ * カーソルを、次の文書に進める。
+ * @param[in,out] cur 読み進めるカーソル
+ */
+static inline void
+doc_search_cursor_next(doc_search_cursor *cur)
+{
+  if (cur->stream) {
+    cur->current = postings_stream_next(cur->stream);
+    cur->index = cur->stream->index;
+    return;
+  }
+  cur->current = (++cur->index < cur->count) ? cur->entries[cur->index] : NULL;
+}
+
+/**
+ * カーソルを、指定した文書ID以上になるまで読み進める。
+ * 長い文書IDの列では、1, 2, 4, ...件先と比較して範囲を絞り込んでから
+ * 二分探索する(galloping search)。
+ * @param[in,out] cur 読み進めるカーソル
+ * @param[in] document_id 読み進める先の文書ID
+ */
+static void
+doc_search_cursor_next_geq(doc_search_cursor *cur, const int document_id)
+{
+  int lo = cur->index, hi, step;
+
+  if (cur->stream) {
+    cur->current = postings_stream_advance_to(cur->stream, document_id);
+    cur->index = cur->stream->index;
+    return;
+  }
+  if (lo >= cur->count || cur->document_ids[lo] >= document_id) { return; }
+  if (!cur->gallop) {
+    while (++lo < cur->count && cur->document_ids[lo] < document_id) {}
+  } else {
+    /* document_ids[lo] < document_id <= document_ids[hi] となる範囲を探す */
+    for (step = 1, hi = lo + 1;
+         hi < cur->count && cur->document_ids[hi] < document_id;
+         step <<= 1, hi = lo + step) {
+      lo = hi;
+    }
+    if (hi > cur->count) { hi = cur->count; }
+    while (lo + 1 < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (cur->document_ids[mid] < document_id) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    lo = hi;
+  }
+  cur->index = lo;
+  cur->current = (lo < cur->count) ? cur->entries[lo] : NULL;
+}
+
+/**
+ * カーソルを、指定した文書ID以上の最初の文書に移動させる。
+ * 現在の位置より前にも戻れるように、文書IDの列全体を二分探索する。
+ * @param[in,out] cur 移動させるカーソル
+ * @param[in] document_id 移動する先の文書ID
+ */
+static void
+doc_search_cursor_seek(doc_search_cursor *cur, const int document_id)
+{
+  int lo = 0, hi = cur->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cur->document_ids[mid] < document_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  cur->index = lo;
+  cur->current = (lo < cur->count) ? cur->entries[lo] : NULL;
+}
+
+/**
+ * 2段階評価の後半として、スコアの高い候補から順にフレーズを確認し、
+ * 上位k件が揃った時点で打ち切る。確認しなかった候補は数えないため、
+ * 一致した文書数は下限値となる。
+ * @param[in] results 検索結果を集める構造体
+ * @param[in] cursors 文書検索でのカーソル群
+ * @param[in] n_cursors 文書検索でのカーソル数
+ * @param[in] candidates スコアを計算済みの候補の文書
+ * @param[in] phrase_cursors フレーズ検索での作業用のカーソル群
+ * @param[in] snippet_hits スニペットの位置を求める作業用の配列。求めない場合はNULL
+ */
+static void
+verify_search_candidates(search_results_collector *results,
+                         doc_search_cursor *cursors, const int n_cursors,
+                         UT_array *candidates,
+                         phrase_search_cursor *phrase_cursors,
+                         UT_array *snippet_hits)
+{
+  int i, j, n = utarray_len(candidates);
+  search_result_entry *c;
+
+  if (!n) { return; }
+  c = (search_result_entry *)utarray_front(candidates);
+  qsort(c, n, sizeof(search_result_entry), search_result_entry_desc_cmp);
+  for (i = 0; i < n && results->heap_len < results->k; i++) {
+    for (j = 0; j < n_cursors; j++) {
+      doc_search_cursor_seek(&cursors[j], c[i].document_id);
+    }
+    if (search_phrase(cursors, n_cursors, phrase_cursors)) {
+      add_search_result(results, c[i].document_id, c[i].score,
+                        find_snippet_position(snippet_hits, cursors,
+                                              n_cursors));
+    }
+  }
+  /* 確認しなかった候補があれば、一致した文書数は下限値となる */
+  if (i < n) {
+    results->count_is_lower_bound = TRUE;
+  }
+}
+
+/**
+ * 検索クエリ中のトークンの出現位置を、位置の昇順に並べるために比較する
+ * @param[in] a トークンの出現位置
+ * @param[in] b トークンの出現位置
+ * @return 位置の大小関係
+ */
+static int
+query_token_position_cmp(const void *a, const void *b)
+{
+  return ((const query_token_position *)a)->position -
+         ((const query_token_position *)b)->position;
+}
+
+/**
+ * フレーズ検索で、候補の文書を絞り込むのに使うトークンを選ぶ。
+ * クエリ中のすべての文字を覆うトークンの組のうち、docs_countの合計が
+ * 最小となるものを動的計画法で求める。選ばれなかったトークンのうち、
+ * 選ばれたトークンのいずれよりもdocs_countが大きいものはdeferredに移し、
+ * ポスティングリストを取得せずに候補の文書の本文で確かめる。
+ * 本文の読み込みと変換は文書ごとに重いため、候補の文書数の上限となる、
+ * 選ばれたトークンの最小のdocs_countがSEARCH_DEFER_MAX_CANDIDATES以下の
+ * 場合に限る。
+ * @param[in] a 作業用の配列を確保するアリーナ
+ * @param[in,out] tokens 検索クエリから作ったトークン情報
+ * @param[out] deferred 候補の文書の本文で確かめるトークン情報
+ */
+static void
+plan_query_tokens(arena *a, query_token_hash **tokens,
+                  query_token_hash **deferred)
+{
+  int i, j, n = 0, n_selected = 0, min_docs_count = INT_MAX,
+      max_docs_count = 0;
+  long long *cost;
+  int *prev;
+  query_token_value *qt, *tmp, **selected;
+  query_token_position *qp;
+
+  HASH_ITER(hh, *tokens, qt, tmp) {
+    n += qt->positions_count;
+  }
+  /* 両端のトークンは必ず必要なので、3つ未満では選ぶ余地がない */
+  if (n < 3) { return; }
+  qp = arena_alloc(a, sizeof(query_token_position) * n);
+  cost = arena_alloc(a, sizeof(long long) * n);
+  prev = arena_alloc(a, sizeof(int) * n);
+  selected = arena_alloc(a, sizeof(query_token_value *) * n);
+  if (!qp || !cost || !prev || !selected) { return; }
+
+  i = 0;
+  HASH_ITER(hh, *tokens, qt, tmp) {
+    int *pos = NULL;
+    while ((pos = (int *)utarray_next(qt->postings_list->positions, pos))) {
+      qp[i].position = *pos;
+      qp[i].token = qt;
+      i++;
+    }
+  }
+  qsort(qp, n, sizeof(query_token_position), query_token_position_cmp);
+
+  /* cost[i]は、i番目のトークンを選んだときの、そこまでの最小の合計。
+     i-1番目を飛ばせるのは、その前後のトークンが隙間なく隣接する場合のみ */
+  for (i = 0; i < n; i++) {
+    cost[i] = qp[i].token->docs_count;
+    prev[i] = i - 1;
+    if (i > 0) {
+      long long c = cost[i - 1];
+      if (i >= 2 && qp[i - 1].position == qp[i - 2].position + 1 &&
+          qp[i].position == qp[i - 1].position + 1 && cost[i - 2] < c) {
+        c = cost[i - 2];
+        prev[i] = i - 2;
+      }
+      cost[i] += c;
+    }
+  }
+  for (i = n - 1; i >= 0; i = prev[i]) {
+    selected[n_selected++] = qp[i].token;
+    if (qp[i].token->docs_count < min_docs_count) {
+      min_docs_count = qp[i].token->docs_count;
+    }
+    if (qp[i].token->docs_count > max_docs_count) {
+      max_docs_count = qp[i].token->docs_count;
+    }
+  }
+  if (min_docs_count > SEARCH_DEFER_MAX_CANDIDATES) { return; }
+
+  HASH_ITER(hh, *tokens, qt, tmp) {
+    for (j = 0; j < n_selected && selected[j] != qt; j++) {}
+    if (j == n_selected && qt->docs_count > max_docs_count) {
+      HASH_DEL(*tokens, qt);
+      HASH_ADD_INT(*deferred, token_id, qt);
+    }
+  }
+}
+
+/**
+ * 文書の本文を読み、使い回す配列にUTF-32に変換する。
+ * 並列に検索する範囲からは呼ばないこと。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] document_id 文書ID
+ * @param[out] body32 本文(UTF-32)。次に呼び出すまで有効
+ * @param[out] body32_len 本文の文字長
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+read_document_body32(wiser_env *env, const int document_id,
+                     const UTF32Char **body32, int *body32_len)
+{
+  int body_size;
+  const char *body;
+  UTF32Char *u;
+  query_scratch *scratch;
+
+  if (!(scratch = get_query_scratch(env, 0)) ||
+      db_get_document_body(env, document_id, &body, &body_size)) {
+    return -1;
+  }
+  *body32_len = utf8_len(body, body_size);
+  utarray_resize(scratch->body, *body32_len);
+  u = (UTF32Char *)utarray_front(scratch->body);
+  utf8toutf32_buffer(body, body_size, u);
+  *body32 = u;
+  return 0;
+}
+
+/**
+ * 候補の文書の本文から、後回しにしたトークンの出現位置を求め、
+ * カーソルがそれを参照するようにする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] document_id 候補の文書ID
+ * @param[in,out] deferred 後回しにしたトークン
+ * @param[out] cursors 後回しにしたトークンのカーソル群
+ * @param[in] n_deferred 後回しにしたトークンの数
+ * @return すべてのトークンが本文に出現したかどうか
+ */
+static int
+find_deferred_tokens(wiser_env *env, const int document_id,
+                     deferred_token *deferred, doc_search_cursor *cursors,
+                     const int n_deferred)
+{
+  int i, body32_len, found = TRUE;
+  const UTF32Char *body32;
+
+  if (read_document_body32(env, document_id, &body32, &body32_len)) {
+    return FALSE;
+  }
+  for (i = 0; i < n_deferred; i++) {
+    deferred_token *d = &deferred[i];
+    utarray_clear(d->entry.positions);
+    d->entry.document_id = document_id;
+    d->entry.positions_count =
+      find_token_positions(body32, body32_len, env->token_len,
+                           d->text, d->text_len, d->entry.positions);
+    if (!d->entry.positions_count) {
+      found = FALSE;
+      break;
+    }
+    cursors[i].current = &d->entry;
+  }
+  return found;
+}
+
+/**
+ * 後回しにしたトークンの出現位置に使い回す配列を、必要な数だけ用意する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] n 後回しにしたトークンの数
+ * @return 出現位置の配列の並び。失敗した場合はNULL
+ */
+static UT_array *
+get_deferred_positions(wiser_env *env, const int n)
+{
+  query_scratch *scratch;
+
+  if (!(scratch = get_query_scratch(env, 0))) { return NULL; }
+  /* 縮めると配列の領域を開放するので、広げるだけにする */
+  while (utarray_len(scratch->deferred_positions) < n) {
+    utarray_extend_back(scratch->deferred_positions);
+  }
+  return (UT_array *)utarray_front(scratch->deferred_positions);
+}
+
+/**
+ * 後回しにしたトークンを、候補の文書の本文で確かめる準備をする。
+ * トークンの文字列はアリーナから切り出す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] tokens 後回しにしたトークン情報
+ * @param[in] positions トークンごとの出現位置に使う配列の並び
+ * @param[out] deferred 後回しにしたトークン
+ * @param[out] cursors 後回しにしたトークンのカーソル群
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+init_deferred_tokens(wiser_env *env, const search_scorer *scorer,
+                     const query_token_hash *tokens, UT_array *positions,
+                     deferred_token *deferred, doc_search_cursor *cursors)
+{
+  int i;
+  const query_token_value *qt;
+
+  if (!positions) { return -1; }
+  for (i = 0, qt = tokens; qt; i++, qt = qt->hh.next) {
+    int token_size;
+    const char *token;
+    if (db_get_token(env, qt->token_id, &token, &token_size) ||
+        utf8toutf32_arena(&env->query.arena, token, token_size,
+                          &deferred[i].text, &deferred[i].text_len)) {
+      print_error("cannot get token: %d", qt->token_id);
+      return -1;
+    }
+    deferred[i].entry.positions = &positions[i];
+    cursors[i].token = qt;
+    cursors[i].idf = calc_idf(scorer, qt->docs_count);
+  }
+  return 0;
+}
+
+/**
+ * 文書IDの列を読み進めるカーソルについて、現在の文書の位置情報を読む。
+ * 配列に展開したカーソルは、位置情報を読み込み済みなので何もしない。
+ * @param[in,out] cursors カーソルの配列
+ * @param[in] n_cursors カーソルの数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+read_doc_search_positions(doc_search_cursor *cursors, const int n_cursors)
+{
+  int i;
+  for (i = 0; i < n_cursors; i++) {
+    if (cursors[i].stream &&
+        postings_stream_positions(cursors[i].stream)) {
+      print_error("cannot read positions: %d", cursors[i].token->token_id);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * 文書検索を分けて並列に行う範囲の数を求める。
+ * @param[in] env アプリケーション環境
+ * @param[in] docs_count 最小のドキュメント数を持つトークンの文書数
+ * @return 範囲の数。2未満なら分けない
+ */
+static int
+count_search_ranges(const wiser_env *env, const int docs_count)
+{
+  int n_ranges = docs_count / SEARCH_PARALLEL_MIN_DOCS;
+  long threads = (env->search_threads > 0) ?
+                 env->search_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_ranges > threads) { n_ranges = threads; }
+  return n_ranges;
+}
+
+/**
+ * 文書IDの範囲について、文書検索を行う。
+ * cursors[0]の添字がr->endに達するか、いずれかのカーソルが末尾に達すると終わる。
+ * @param[in] r 検索する範囲の情報
+ */
+static void
+search_doc_range(search_range *r)
+{
+  int i;
+  wiser_env *env = r->env;
+  const search_scorer *scorer = r->scorer;
+  doc_search_cursor *cur, *cursors = r->cursors;
+  const int n_tokens = r->n_tokens, n_deferred = r->n_deferred;
+  deferred_token *deferred = r->deferred;
+  search_results_collector *results = r->results;
+  UT_array *candidates = r->candidates, *snippet_hits = r->snippet_hits;
+
+  while (cursors[0].current && cursors[0].index < r->end) {
+    int doc_id, next_doc_id = 0;
+    /* 最小のドキュメント数を持つtokenをAと呼ぶ。 */
+    doc_id = cursors[0].current->document_id;
+    /* A以外のtokenについて、Aのdocument_id以上になるまで読み進める */
+    for (cur = cursors + 1, i = 1; i < n_tokens; cur++, i++) {
+      doc_search_cursor_next_geq(cur, doc_id);
+      if (!cur->current) { return; }
+      /* A以外のtokenについて、Aとdocument_idが違うならnext_doc_idを設定 */
+      if (cur->current->document_id != doc_id) {
+        next_doc_id = cur->current->document_id;
+        break;
+      }
+    }
+    if (next_doc_id > 0) {
+      /* Aのdocument_idが、next_doc_id以上になるまで読み進める */
+      doc_search_cursor_next_geq(&cursors[0], next_doc_id);
+    } else {
+      int phrase_count = -1;
+      if (results->count_only && !r->check_phrase) {
+        /* 数えるだけなら、位置情報もスコアも要らない */
+        results->total_count++;
+        doc_search_cursor_next(&cursors[0]);
+        continue;
+      }
+      if (read_doc_search_positions(cursors, n_tokens)) { return; }
+      if (candidates) {
+        search_result_entry e;
+        e.document_id = doc_id;
+        e.score = calc_score(scorer, cursors, n_tokens, doc_id);
+        e.snippet_position = -1;
+        add_search_candidate(results, candidates, &e);
+        phrase_count = 0;
+      } else if (env->enable_phrase_search) {
+        phrase_count = search_phrase(cursors, n_tokens, r->phrase_cursors);
+        /* 候補の文書について、後回しにしたトークンも含めて確かめる */
+        if (phrase_count && n_deferred) {
+          phrase_count =
+            find_deferred_tokens(env, doc_id, deferred,
+                                 cursors + n_tokens, n_deferred) ?
+            search_phrase(cursors, n_tokens + n_deferred,
+                          r->phrase_cursors) : 0;
+        }
+      }
+      if (phrase_count && results->count_only) {
+        results->total_count++;
+      } else if (phrase_count) {
+        double score = calc_score(scorer, cursors, n_tokens + n_deferred,
+                                  doc_id);
+        add_search_result(results, doc_id, score,
+                          find_snippet_position(snippet_hits, cursors,
+                                                n_tokens + n_deferred));
+      }
+      doc_search_cursor_next(&cursors[0]);
+    }
+  }
+}
+
+/**
+ * 検索スレッドのエントリポイント
+ * @param[in] arg 検索する範囲の情報
+ * @return NULL
+ */
+static void *
+search_doc_range_main(void *arg)
+{
+  search_doc_range((search_range *)arg);
+  return NULL;
+}
+
+/**
+ * 範囲ごとに集めた検索結果を、全体の検索結果に加える。
+ * @param[in,out] dst 全体の検索結果を集める構造体
+ * @param[in] src 範囲ごとの検索結果を集めた構造体
+ */
+static void
+merge_search_results(search_results_collector *dst,
+                     const search_results_collector *src)
+{
+  int i;
+
+  if (src->k > 0) {
+    for (i = 0; i < src->heap_len; i++) {
+      add_search_result(dst, src->heap[i].document_id, src->heap[i].score,
+                        src->heap[i].snippet_position);
+    }
+    /* add_search_resultで数えた分を除いた、一致した文書数を加える */
+    dst->total_count += src->total_count - src->heap_len;
+  } else {
+    /* 範囲ごとのスコアは、同じアキュムレータの重ならない文書IDに集めてある */
+    utarray_concat(dst->documents, src->documents);
+    dst->total_count += src->total_count;
+  }
+  if (src->count_is_lower_bound) {
+    dst->count_is_lower_bound = TRUE;
+  }
+  if (src->candidates_dropped) {
+    dst->candidates_dropped = TRUE;
+  }
+}
+
+/**
+ * 最小のドキュメント数を持つトークンの文書IDの列を範囲に分け、
+ * env->search_threads(0の場合はオンラインのCPU数)のスレッドで並列に
+ * 文書検索を行う。
+ * 各範囲は、ブロック境界の文書から各カーソルを二分探索で移動させて始め、
+ * 範囲ごとに集めた上位k件や候補を、最後に文書IDの順にまとめる。
+ * 範囲ごとの作業領域は、呼び出したスレッドでアリーナから確保しておく。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] results 検索結果を集める構造体
+ * @param[in] cursors 文書検索でのカーソル群
+ * @param[in] n_tokens 候補の文書を絞り込むトークンの数
+ * @param[in] deferred 後回しにしたトークン
+ * @param[in] n_deferred 後回しにしたトークンの数
+ * @param[in] candidates 2段階評価での候補の文書。使わない場合はNULL
+ */
+static void
+search_doc_ranges(wiser_env *env, const search_scorer *scorer,
+                  search_results_collector *results,
+                  doc_search_cursor *cursors, const int n_tokens,
+                  deferred_token *deferred, const int n_deferred,
+                  UT_array *candidates)
+{
+  int i, j, n_ranges = count_search_ranges(env, cursors[0].count);
+  arena *a = &env->query.arena;
+  search_range *ranges = NULL;
+  /* 1トークンだけのクエリは、文書に含まれればフレーズに一致する */
+  int check_phrase = env->enable_phrase_search &&
+                     (n_tokens + n_deferred > 1 ||
+                      cursors[0].token->positions_count > 1);
+
+  /* 後回しにしたトークンの確認は、データベースの文や共有の領域を使うため、
+     並列には行わない。件数を制限しない場合は、各範囲がアキュムレータの
+     重ならない要素に書き込むので、あらかじめ最後の文書IDまで確保しておく。
+     文書IDの列を読み進めるカーソルは、範囲の途中から読み始められない */
+  for (i = 0; i < n_tokens; i++) {
+    if (cursors[i].stream) { n_ranges = 0; }
+  }
+  if (n_ranges >= 2 && !n_deferred &&
+      (results->k > 0 || results->count_only ||
+       !reserve_score_accumulators(
+         results->accumulators,
+         cursors[0].document_ids[cursors[0].count - 1] + 1)) &&
+      (ranges = arena_alloc(a, sizeof(search_range) * n_ranges))) {
+    memset(ranges, 0, sizeof(search_range) * n_ranges);
+    for (i = 0; i < n_ranges; i++) {
+      search_range *r = &ranges[i];
+      query_scratch *scratch;
+      int begin = (long long)cursors[0].count * i / n_ranges /
+                  POSTINGS_BLOCK_SIZE * POSTINGS_BLOCK_SIZE;
+      r->env = env;
+      r->scorer = scorer;
+      r->n_tokens = n_tokens;
+      r->end = (i + 1 < n_ranges) ?
+               (long long)cursors[0].count * (i + 1) / n_ranges /
+               POSTINGS_BLOCK_SIZE * POSTINGS_BLOCK_SIZE : cursors[0].count;
+      r->results = &r->collector;
+      if (!(scratch = get_query_scratch(env, i + 1)) ||
+          init_search_results_collector(&r->collector, a, NULL,
+                                        scratch->documents, results->k) ||
+          !(r->cursors = arena_alloc(a, sizeof(doc_search_cursor) *
+                                     n_tokens))) {
+        goto fallback;
+      }
+      r->collector.accumulators = results->accumulators;
+      r->collector.count_only = results->count_only;
+      r->check_phrase = check_phrase;
+      if (candidates) {
+        r->candidates = scratch->candidates;
+        utarray_clear(r->candidates);
+      } else if (env->enable_phrase_search &&
+                 !(r->phrase_cursors =
+                     alloc_phrase_search_cursors(a, cursors, n_tokens))) {
+        goto fallback;
+      }
+      if (env->enable_snippets) {
+        r->snippet_hits = scratch->snippet_hits;
+      }
+      memcpy(r->cursors, cursors, sizeof(doc_search_cursor) * n_tokens);
+      r->cursors[0].index = begin;
+      r->cursors[0].current = cursors[0].entries[begin];
+      for (j = 1; j < n_tokens; j++) {
+        doc_search_cursor_seek(&r->cursors[j], cursors[0].document_ids[begin]);
+      }
+    }
+    /* 先頭の範囲は、呼び出したスレッドで検索する */
+    for (i = 1; i < n_ranges; i++) {
+      ranges[i].started = !pthread_create(&ranges[i].thread, NULL,
+                                          search_doc_range_main, &ranges[i]);
+    }
+    search_doc_range(&ranges[0]);
+    for (i = 1; i < n_ranges; i++) {
+      if (ranges[i].started) {
+        pthread_join(ranges[i].thread, NULL);
+      } else {
+        search_doc_range(&ranges[i]);
+      }
+    }
+    for (i = 0; i < n_ranges; i++) {
+      merge_search_results(results, &ranges[i].collector);
+      if (candidates) {
+        utarray_concat(candidates, ranges[i].candidates);
+      }
+    }
+    return;
+  }
+fallback:
+  {
+    search_range r;
+    query_scratch *scratch;
+    memset(&r, 0, sizeof(search_range));
+    if (!candidates && env->enable_phrase_search &&
+        !(r.phrase_cursors =
+            alloc_phrase_search_cursors(a, cursors, n_tokens + n_deferred))) {
+      return;
+    }
+    if (env->enable_snippets) {
+      if (!(scratch = get_query_scratch(env, 0))) { return; }
+      r.snippet_hits = scratch->snippet_hits;
+    }
+    r.env = env;
+    r.scorer = scorer;
+    r.cursors = cursors;
+    r.n_tokens = n_tokens;
+    r.deferred = deferred;
+    r.n_deferred = n_deferred;
+    r.end = cursors[0].count;
+    r.results = results;
+    r.candidates = candidates;
+    r.check_phrase = check_phrase;
+    search_doc_range(&r);
+  }
+}
+
+/**
+ * 文書検索を行う。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] results 検索結果を集める構造体
+ * @param[in] tokens 検索クエリから作ったトークン情報
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+search_docs(wiser_env *env, const search_scorer *scorer,
+            search_results_collector *results, query_token_hash *tokens)
+{
+  int rc = 0, n_tokens, n_deferred, check_phrase, streaming;
+  doc_search_cursor *cursors;
+  deferred_token *deferred = NULL;
+  query_token_hash *deferred_tokens = NULL;
+  UT_array *candidates = NULL;
+  arena *a = &env->query.arena;
+
+  if (!tokens) { return 0; }
 
   /* tokensについて、docs_countの昇順にソート */
-  HASH_SORT(tokens, query_token_value_docs_count_desc_sort);
+  HASH_SORT(tokens, query_token_value_docs_count_asc_sort);
+
+  /* フレーズ検索では、クエリを覆うトークンだけで候補の文書を絞り込む */
+  if (env->enable_phrase_search) {
+    plan_query_tokens(a, &tokens, &deferred_tokens);
+  }
+
+  /* 初期化。後回しにしたトークンのカーソルは、tokensのカーソルの後に置く */
+  n_tokens = HASH_COUNT(tokens);
+  n_deferred = HASH_COUNT(deferred_tokens);
+  if (n_deferred) {
+    if ((deferred = arena_alloc(a, sizeof(deferred_token) * n_deferred))) {
+      memset(deferred, 0, sizeof(deferred_token) * n_deferred);
+    } else {
+      /* 一致する文書がないことにせず、後回しにせずに検索する */
+      query_token_value *qt, *tmp;
+      print_error("cannot allocate memory for deferred tokens.");
+      HASH_ITER(hh, deferred_tokens, qt, tmp) {
+        HASH_DEL(deferred_tokens, qt);
+        HASH_ADD_INT(tokens, token_id, qt);
+      }
+      HASH_SORT(tokens, query_token_value_docs_count_asc_sort);
+      n_tokens = HASH_COUNT(tokens);
+      n_deferred = 0;
+    }
+  }
+  if (n_tokens &&
+      (cursors = arena_alloc(a, sizeof(doc_search_cursor) *
+                             (n_tokens + n_deferred)))) {
+    int i;
+    query_token_value *token;
+    memset(cursors, 0, sizeof(doc_search_cursor) * (n_tokens + n_deferred));
+    if (n_deferred &&
+        init_deferred_tokens(env, scorer, deferred_tokens,
+                             get_deferred_positions(env, n_deferred),
+                             deferred, cursors + n_tokens)) {
+      goto exit;
+    }
+    /* 2段階評価を指定した上位k件のフレーズ検索では、文書単位の統計で
+       スコアを先に計算し、位置情報によるフレーズの確認はスコアの高い候補
+       だけに行う。一致した文書数は下限値となるため、指定した場合に限る。
+       後回しにしたトークンがある場合は、スコアの計算にも本文が必要なため、
+       候補ごとにその場で確かめる。1トークンのクエリは確認が不要 */
+    if (env->enable_two_phase_search && env->enable_phrase_search &&
+        results->k > 0 && !n_deferred &&
+        (n_tokens > 1 || tokens->positions_count > 1)) {
+      query_scratch *scratch;
+      if (!(scratch = get_query_scratch(env, 0))) {
+        rc = -1;
+        goto exit;
+      }
+      candidates = scratch->candidates;
+      utarray_clear(candidates);
+    }
+    /* 位置情報もスコアも使わずに文書数を数えるだけの場合は、スレッド数や
+       キャッシュの設定によらず、ポスティングリストを配列に展開せず、
+       文書IDだけを読み進めた分だけ復号する。範囲を分けず、キャッシュも
+       使わない検索でも、配列に展開せずに、読まなくてよいブロックを
+       飛ばしながら読み、位置情報は一致した文書の分だけを復号する */
+    check_phrase = env->enable_phrase_search &&
+                   (n_tokens + n_deferred > 1 || tokens->positions_count > 1);
+    streaming = !candidates &&
+                ((results->count_only && !check_phrase) ||
+                 (!env->postings_cache.budget &&
+                  (n_deferred ||
+                   count_search_ranges(env, tokens->docs_count) < 2)));
+    for (i = 0, token = tokens; token; i++, token = token->hh.next) {
+      int blocks_count, cached, len, *document_ids;
+      postings_block *blocks;
+      token_positions_list *documents, **entries;
+      if (!token->token_id) {
+        /* 当該tokenがインデックス作成時に1回も出現していない */
+        goto exit;
+      }
+      if (streaming) {
+        /* 位置情報を読めない古いデータベースでは、配列に展開する */
+        int stream_rc = init_doc_search_stream(
+                          &cursors[i], env, token,
+                          !results->count_only || check_phrase, a);
+        if (stream_rc < 0 || (!stream_rc && !cursors[i].current)) {
+          goto exit;
+        }
+        if (!stream_rc) {
+          cursors[i].token = token;
+          cursors[i].idf = calc_idf(scorer, token->docs_count);
+          continue;
+        }
+      }
+      if (fetch_cached_postings(env, token->token_id, &documents, &len,
+                                &entries, &document_ids,
+                                &blocks, &blocks_count, &cached)) {
+        print_error("decode postings error!: %d\n", token->token_id);
+        rc = -1;
+        goto exit;
+      }
+      if (!cached && blocks) { free(blocks); }
+      if (!documents) {
+        /* tokenはあるが、postingsが空。更新・削除の結果 */
+        goto exit;
+      }
+      if (init_doc_search_cursor(&cursors[i], documents, len, entries,
+                                 document_ids, cached, a)) {
+        goto exit;
+      }
+      /* Aより十分に長い文書IDの列は、galloping searchで読み進める */
+      cursors[i].gallop =
+        cursors[i].count >= cursors[0].count * SEARCH_GALLOP_RATIO;
+      cursors[i].token = token;
+      cursors[i].idf = calc_idf(scorer, token->docs_count);
+    }
+    search_doc_ranges(env, scorer, results, cursors, n_tokens,
+                      deferred, n_deferred, candidates);
+exit:
+    if (candidates && utarray_len(candidates)) {
+      /* 範囲ごとの検索が終わったので、先頭の作業用の配列を使える */
+      UT_array *snippet_hits = env->enable_snippets ?
+                               get_query_scratch(env, 0)->snippet_hits : NULL;
+      phrase_search_cursor *phrase_cursors;
+      if (!(phrase_cursors = alloc_phrase_search_cursors(a, cursors,
+                                                         n_tokens))) {
+        print_error("cannot allocate memory for phrase search.");
+        rc = -1;
+        goto fin;
+      }
+      verify_search_candidates(results, cursors, n_tokens, candidates,
+                               phrase_cursors, snippet_hits);
+      /* 保持した候補だけでは上位k件が揃わなかった場合は、捨てた候補に
+         一致する文書が残っているかもしれないので、1段階で検索し直す */
+      if (results->candidates_dropped && results->heap_len < results->k) {
+        results->total_count = results->heap_len = 0;
+        results->count_is_lower_bound = results->candidates_dropped = FALSE;
+        for (i = 0; i < n_tokens; i++) {
+          doc_search_cursor_seek(&cursors[i], 0);
+        }
+        search_doc_ranges(env, scorer, results, cursors, n_tokens,
+                          deferred, n_deferred, NULL);
+      }
+    }
+fin:
+    for (i = 0; i < n_tokens; i++) {
+      fin_doc_search_cursor(&cursors[i]);
+    }
+  }
+
+  sort_search_results(results);
+  return rc;
+}
+
+/**
+ * 文書数の見積もりで本文を確かめる標本として、トークンが出現する文書から
+ * 等間隔に最大ESTIMATE_SAMPLE_DOCS件を選ぶ。
+ * 文書IDの列が標本のブロック数分より短い場合は、文書IDの列だけを先頭から
+ * 読み、長い場合は、各ブロックの最後の文書IDを等間隔に選ぶ。
+ * どちらも、読む量は文書IDの列の長さによらず上限がある。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] token 最小のドキュメント数を持つトークン
+ * @param[out] sample 選んだ文書IDの格納先
+ * @return 選んだ文書数。失敗した場合は-1
+ */
+static int
+sample_estimate_documents(wiser_env *env, const query_token_value *token,
+                          int *sample)
+{
+  int i, n_sample = token->docs_count;
+  arena *a = &env->query.arena;
+
+  if (n_sample > ESTIMATE_SAMPLE_DOCS) { n_sample = ESTIMATE_SAMPLE_DOCS; }
+  if (token->docs_count <= ESTIMATE_SAMPLE_DOCS * POSTINGS_BLOCK_SIZE) {
+    doc_search_cursor cur;
+    memset(&cur, 0, sizeof(doc_search_cursor));
+    if (init_doc_search_stream(&cur, env, token, FALSE, a)) { return -1; }
+    for (i = 0; i < n_sample && cur.current; ) {
+      /* i件目の標本は、(2i + 1) / 2n の位置にある文書とする */
+      if (cur.index == (long long)(2 * i + 1) * token->docs_count /
+                       (2 * n_sample)) {
+        sample[i++] = cur.current->document_id;
+      }
+      doc_search_cursor_next(&cur);
+    }
+    fin_doc_search_cursor(&cur);
+    return (i == n_sample) ? n_sample : -1;
+  } else {
+    /* 最後のブロック以外は、POSTINGS_BLOCK_SIZE件の文書を持つ */
+    int blocks_count = (token->docs_count + POSTINGS_BLOCK_SIZE - 1) /
+                       POSTINGS_BLOCK_SIZE,
+        full_blocks = token->docs_count / POSTINGS_BLOCK_SIZE;
+    postings_block *blocks;
+    if (!(blocks = arena_alloc(a, sizeof(postings_block) * blocks_count)) ||
+        db_read_postings_blocks(env, token->token_id, blocks,
+                                sizeof(postings_block) * blocks_count)) {
+      return -1;
+    }
+    for (i = 0; i < n_sample; i++) {
+      sample[i] = blocks[(long long)(2 * i + 1) * full_blocks /
+                         (2 * n_sample)].last_document_id;
+    }
+    return n_sample;
+  }
+}
+
+/**
+ * AND検索で一致する文書数を、文書IDの列をすべては読まずに見積もる。
+ * 最小のドキュメント数を持つトークンが出現する文書から、等間隔に選んだ
+ * 標本の本文で各トークンの出現を(フレーズ検索では位置も)確かめ、
+ * 一致した割合にそのトークンの文書数を掛けて見積もる。
+ * 信頼区間は、一致した割合についての有限母集団修正をしたWilsonの区間とする。
+ * 標本は等間隔に選ぶため、一致する文書が文書IDの順に周期的に偏っている
+ * 場合は、区間が実際の値を含む割合は95%より低くなる。
+ * 読む文書IDの列と確かめる本文の数に上限があるため、
+ * 文書IDの列の長さによらず一定の時間で終わる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] tokens 検索クエリから作ったトークン情報。ソートする
+ * @param[out] count 見積もった文書数
+ * @param[out] lower 95%信頼区間の下限
+ * @param[out] upper 95%信頼区間の上限。lowerと等しい場合、countは正確な値
+ * @retval 0 成功
+ * @retval 1 ブロックごとの情報が読めず、見積もれない
+ */
+static int
+estimate_search_count(wiser_env *env, const search_scorer *scorer,
+                      query_token_hash **tokens,
+                      int *count, int *lower, int *upper)
+{
+  int i, n_tokens, docs_count, check_phrase, n_sample, matches = 0;
+  int *sample;
+  arena *a = &env->query.arena;
+  deferred_token *deferred = NULL;
+  doc_search_cursor *cursors;
+  phrase_search_cursor *phrase_cursors = NULL;
+
+  if (!*tokens) { return 1; }
+  HASH_SORT(*tokens, query_token_value_docs_count_asc_sort);
+  n_tokens = HASH_COUNT(*tokens);
+  docs_count = (*tokens)->docs_count;
+  check_phrase = env->enable_phrase_search &&
+                 (n_tokens > 1 || (*tokens)->positions_count > 1);
+  *count = *lower = *upper = 0;
+  if (!(*tokens)->token_id || (!check_phrase && n_tokens == 1)) {
+    /* 出現しないトークンがあれば一致する文書はなく、
+       位置を確かめない1トークンのクエリは、トークンの文書数が正確な値 */
+    *count = *lower = *upper = docs_count;
+    return 0;
+  }
+  if (!(sample = arena_alloc(a, sizeof(int) * ESTIMATE_SAMPLE_DOCS)) ||
+      (n_sample = sample_estimate_documents(env, *tokens, sample)) < 0 ||
+      !(deferred = arena_alloc(a, sizeof(deferred_token) * n_tokens)) ||
+      !(cursors = arena_alloc(a, sizeof(doc_search_cursor) * n_tokens))) {
+    return 1;
+  }
+  memset(deferred, 0, sizeof(deferred_token) * n_tokens);
+  memset(cursors, 0, sizeof(doc_search_cursor) * n_tokens);
+  /* 標本の文書では、すべてのトークンを後回しにしたトークンと同様に、
+     本文から出現位置を求めて確かめる */
+  if (init_deferred_tokens(env, scorer, *tokens,
+                           get_deferred_positions(env, n_tokens),
+                           deferred, cursors) ||
+      (check_phrase &&
+       !(phrase_cursors = alloc_phrase_search_cursors(a, cursors,
+                                                      n_tokens)))) {
+    return 1;
+  }
+  for (i = 0; i < n_sample; i++) {
+    if (find_deferred_tokens(env, sample[i], deferred, cursors, n_tokens) &&
+        (!check_phrase || search_phrase(cursors, n_tokens, phrase_cursors))) {
+      matches++;
+    }
+  }
+
+  if (n_sample == docs_count) {
+    /* 標本が全体を覆っていれば、数えた文書数が正確な値 */
+    *count = *lower = *upper = matches;
+  } else {
+    /* 標本で一致した文書は確かに一致し、一致しなかった文書は確かに一致しない */
+    int min_count = matches, max_count = docs_count - (n_sample - matches);
+    double p = (double)matches / n_sample,
+           z2 = ESTIMATE_Z * ESTIMATE_Z *
+                (docs_count - n_sample) / (docs_count - 1.0),
+           center = (p + z2 / (2 * n_sample)) / (1 + z2 / n_sample),
+           half = sqrt(z2 * (p * (1 - p) / n_sample +
+                             z2 / (4.0 * n_sample * n_sample))) /
+                  (1 + z2 / n_sample),
+           estimate = p * docs_count;
+    *count = (estimate < min_count) ? min_count :
+             (estimate > max_count) ? max_count : (int)(estimate + 0.5);
+    *lower = ((center - half) * docs_count < min_count) ?
+             min_count : (int)((center - half) * docs_count + 0.5);
+    *upper = ((center + half) * docs_count > max_count) ?
+             max_count : (int)((center + half) * docs_count + 0.5);
+    if (*lower > *count) { *lower = *count; }
+    if (*upper < *count) { *upper = *count; }
+  }
+  return 0;
+}
+
+/**
+ * OR検索のカーソルのブロックを、指定した文書IDを含むブロックまで読み進める。
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] cur 読み進めるカーソル
+ * @param[in] document_id 読み進める先の文書ID
+ * @return ブロック内でのスコアの上限
+ */
+static double
+wand_cursor_block_max_score(const search_scorer *scorer, wand_cursor *cur,
+                            const int document_id)
+{
+  while (cur->block < cur->blocks_count - 1 &&
+         cur->blocks[cur->block].last_document_id < document_id) {
+    cur->block++;
+  }
+  return calc_term_score_upper_bound(
+           scorer, cur->blocks[cur->block].max_positions_count, cur->docs.idf);
+}
+
+/**
+ * OR検索のカーソルを、参照している文書IDの昇順に並べ直す。
+ * 読み終えたカーソルは末尾に移し、その数を除いたカーソル数を返す。
+ * @param[in,out] cursors カーソル群
+ * @param[in] n_cursors カーソル数
+ * @return 読み終えていないカーソル数
+ */
+static int
+sort_wand_cursors(wand_cursor *cursors, int n_cursors)
+{
+  int i, j;
+  /* カーソルは高々クエリのトークン数なので、挿入ソートで十分 */
+  for (i = 1; i < n_cursors; i++) {
+    wand_cursor c = cursors[i];
+    int doc_id = c.docs.current ? c.docs.current->document_id : INT_MAX;
+    for (j = i; j > 0; j--) {
+      const doc_search_cursor *prev = &cursors[j - 1].docs;
+      if ((prev->current ? prev->current->document_id : INT_MAX) <= doc_id) {
+        break;
+      }
+      cursors[j] = cursors[j - 1];
+    }
+    cursors[j] = c;
+  }
+  while (n_cursors > 0 && !cursors[n_cursors - 1].docs.current) {
+    n_cursors--;
+  }
+  return n_cursors;
+}
+
+/**
+ * OR検索のカーソルを初期化する。
+ * ブロックごとの情報がDBにない場合は、ポスティングリスト全体を1ブロックとする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] token 検索クエリのトークン
+ * @param[out] cur 初期化するカーソル
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+init_wand_cursor(wiser_env *env, const search_scorer *scorer,
+                 const query_token_value *token, wand_cursor *cur)
+{
+  int i, cached, len, *document_ids;
+  token_positions_list *documents, **entries;
+
+  if (fetch_cached_postings(env, token->token_id, &documents, &len,
+                            &entries, &document_ids,
+                            &cur->blocks, &cur->blocks_count, &cached)) {
+    print_error("decode postings error!: %d\n", token->token_id);
+    return -1;
+  }
+  cur->blocks_owned = !cached;
+  if (!documents) { return 0; }
+  if (init_doc_search_cursor(&cur->docs, documents, len, entries,
+                             document_ids, cached, &env->query.arena)) {
+    return -1;
+  }
+  if (!cur->blocks_count) {
+    const token_positions_list *p;
+    if (cur->blocks && cur->blocks_owned) { free(cur->blocks); }
+    cur->blocks_owned = FALSE;
+    if (!(cur->blocks = arena_alloc(&env->query.arena,
+                                    sizeof(postings_block)))) {
+      print_error("cannot allocate memory for postings blocks.");
+      return -1;
+    }
+    cur->blocks_count = 1;
+    cur->blocks[0].max_positions_count = 0;
+    LL_FOREACH(cur->docs.documents, p) {
+      if (p->positions_count > cur->blocks[0].max_positions_count) {
+        cur->blocks[0].max_positions_count = p->positions_count;
+      }
+      cur->blocks[0].last_document_id = p->document_id;
+    }
+  }
+  cur->docs.idf = calc_idf(scorer, token->docs_count);
+  cur->max_score = 0;
+  for (i = 0; i < cur->blocks_count; i++) {
+    double s = calc_term_score_upper_bound(
+                 scorer, cur->blocks[i].max_positions_count, cur->docs.idf);
+    if (s > cur->max_score) { cur->max_score = s; }
+  }
+  return 0;
+}
+
+/**
+ * いずれかのトークンを含む文書を、スコアの順位付きで検索する。
+ * 上位k件が指定されている場合は、Block-Max WANDにより
+ * 上位k件に入り得ない文書の評価を省略する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] results 検索結果を集める構造体
+ * @param[in] tokens 検索クエリから作ったトークン情報
+ */
+void
+search_docs_or(wiser_env *env, const search_scorer *scorer,
+               search_results_collector *results, query_token_hash *tokens)
+{
+  int n_tokens;
+  wand_cursor *cursors;
+  UT_array *snippet_hits = NULL;
+
+  if (!tokens) { return; }
+
+  n_tokens = HASH_COUNT(tokens);
+  if (env->enable_snippets) {
+    query_scratch *scratch;
+    if (!(scratch = get_query_scratch(env, 0))) {
+      n_tokens = 0;
+    } else {
+      snippet_hits = scratch->snippet_hits;
+    }
+  }
+  if (n_tokens &&
+      (cursors = arena_alloc(&env->query.arena,
+                             sizeof(wand_cursor) * n_tokens))) {
+    int i, n_cursors = 0;
+    query_token_value *token;
+    memset(cursors, 0, sizeof(wand_cursor) * n_tokens);
+    for (token = tokens; token; token = token->hh.next) {
+      /* インデックス作成時に1回も出現していないtokenは読み飛ばす */
+      if (!token->token_id || !token->docs_count) { continue; }
+      if (init_wand_cursor(env, scorer, token, &cursors[n_cursors])) {
+        n_cursors++;
+        goto exit;
+      }
+      n_cursors++;
+    }
+    /* 最も短い文書IDの列より十分に長いものは、galloping searchで読み進める */
+    {
+      int min_count = INT_MAX;
+      for (i = 0; i < n_cursors; i++) {
+        if (cursors[i].docs.count && cursors[i].docs.count < min_count) {
+          min_count = cursors[i].docs.count;
+        }
+      }
+      for (i = 0; i < n_cursors; i++) {
+        cursors[i].docs.gallop =
+          cursors[i].docs.count / SEARCH_GALLOP_RATIO >= min_count;
+      }
+    }
+
+    while ((n_cursors = sort_wand_cursors(cursors, n_cursors))) {
+      int pivot, pivot_doc_id;
+      double threshold, upper_bound = 0;
+
+      /* 上位k件の最下位のスコア以下の文書は、上位k件に入れない */
+      threshold = (results->k > 0 && results->heap_len == results->k) ?
+                  results->heap[0].score : -INFINITY;
+
+      /* スコアの上限の累積が閾値を超えるカーソルを、ピボットとする */
+      for (pivot = 0; pivot < n_cursors; pivot++) {
+        upper_bound += cursors[pivot].max_score;
+        if (upper_bound > threshold) { break; }
+      }
+      if (pivot == n_cursors) {
+        /* 残りの文書はいずれも上位k件に入れない */
+        results->count_is_lower_bound = TRUE;
+        break;
+      }
+      pivot_doc_id = cursors[pivot].docs.current->document_id;
+      while (pivot + 1 < n_cursors &&
+             cursors[pivot + 1].docs.current->document_id == pivot_doc_id) {
+        pivot++;
+      }
+
+      /* ピボットの文書を含むブロックのスコアの上限で、もう一度判定する */
+      upper_bound = 0;
+      for (i = 0; i <= pivot; i++) {
+        upper_bound += wand_cursor_block_max_score(scorer, &cursors[i],
+                                                   pivot_doc_id);
+      }
+      if (upper_bound <= threshold) {
+        /* いずれかのブロックの終わりか、次のカーソルの文書まで読み飛ばす */
+        int next_doc_id = (pivot + 1 < n_cursors) ?
+                          cursors[pivot + 1].docs.current->document_id :
+                          INT_MAX;
+        for (i = 0; i <= pivot; i++) {
+          const postings_block *b = &cursors[i].blocks[cursors[i].block];
+          if (b->last_document_id < next_doc_id) {
+            next_doc_id = b->last_document_id + 1;
+          }
+        }
+        for (i = 0; i <= pivot; i++) {
+          doc_search_cursor_next_geq(&cursors[i].docs, next_doc_id);
+        }
+        results->count_is_lower_bound = TRUE;
+      } else if (cursors[0].docs.current->document_id == pivot_doc_id) {
+        /* ピボットまでのカーソルがすべて同じ文書を指しているので、評価する */
+        double score = 0, norm = calc_document_norm(scorer, pivot_doc_id);
+        if (snippet_hits) { utarray_clear(snippet_hits); }
+        for (i = 0; i <= pivot; i++) {
+          doc_search_cursor *dcur = &cursors[i].docs;
+          score += calc_term_score(scorer, dcur->current->positions_count,
+                                   dcur->idf, norm);
+          if (snippet_hits) { add_snippet_hits(snippet_hits, dcur); }
+          doc_search_cursor_next(dcur);
+        }
+        add_search_result(results, pivot_doc_id, score,
+                          snippet_hits ?
+                          choose_snippet_position(snippet_hits) : -1);
+      } else {
+        /* ピボットより前のカーソルを、ピボットの文書まで読み進める */
+        for (i = 0; i < pivot; i++) {
+          doc_search_cursor_next_geq(&cursors[i].docs, pivot_doc_id);
+        }
+        results->count_is_lower_bound = TRUE;
+      }
+    }
+exit:
+    for (i = 0; i < n_tokens; i++) {
+      fin_doc_search_cursor(&cursors[i].docs);
+      if (cursors[i].blocks && cursors[i].blocks_owned) {
+        free(cursors[i].blocks);
+      }
+    }
+  }
+
+  sort_search_results(results);
+}
+
+/**
+ * セグメントを、スコアの上限の降順に並べるために比較する
+ * @param[in] a セグメント
+ * @param[in] b セグメント
+ * @return スコアの上限の大小関係
+ */
+static int
+impact_segment_ref_desc_cmp(const void *a, const void *b)
+{
+  const impact_segment_ref *sa = a, *sb = b;
+  return (sb->bound > sa->bound) ? 1 : (sb->bound < sa->bound) ? -1 : 0;
+}
+
+/**
+ * インパクト順のポスティングリストのカーソルを初期化する。
+ * セグメントの並びは出現数の順だが、BM25では文書長によってスコアの上限の
+ * 順序が入れ替わるので、スコアの上限の降順に読むように並べ直す。
+ * データベースにない場合、短いポスティングリストであればメモリ上で作成する。
+ * セグメントの情報は、アリーナから確保する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] token 検索クエリのトークン
+ * @param[out] cur 初期化するカーソル
+ * @retval 0 成功
+ * @retval 1 インパクト順のポスティングリストが使えない
+ */
+static int
+init_impact_cursor(wiser_env *env, const search_scorer *scorer,
+                   const query_token_value *token, impact_cursor *cur)
+{
+  int i, offset, segments_count;
+  impact_segment *segments = NULL;
+  arena *a = &env->query.arena;
+
+  cur->token = token;
+  cur->idf = calc_idf(scorer, token->docs_count);
+  /* 索引にないトークンは、どの文書にも出現しない */
+  if (!token->token_id || !token->docs_count) { return 0; }
+  if (!db_read_impacts(env, token->token_id, 0, sizeof(int),
+                       &segments_count)) {
+    int size = sizeof(impact_segment) * segments_count;
+    if (!(segments = arena_alloc(a, size)) ||
+        db_read_impacts(env, token->token_id, sizeof(int), size, segments)) {
+      return 1;
+    }
+  } else if (token->docs_count < IMPACT_POSTINGS_MIN_DOCS) {
+    postings_list *postings = NULL;
+    int postings_len = 0;
+    if (fetch_postings(env, token->token_id, &postings, &postings_len,
+                       NULL, NULL) ||
+        !(cur->memory = alloc_buffer()) ||
+        encode_impact_postings(postings, postings_len,
+                               scorer->document_lengths,
+                               scorer->document_lengths_count,
+                               cur->memory)) {
+      free_postings_list(postings);
+      return 1;
+    }
+    free_postings_list(postings);
+    if (!BUFFER_SIZE(cur->memory)) { return 0; }
+    memcpy(&segments_count, BUFFER_PTR(cur->memory), sizeof(int));
+  } else {
+    /* インデックス作成時に、インパクト順のポスティングリストを作っていない */
+    return 1;
+  }
+  if (!(cur->segments = arena_alloc(a, sizeof(impact_segment_ref) *
+                                    segments_count))) {
+    print_error("cannot allocate memory for impact segments.");
+    return 1;
+  }
+  offset = sizeof(int) + sizeof(impact_segment) * segments_count;
+  for (i = 0; i < segments_count; i++) {
+    impact_segment seg;
+    if (segments) {
+      seg = segments[i];
+    } else {
+      memcpy(&seg, BUFFER_PTR(cur->memory) + sizeof(int) +
+             sizeof(impact_segment) * i, sizeof(impact_segment));
+    }
+    cur->segments[i].offset = offset;
+    cur->segments[i].postings_count = seg.postings_count;
+    /* セグメント内で最も出現数が多く、最も短い文書のスコアを上限とする */
+    cur->segments[i].bound =
+      calc_term_score(scorer, seg.max_positions_count, cur->idf,
+                      scorer->norm_base +
+                      scorer->norm_per_length * seg.min_document_length);
+    offset += sizeof(impact_posting) * seg.postings_count;
+  }
+  qsort(cur->segments, segments_count, sizeof(impact_segment_ref),
+        impact_segment_ref_desc_cmp);
+  cur->segments_count = segments_count;
+  cur->bound = segments_count ? cur->segments[0].bound : 0;
+  return 0;
+}
+
+/**
+ * インパクト順のポスティングリストのカーソルが使った領域を解放する。
+ * @param[in] cur カーソル
+ */
+static void
+fin_impact_cursor(impact_cursor *cur)
+{
+  if (cur->memory) { free_buffer(cur->memory); }
+}
+
+/**
+ * インパクト順のポスティングリストの、次のセグメントを読み込む。
+ * 読み込む領域は、アリーナの中で必要に応じて広げる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in,out] cur カーソル
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+read_impact_segment(wiser_env *env, impact_cursor *cur)
+{
+  const impact_segment_ref *seg = &cur->segments[cur->segment];
+  int size = sizeof(impact_posting) * seg->postings_count;
+
+  if (seg->postings_count > cur->postings_capacity) {
+    impact_posting *p;
+    if (!(p = arena_realloc(&env->query.arena, cur->postings,
+                            sizeof(impact_posting) * cur->postings_capacity,
+                            size))) {
+      print_error("cannot allocate memory for impact postings.");
+      return -1;
+    }
+    cur->postings = p;
+    cur->postings_capacity = seg->postings_count;
+  }
+  if (cur->memory) {
+    memcpy(cur->postings, BUFFER_PTR(cur->memory) + seg->offset, size);
+  } else if (db_read_impacts(env, cur->token->token_id, seg->offset, size,
+                             cur->postings)) {
+    print_error("cannot read impact postings: %d", cur->token->token_id);
+    return -1;
+  }
+  cur->postings_count = seg->postings_count;
+  cur->segment++;
+  cur->bound = (cur->segment < cur->segments_count) ?
+               cur->segments[cur->segment].bound : 0;
+  return 0;
+}
+
+/**
+ * 読んでいないセグメントが、上位k件を変えられないかを判定する。
+ * 読んでいない文書のスコアの上限と、上位k件に入っていない文書のスコアの上限が
+ * k番目のスコアを下回り、上位k件の文書のスコアが確定していれば、打ち切れる。
+ * @param[in] accumulated 文書ごとのスコアを集めている構造体
+ * @param[in] top 上位k件を求めるための作業用の構造体
+ * @param[in] cursors インパクト順のポスティングリストのカーソル群
+ * @param[in] n_cursors カーソル数
+ * @return 打ち切れる場合は真
+ */
+static int
+impact_search_converged(const search_results_collector *accumulated,
+                        search_results_collector *top,
+                        const impact_cursor *cursors, const int n_cursors)
+{
+  int i, j, n = utarray_len(accumulated->documents);
+  const int *ids = (const int *)utarray_front(accumulated->documents);
+  const score_accumulators *acc = accumulated->accumulators;
+  double unseen = 0;
+  search_result_entry kth;
+
+  if (n < top->k) { return FALSE; }
+  top->heap_len = 0;
+  top->total_count = 0;
+  for (j = 0; j < n; j++) {
+    add_search_result(top, ids[j], acc->entries[ids[j]].score, -1);
+  }
+  kth = top->heap[0];
+  for (i = 0; i < n_cursors; i++) {
+    unseen += cursors[i].bound;
+  }
+  if (unseen >= kth.score) { return FALSE; }
+  for (j = 0; j < n; j++) {
+    const search_result_entry *e = &acc->entries[ids[j]];
+    double missing = 0;
+    for (i = 0; i < n_cursors; i++) {
+      if (!(acc->seen[ids[j]] & (1U << i))) { missing += cursors[i].bound; }
+    }
+    /* スコアが確定していない文書が、上位k件に入りうる間は打ち切れない */
+    if (missing > 0 && (!search_result_entry_lower(e, &kth) ||
+                        e->score + missing >= kth.score)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/**
+ * インパクト順のポスティングリストで検索できるクエリかを判定する。
+ * フレーズ検索では、位置を確かめなくてよい1トークンのクエリに限る。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] tokens 検索クエリから作ったトークン情報
+ * @return 検索できる場合は真
+ */
+static int
+use_impact_search(const wiser_env *env, const query_token_hash *tokens)
+{
+  if (!env->enable_impact_search || env->search_top_k <= 0 || !tokens) {
+    return FALSE;
+  }
+  if (env->enable_or_search) { return TRUE; }
+  return HASH_COUNT(tokens) == 1 &&
+         (!env->enable_phrase_search || tokens->positions_count == 1);
+}
+
+/**
+ * インパクト順のポスティングリストを用いて、上位k件の文書検索を行う。
+ * すべてのトークンのうち、スコアの上限が最も大きいセグメントから順に読み、
+ * 残りのセグメントで上位k件が変わらなくなった時点で打ち切る。
+ * OR検索か、1トークンのクエリの検索と同じ結果を返す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] results 検索結果を集める構造体
+ * @param[in] tokens 検索クエリから作ったトークン情報
+ * @retval 0 成功
+ * @retval 1 インパクト順のポスティングリストが使えない
+ */
+static int
+search_docs_impact(wiser_env *env, const search_scorer *scorer,
+                   search_results_collector *results, query_token_hash *tokens)
+{
+  int i, rc = 1, converged = FALSE, n_cursors = 0;
+  int n_tokens = HASH_COUNT(tokens);
+  impact_cursor *cursors;
+  query_token_value *token;
+  search_results_collector accumulated, top;
+  score_accumulators *acc = &env->query.accumulators;
+  arena *a = &env->query.arena;
+  query_scratch *scratch;
+
+  if (!n_tokens || n_tokens > IMPACT_SEARCH_MAX_TOKENS || results->k <= 0) {
+    return 1;
+  }
+  if (!(cursors = arena_alloc(a, sizeof(impact_cursor) * n_tokens))) {
+    return 1;
+  }
+  memset(cursors, 0, sizeof(impact_cursor) * n_tokens);
+  /* 文書ごとのスコアは、件数を制限しない収集と同じアキュムレータに集める */
+  if (!(scratch = get_query_scratch(env, 0)) ||
+      init_search_results_collector(&accumulated, a, acc,
+                                    scratch->documents, 0) ||
+      init_search_results_collector(&top, a, NULL, NULL, results->k)) {
+    return 1;
+  }
+  for (token = tokens; token; token = token->hh.next) {
+    if (init_impact_cursor(env, scorer, token, &cursors[n_cursors++])) {
+      goto exit;
+    }
+  }
+  for (;;) {
+    impact_cursor *cur = NULL;
+    /* スコアの上限が最も大きいセグメントを読む */
+    for (i = 0; i < n_cursors; i++) {
+      if (cursors[i].bound > 0 && (!cur || cursors[i].bound > cur->bound)) {
+        cur = &cursors[i];
+      }
+    }
+    if (!cur) { break; }
+    if (read_impact_segment(env, cur)) { goto exit; }
+    for (i = 0; i < cur->postings_count; i++) {
+      const impact_posting *p = &cur->postings[i];
+      add_search_result(&accumulated, p->document_id,
+                        calc_term_score(scorer, p->positions_count, cur->idf,
+                                        calc_document_norm(scorer,
+                                                           p->document_id)),
+                        -1);
+      if (p->document_id >= acc->capacity) { goto exit; }
+      acc->seen[p->document_id] |= 1U << (cur - cursors);
+    }
+    if (impact_search_converged(&accumulated, &top, cursors, n_cursors)) {
+      converged = TRUE;
+      break;
+    }
+  }
+  {
+    int n = utarray_len(accumulated.documents);
+    const int *ids = (const int *)utarray_front(accumulated.documents);
+    for (i = 0; i < n; i++) {
+      add_search_result(results, ids[i], acc->entries[ids[i]].score, -1);
+    }
+  }
+  /* 打ち切った場合も、1トークンのクエリの文書数はdocs_countと一致する。
+     OR検索では、読んだ文書数と各トークンのdocs_countのうち最大のものが
+     下限値となる */
+  if (converged && n_tokens == 1) {
+    results->total_count = tokens->docs_count;
+  } else if (converged) {
+    for (token = tokens; token; token = token->hh.next) {
+      if (token->docs_count > results->total_count) {
+        results->total_count = token->docs_count;
+      }
+    }
+    results->count_is_lower_bound = TRUE;
+  }
+  rc = 0;
+exit:
+  for (i = 0; i < n_cursors; i++) {
+    fin_impact_cursor(&cursors[i]);
+  }
+  if (!rc) { sort_search_results(results); }
+  return rc;
+}
+
+/**
+ * 文書IDの最小ヒープで、指定位置のカーソルを下方に移動させる。
+ * @param[in,out] heap カーソルの最小ヒープ
+ * @param[in] heap_len ヒープの要素数
+ * @param[in] i 移動させる要素の位置
+ */
+static void
+doc_cursor_heap_down(doc_search_cursor **heap, int heap_len, int i)
+{
+  doc_search_cursor *e = heap[i];
+  for (;;) {
+    int c = i * 2 + 1;
+    if (c >= heap_len) { break; }
+    if (c + 1 < heap_len && heap[c + 1]->current->document_id <
+        heap[c]->current->document_id) {
+      c++;
+    }
+    if (heap[c]->current->document_id >= e->current->document_id) { break; }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = e;
+}
+
+/**
+ * 文書IDの最小ヒープに、カーソルを加える。
+ * @param[in,out] heap カーソルの最小ヒープ
+ * @param[in,out] heap_len ヒープの要素数
+ * @param[in] cur 加えるカーソル
+ */
+static void
+doc_cursor_heap_push(doc_search_cursor **heap, int *heap_len,
+                     doc_search_cursor *cur)
+{
+  int i = (*heap_len)++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (heap[parent]->current->document_id <= cur->current->document_id) {
+      break;
+    }
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = cur;
+}
+
+/**
+ * 文書IDの最小ヒープから、先頭のカーソルを取り出す。
+ * @param[in,out] heap カーソルの最小ヒープ
+ * @param[in,out] heap_len ヒープの要素数
+ * @return 取り出したカーソル
+ */
+static doc_search_cursor *
+doc_cursor_heap_pop(doc_search_cursor **heap, int *heap_len)
+{
+  doc_search_cursor *top = heap[0];
+  heap[0] = heap[--(*heap_len)];
+  if (*heap_len) { doc_cursor_heap_down(heap, *heap_len, 0); }
+  return top;
+}
+
+/* あいまい検索で、候補の文書に現れたクエリのトークンの位置 */
+typedef struct {
+  int position; /* 文書中での位置 */
+  int cursor;   /* トークンのカーソルの添字 */
+} fuzzy_gram_position;
+
+/**
+ * 候補の文書で、クエリのトークンがwindow以内の位置の範囲に
+ * threshold個以上まとまって現れるかを調べる。
+ * 同じトークンは、クエリ中に現れる回数までしか数えない。
+ * 作業用の配列は候補の文書の間で使い回し、足りなければアリーナの中で広げる。
+ * @param[in] a 作業用の配列を確保するアリーナ
+ * @param[in,out] grams_buffer トークンの位置を並べる作業用の配列
+ * @param[in,out] grams_capacity gramsの要素数
+ * @param[out] counts カーソルごとの数を数える、要素数n_cursors以上の配列
+ * @param[in] cursors 候補の文書を指しているカーソル群
+ * @param[in] n_cursors カーソルの数
+ * @param[in] window 位置の範囲の幅
+ * @param[in] threshold 必要なトークンの数
+ * @return まとまって現れれば真
+ */
+static int
+fuzzy_positions_match(arena *a, fuzzy_gram_position **grams_buffer,
+                      int *grams_capacity, int *counts,
+                      doc_search_cursor **cursors, const int n_cursors,
+                      const int window, const int threshold)
+{
+  int i, n = 0, lo = 0, count = 0, found = FALSE;
+  fuzzy_gram_position *grams = *grams_buffer;
+
+  for (i = 0; i < n_cursors; i++) {
+    n += utarray_len(cursors[i]->current->positions);
+  }
+  if (n > *grams_capacity) {
+    int capacity = (n > *grams_capacity * 2) ? n : *grams_capacity * 2;
+    if (!(grams = arena_realloc(a, grams,
+                                sizeof(fuzzy_gram_position) * *grams_capacity,
+                                sizeof(fuzzy_gram_position) * capacity))) {
+      /* 位置で絞り込めない場合は、本文で確かめる */
+      return TRUE;
+    }
+    *grams_buffer = grams;
+    *grams_capacity = capacity;
+  }
+  /* カーソルごとの位置は昇順なので、併合して並べる。
+     counts[i]は、i番目のカーソルの次に並べる位置の添字 */
+  memset(counts, 0, sizeof(int) * n_cursors);
+  for (n = 0;; n++) {
+    int best = -1, best_position = 0;
+    for (i = 0; i < n_cursors; i++) {
+      const UT_array *positions = cursors[i]->current->positions;
+      if (counts[i] < utarray_len(positions)) {
+        int position = *(int *)utarray_eltptr(positions, counts[i]);
+        if (best < 0 || position < best_position) {
+          best = i;
+          best_position = position;
+        }
+      }
+    }
+    if (best < 0) { break; }
+    grams[n].position = best_position;
+    grams[n].cursor = best;
+    counts[best]++;
+  }
+  memset(counts, 0, sizeof(int) * n_cursors);
+  for (i = 0; i < n && !found; i++) {
+    int c = grams[i].cursor;
+    if (counts[c]++ < cursors[c]->token->positions_count) { count++; }
+    for (; grams[i].position - grams[lo].position > window; lo++) {
+      c = grams[lo].cursor;
+      if (--counts[c] < cursors[c]->token->positions_count) { count--; }
+    }
+    found = count >= threshold;
+  }
+  return found;
+}
+
+/**
+ * 文書の本文に、クエリとの編集距離がmax_distance以下の部分文字列があるかを
+ * Sellersのアルゴリズムで調べる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] document_id 文書ID
+ * @param[in] query クエリ
+ * @param[in] query_len クエリの文字長
+ * @param[in] max_distance 許す編集距離
+ * @param[out] col 要素数query_len + 1の作業用の配列
+ * @return 部分文字列があれば真
+ */
+static int
+fuzzy_body_match(wiser_env *env, const int document_id,
+                 const UTF32Char *query, const int query_len,
+                 const int max_distance, int *col)
+{
+  int i, j, body32_len, found = FALSE;
+  const UTF32Char *body32;
+
+  if (read_document_body32(env, document_id, &body32, &body32_len)) {
+    return FALSE;
+  }
+  /* col[j]は、本文の現在の文字で終わる部分文字列と、クエリの先頭j文字との
+     編集距離の最小値 */
+  for (j = 0; j <= query_len; j++) { col[j] = j; }
+  for (i = 0; i < body32_len && !found; i++) {
+    int diag = 0;
+    col[0] = 0;
+    for (j = 1; j <= query_len; j++) {
+      int d = diag + (query[j - 1] != body32[i]);
+      diag = col[j];
+      if (col[j] + 1 < d) { d = col[j] + 1; }
+      if (col[j - 1] + 1 < d) { d = col[j - 1] + 1; }
+      col[j] = d;
+    }
+    found = col[query_len] <= max_distance;
+  }
+  return found;
+}
+
+/**
+ * クエリとの編集距離がenv->fuzzy_distance以下の部分文字列を含む文書を検索する。
+ * 編集1回で変わるトークンは高々N個なので、一致する文書はクエリのトークンを
+ * (トークン数 - N * 編集距離)個以上含む。この数を満たす文書を、
+ * ヒープで全トークンのカーソルを併合しながら求め(MergeSkip)、
+ * トークンの位置がまとまって現れるかで絞り込んだ上で、本文で確かめる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] results 検索結果を集める構造体
+ * @param[in] tokens 検索クエリから作ったトークン情報
+ * @param[in] query クエリ
+ * @param[in] query_len クエリの文字長
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+search_docs_fuzzy(wiser_env *env, const search_scorer *scorer,
+                  search_results_collector *results, query_token_hash *tokens,
+                  const UTF32Char *query, const int query_len)
+{
+  int i, rc = -1, n_tokens = 0, n_cursors = 0, heap_len = 0, threshold = 0,
+      grams_capacity = 0, *counts, *col;
+  doc_search_cursor *cursors = NULL, **heap, **popped;
+  fuzzy_gram_position *grams = NULL;
+  query_token_value *token;
+  UT_array *snippet_hits = NULL;
+  arena *a = &env->query.arena;
+
+  for (token = tokens; token; token = token->hh.next) {
+    threshold += token->positions_count;
+    n_tokens++;
+  }
+  threshold -= env->token_len * env->fuzzy_distance;
+  if (threshold < 1) {
+    print_error("too short query for edit distance %d.", env->fuzzy_distance);
+    goto exit;
+  }
+  if (!(cursors = arena_alloc(a, sizeof(doc_search_cursor) * n_tokens)) ||
+      !(heap = arena_alloc(a, sizeof(doc_search_cursor *) * n_tokens)) ||
+      !(popped = arena_alloc(a, sizeof(doc_search_cursor *) * n_tokens)) ||
+      !(counts = arena_alloc(a, sizeof(int) * n_tokens)) ||
+      !(col = arena_alloc(a, sizeof(int) * (query_len + 1)))) {
+    print_error("cannot allocate memory for search cursor.");
+    goto exit;
+  }
+  memset(cursors, 0, sizeof(doc_search_cursor) * n_tokens);
+  if (env->enable_snippets) {
+    query_scratch *scratch;
+    if (!(scratch = get_query_scratch(env, 0))) { goto exit; }
+    snippet_hits = scratch->snippet_hits;
+  }
+  for (token = tokens; token; token = token->hh.next) {
+    int blocks_count, cached, len, *document_ids;
+    postings_block *blocks;
+    token_positions_list *documents, **entries;
+    doc_search_cursor *cur = &cursors[n_cursors];
+    /* 索引にないトークンは、どの文書でも数えられないだけ */
+    if (!token->token_id) { continue; }
+    if (fetch_cached_postings(env, token->token_id, &documents, &len,
+                              &entries, &document_ids,
+                              &blocks, &blocks_count, &cached)) {
+      print_error("decode postings error!: %d\n", token->token_id);
+      goto exit;
+    }
+    if (!cached && blocks) { free(blocks); }
+    if (!documents) { continue; }
+    n_cursors++;
+    if (init_doc_search_cursor(cur, documents, len, entries, document_ids,
+                               cached, a)) {
+      goto exit;
+    }
+    /* MergeSkipで読み飛ばす距離は一定しないので、常にgalloping searchを使う */
+    cur->gallop = TRUE;
+    cur->token = token;
+    cur->idf = calc_idf(scorer, token->docs_count);
+    doc_cursor_heap_push(heap, &heap_len, cur);
+  }
+
+  while (heap_len) {
+    int doc_id = heap[0]->current->document_id, next_doc_id,
+        weight = 0, n_popped = 0;
+    /* 同じ文書を指すカーソルを取り出し、含むトークンの数を数える */
+    while (heap_len && heap[0]->current->document_id == doc_id) {
+      weight += heap[0]->token->positions_count;
+      popped[n_popped++] = doc_cursor_heap_pop(heap, &heap_len);
+    }
+    if (weight >= threshold) {
+      if (fuzzy_positions_match(a, &grams, &grams_capacity, counts,
+                                popped, n_popped,
+                                query_len + env->fuzzy_distance -
+                                env->token_len, threshold) &&
+          fuzzy_body_match(env, doc_id, query, query_len,
+                           env->fuzzy_distance, col)) {
+        double score = 0, norm = calc_document_norm(scorer, doc_id);
+        if (snippet_hits) { utarray_clear(snippet_hits); }
+        for (i = 0; i < n_popped; i++) {
+          score += calc_term_score(scorer,
+                                   popped[i]->current->positions_count,
+                                   popped[i]->idf, norm);
+          if (snippet_hits) { add_snippet_hits(snippet_hits, popped[i]); }
+        }
+        add_search_result(results, doc_id, score,
+                          snippet_hits ?
+                          choose_snippet_position(snippet_hits) : -1);
+      }
+      next_doc_id = doc_id + 1;
+    } else {
+      /* 取り出したカーソルの数が足りない間は、ヒープの先頭より前の文書は
+         取り出したカーソルにしか現れないため、条件を満たさない */
+      while (heap_len &&
+             weight + heap[0]->token->positions_count < threshold) {
+        weight += heap[0]->token->positions_count;
+        popped[n_popped++] = doc_cursor_heap_pop(heap, &heap_len);
+      }
+      next_doc_id = heap_len ? heap[0]->current->document_id : INT_MAX;
+    }
+    for (i = 0; i < n_popped; i++) {
+      if (next_doc_id == INT_MAX) { break; }
+      doc_search_cursor_next_geq(popped[i], next_doc_id);
+      if (popped[i]->current) {
+        doc_cursor_heap_push(heap, &heap_len, popped[i]);
+      }
+    }
+  }
+  rc = 0;
+exit:
+  if (cursors) {
+    for (i = 0; i < n_cursors; i++) {
+      fin_doc_search_cursor(&cursors[i]);
+    }
+  }
+
+  sort_search_results(results);
+  return rc;
+}
+
+/**
+ * クエリ文字列から、トークンの情報を取り出す。
+ * 連想配列とトークンごとの位置情報列は、検索の実行状態のアリーナから
+ * 切り出すので、開放しない。
+ * @param[in] env 環境
+ * @param[in] text クエリ文字列
+ * @param[in] text_len クエリ文字列の文字長
+ * @param[in] n 何-gramか
+ * @param[out] query_tokens トークンIDごとに位置情報列を保存する連想配列
+ *                          NULLを指すポインタを渡すこと
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+split_query_to_tokens(wiser_env *env,
+                      const UTF32Char *text,
+                      const unsigned int text_len,
+                      const int n, query_token_hash **query_tokens)
+{
+  int t_len, i, position;
+  const UTF32Char *t, *text_end = text + text_len;
+  query_token_value *qt, *tmp, **tokens;
+  arena *a = &env->query.arena;
+
+  /* 1文字ずつ進むので、トークンの位置は文字長を超えない。
+     位置ごとのトークンを記録し、トークンごとの出現数を数える */
+  if (!(tokens = arena_alloc(a, sizeof(query_token_value *) * text_len))) {
+    return -1;
+  }
+  for (t = text, position = 0; (t_len = ngram_next(t, text_end, n, &t));
+       t++, position++) {
+    int token_id, token_docs_count, t_8_size;
+    char t_8[n * MAX_UTF8_SIZE];
+
+    tokens[position] = NULL;
+    /* 最後のN-gramに満たない端文字のトークンは使わない */
+    if (t_len < n) { continue; }
+    utf32toutf8(t, t_len, t_8, &t_8_size);
+    token_id = db_get_token_id(env, t_8, t_8_size, 0, &token_docs_count);
+    HASH_FIND_INT(*query_tokens, &token_id, qt);
+    if (!qt) {
+      if (!(qt = arena_alloc(a, sizeof(query_token_value)))) { return -1; }
+      qt->token_id = token_id;
+      qt->docs_count = token_docs_count;
+      qt->positions_count = 0;
+      qt->postings_list = NULL;
+      HASH_ADD_INT(*query_tokens, token_id, qt);
+    }
+    qt->positions_count++;
+    tokens[position] = qt;
+  }
+
+  /* 位置情報列は出現数ちょうどの大きさで切り出し、追加で広げないようにする */
+  HASH_ITER(hh, *query_tokens, qt, tmp) {
+    token_positions_list *pl;
+    if (!(pl = arena_alloc(a, sizeof(token_positions_list))) ||
+        !(pl->positions = arena_alloc(a, sizeof(UT_array))) ||
+        !(pl->positions->d = arena_alloc(a, sizeof(int) *
+                                            qt->positions_count))) {
+      return -1;
+    }
+    pl->document_id = 0;
+    pl->positions_count = qt->positions_count;
+    pl->next = NULL;
+    pl->positions->icd = ut_int_icd;
+    pl->positions->i = 0;
+    pl->positions->n = qt->positions_count;
+    qt->postings_list = pl;
+  }
+  for (i = 0; i < position; i++) {
+    if (tokens[i]) {
+      utarray_push_back(tokens[i]->postings_list->positions, &i);
+    }
+  }
+  return 0;
+}
+
+/**
+ * ブール検索クエリの語ごとに、トークンを取り出してカーソルを作成する。
+ * 語のノードのcostには、最も少ないトークンの文書数を設定する。
+ * 語ごとの検索状態とカーソル群は、アリーナから確保する。
+ * フレーズとして確かめる語では、1語のクエリと同様に語を覆うトークンだけで
+ * 文書を絞り込み、残りのトークンは候補の文書の本文で確かめる。
+ * 文字数がトークンの長さに満たない語は、トークンを持たない語として残し、
+ * drop_short_query_termsで取り除く。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] node 演算子木のノード
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+init_query_term_cursors(wiser_env *env, const search_scorer *scorer,
+                        query_node *node)
+{
+  int i, n_tokens, term32_len;
+  UTF32Char *term32;
+  query_term_cursor *t;
+  query_token_value *token;
+  query_token_hash *deferred_tokens = NULL;
+  arena *a = &env->query.arena;
+
+  if (node->type != query_node_term) {
+    for (i = 0; i < node->children_count; i++) {
+      if (init_query_term_cursors(env, scorer, node->children[i])) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  if (!(t = arena_alloc(a, sizeof(query_term_cursor)))) {
+    print_error("cannot allocate memory for search cursor.");
+    return -1;
+  }
+  memset(t, 0, sizeof(query_term_cursor));
+  node->data = t;
+  t->env = env;
+  if (utf8toutf32_arena(a, node->term, node->term_size,
+                        &term32, &term32_len) ||
+      split_query_to_tokens(env, term32, term32_len, env->token_len,
+                            &t->tokens)) {
+    return -1;
+  }
+  if (!t->tokens) {
+    print_error("ignored too short query term: %s", node->term);
+    return 0;
+  }
+  /* 語の中では、docs_countの昇順に読み進める */
+  HASH_SORT(t->tokens, query_token_value_docs_count_asc_sort);
+  node->cost = t->tokens->docs_count;
+  t->phrase = node->is_phrase || env->enable_phrase_search;
+  if (t->phrase) {
+    plan_query_tokens(a, &t->tokens, &deferred_tokens);
+  }
+  n_tokens = HASH_COUNT(t->tokens);
+  t->n_deferred = HASH_COUNT(deferred_tokens);
+  if (!(t->cursors = arena_alloc(a, sizeof(doc_search_cursor) *
+                                 (n_tokens + t->n_deferred)))) {
+    print_error("cannot allocate memory for search cursor.");
+    return -1;
+  }
+  memset(t->cursors, 0,
+         sizeof(doc_search_cursor) * (n_tokens + t->n_deferred));
+  if (t->n_deferred) {
+    /* 語ごとに出現位置を保持するので、配列は語ごとに用意する */
+    UT_array *positions;
+    if (!(t->deferred = arena_alloc(a, sizeof(deferred_token) *
+                                    t->n_deferred)) ||
+        !(positions = arena_alloc(a, sizeof(UT_array) * t->n_deferred))) {
+      print_error("cannot allocate memory for deferred tokens.");
+      t->n_deferred = 0;
+      return -1;
+    }
+    memset(t->deferred, 0, sizeof(deferred_token) * t->n_deferred);
+    for (i = 0; i < t->n_deferred; i++) {
+      utarray_init(&positions[i], &ut_int_icd);
+      t->deferred[i].entry.positions = &positions[i];
+    }
+    if (init_deferred_tokens(env, scorer, deferred_tokens, positions,
+                             t->deferred, t->cursors + n_tokens)) {
+      return -1;
+    }
+  }
+  for (i = 0, token = t->tokens; token; i++, token = token->hh.next) {
+    int blocks_count, cached, len, *document_ids;
+    postings_block *blocks;
+    token_positions_list *documents, **entries;
+    if (!token->token_id) {
+      /* 当該tokenがインデックス作成時に1回も出現していない */
+      t->empty = TRUE;
+      break;
+    }
+    if (fetch_cached_postings(env, token->token_id, &documents, &len,
+                              &entries, &document_ids,
+                              &blocks, &blocks_count, &cached)) {
+      print_error("decode postings error!: %d\n", token->token_id);
+      return -1;
+    }
+    if (!cached && blocks) { free(blocks); }
+    if (!documents) {
+      /* tokenはあるが、postingsが空。更新・削除の結果 */
+      t->empty = TRUE;
+      break;
+    }
+    t->n_cursors = i + 1;
+    if (init_doc_search_cursor(&t->cursors[i], documents, len, entries,
+                               document_ids, cached, a)) {
+      return -1;
+    }
+    t->cursors[i].gallop =
+      t->cursors[i].count >= t->cursors[0].count * SEARCH_GALLOP_RATIO;
+    t->cursors[i].token = token;
+    t->cursors[i].idf = calc_idf(scorer, token->docs_count);
+  }
+  if (t->phrase && !t->empty &&
+      !(t->phrase_cursors =
+          alloc_phrase_search_cursors(a, t->cursors,
+                                      t->n_cursors + t->n_deferred))) {
+    print_error("cannot allocate memory for phrase search.");
+    return -1;
+  }
+  return 0;
+}
 
-  /* 初期化 */
-  n_tokens = HASH_COUNT(tokens);
-  if (n_tokens &&
-      (cursors = (doc_search_cursor *)calloc(
-                   sizeof(doc_search_cursor), n_tokens))) {
-    int i;
-    doc_search_cursor *cur;
-    query_token_value *token;
-    for (i = 0, token = tokens; token; i++, token = token->hh.next) {
-      if (!token->token_id) {
-        /* 当該tokenがインデックス作成時に1回も出現していない */
-        goto exit;
+/**
+ * トークンを持たない短い語を、演算子木から取り除く。
+ * 子ノードがすべて取り除かれたAND・OR・NOTも取り除く。
+ * @param[in,out] node 演算子木のノード。init_query_term_cursorsを呼んだ後
+ * @return nodeを取り除くべきかどうか
+ */
+static int
+drop_short_query_terms(query_node *node)
+{
+  int i, n = 0;
+
+  if (node->type == query_node_term) {
+    return !((query_term_cursor *)node->data)->tokens;
+  }
+  for (i = 0; i < node->children_count; i++) {
+    if (!drop_short_query_terms(node->children[i])) {
+      node->children[n++] = node->children[i];
+    }
+  }
+  node->children_count = n;
+  return !n;
+}
+
+/**
+ * ブール検索クエリの語ごとのカーソルを開放する。
+ * @param[in,out] node 演算子木のノード
+ */
+static void
+fin_query_term_cursors(query_node *node)
+{
+  int i;
+  query_term_cursor *t = node->data;
+
+  for (i = 0; i < node->children_count; i++) {
+    fin_query_term_cursors(node->children[i]);
+  }
+  if (!t) { return; }
+  for (i = 0; i < t->n_cursors; i++) {
+    fin_doc_search_cursor(&t->cursors[i]);
+  }
+  for (i = 0; i < t->n_deferred; i++) {
+    utarray_done(t->deferred[i].entry.positions);
+  }
+  node->data = NULL;
+}
+
+static void query_node_next_geq(const search_scorer *scorer,
+                                query_node *node, int document_id);
+
+/**
+ * 語のノードを、指定した文書ID以上で語に一致する文書まで読み進める。
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] node 語のノード
+ * @param[in] document_id 読み進める先の文書ID
+ */
+static void
+query_term_next_geq(const search_scorer *scorer, query_node *node,
+                    int document_id)
+{
+  int i;
+  query_term_cursor *t = node->data;
+  doc_search_cursor *cursors = t->cursors;
+
+  while (!t->empty) {
+    doc_search_cursor_next_geq(&cursors[0], document_id);
+    if (!cursors[0].current) { break; }
+    document_id = cursors[0].current->document_id;
+    for (i = 1; i < t->n_cursors; i++) {
+      doc_search_cursor_next_geq(&cursors[i], document_id);
+      if (!cursors[i].current) { goto exit; }
+      if (cursors[i].current->document_id != document_id) {
+        document_id = cursors[i].current->document_id;
+        break;
       }
-      if (fetch_postings(env, token->token_id,
-                         &cursors[i].documents, NULL)) {
-        print_error("decode postings error!: %d\n", token->token_id);
-        goto exit;
+    }
+    if (i < t->n_cursors) { continue; }
+    /* 後回しにしたトークンは、フレーズに一致した文書の本文で確かめる */
+    if (!t->phrase ||
+        (search_phrase(cursors, t->n_cursors, t->phrase_cursors) &&
+         (!t->n_deferred ||
+          (find_deferred_tokens(t->env, document_id, t->deferred,
+                                cursors + t->n_cursors, t->n_deferred) &&
+           search_phrase(cursors, t->n_cursors + t->n_deferred,
+                         t->phrase_cursors))))) {
+      node->document_id = document_id;
+      node->score = calc_score(scorer, cursors, t->n_cursors + t->n_deferred,
+                               document_id);
+      return;
+    }
+    document_id++;
+  }
+exit:
+  node->document_id = INT_MAX;
+}
+
+/**
+ * ANDのノードを、指定した文書ID以上ですべての子ノードに一致する文書まで
+ * 読み進める。子ノードは一致する文書数の少ない順に並んでおり、
+ * NOTの子ノードには、候補の文書を読み飛ばすためにだけ使う。
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] node ANDのノード
+ * @param[in] document_id 読み進める先の文書ID
+ */
+static void
+query_and_next_geq(const search_scorer *scorer, query_node *node,
+                   int document_id)
+{
+  int i;
+
+  for (;;) {
+    for (i = 0; i < node->children_count; i++) {
+      query_node *child = node->children[i];
+      if (child->type == query_node_not) { break; }
+      if (child->document_id < document_id) {
+        query_node_next_geq(scorer, child, document_id);
       }
-      if (!cursors[i].documents) {
-        /* tokenはあるが、postingsが空。更新・削除の結果 */
-        goto exit;
+      if (child->document_id == INT_MAX) {
+        node->document_id = INT_MAX;
+        return;
       }
-      cursors[i].current = cursors[i].documents;
-    }
-    while (cursors[0].current) {
-      int doc_id, next_doc_id = 0;
-      /* 最小のドキュメント数を持つtokenをAと呼ぶ。 */
-      doc_id = cursors[0].current->document_id;
-      /* A以外のtokenについて、Aのdocument_id以上になるまで読み進める */
-      for (cur = cursors + 1, i = 1; i < n_tokens; cur++, i++) {
-        while (cur->current && cur->current->document_id < doc_id) {
-          cur->current = cur->current->next;
-        }
-        if (!cur->current) { goto exit; }
-        /* A以外のtokenについて、Aとdocument_idが違うならnext_doc_idを設定 */
-        if (cur->current->document_id != doc_id) {
-          next_doc_id = cur->current->document_id;
-          break;
-        }
+      if (child->document_id > document_id) {
+        /* 先頭の子ノードから、新しい文書IDで確かめ直す */
+        document_id = child->document_id;
+        i = -1;
       }
-      if (next_doc_id > 0) {
-        /* Aのdocument_idが、next_doc_id以上になるまで読み進める */
-        while (cursors[0].current
-               && cursors[0].current->document_id < next_doc_id) {
-          cursors[0].current = cursors[0].current->next;
-        }
-      } else {
-        int phrase_count = -1;
-        if (env->enable_phrase_search) {
-          phrase_count = search_phrase(tokens, cursors);
-        }
-        if (phrase_count) {
-          double score = calc_tf_idf(tokens, cursors, n_tokens,
-                                     env->indexed_count);
-          add_search_result(results, doc_id, score);
-        }
-        cursors[0].current = cursors[0].current->next;
+    }
+    /* NOTの子ノードに一致する文書は読み飛ばす */
+    for (; i < node->children_count; i++) {
+      query_node *excluded = node->children[i]->children[0];
+      if (excluded->document_id < document_id) {
+        query_node_next_geq(scorer, excluded, document_id);
       }
+      if (excluded->document_id == document_id) { break; }
     }
-exit:
-    for (i = 0; i < n_tokens; i++) {
-      if (cursors[i].documents) {
-        free_token_positions_list(cursors[i].documents);
+    if (i == node->children_count) { break; }
+    document_id++;
+  }
+  node->document_id = document_id;
+  node->score = 0;
+  for (i = 0; i < node->children_count &&
+       node->children[i]->type != query_node_not; i++) {
+    node->score += node->children[i]->score;
+  }
+}
+
+/**
+ * ORのノードを、指定した文書ID以上でいずれかの子ノードに一致する文書まで
+ * 読み進める。スコアは、一致した子ノードのスコアの和とする。
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] node ORのノード
+ * @param[in] document_id 読み進める先の文書ID
+ */
+static void
+query_or_next_geq(const search_scorer *scorer, query_node *node,
+                  int document_id)
+{
+  int i;
+
+  node->document_id = INT_MAX;
+  for (i = 0; i < node->children_count; i++) {
+    query_node *child = node->children[i];
+    if (child->document_id < document_id) {
+      query_node_next_geq(scorer, child, document_id);
+    }
+    if (child->document_id < node->document_id) {
+      node->document_id = child->document_id;
+    }
+  }
+  node->score = 0;
+  for (i = 0; i < node->children_count; i++) {
+    if (node->children[i]->document_id == node->document_id) {
+      node->score += node->children[i]->score;
+    }
+  }
+}
+
+/**
+ * 演算子木のノードを、指定した文書ID以上で一致する文書まで読み進める。
+ * 一致する文書がなくなった場合、node->document_idはINT_MAXとなる。
+ * @param[in] scorer スコア計算の定数
+ * @param[in,out] node 演算子木のノード
+ * @param[in] document_id 読み進める先の文書ID
+ */
+static void
+query_node_next_geq(const search_scorer *scorer, query_node *node,
+                    int document_id)
+{
+  switch (node->type) {
+  case query_node_term:
+    query_term_next_geq(scorer, node, document_id);
+    break;
+  case query_node_and:
+    query_and_next_geq(scorer, node, document_id);
+    break;
+  case query_node_or:
+    query_or_next_geq(scorer, node, document_id);
+    break;
+  case query_node_not:
+    /* ANDのノードが直接扱う */
+    break;
+  }
+}
+
+/**
+ * ブール検索クエリの演算子木で文書検索を行う。
+ * 語ごとのトークンの文書数から演算子木を書き換え、
+ * すべてのポスティングリストを文書IDの順に1度だけ読み進める。
+ * トークンの長さに満たない語は、条件にしない。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] results 検索結果を集める構造体
+ * @param[in] root 演算子木の根
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+search_query(wiser_env *env, const search_scorer *scorer,
+             search_results_collector *results, query_node *root)
+{
+  int rc = -1;
+
+  if (!init_query_term_cursors(env, scorer, root)) {
+    if (drop_short_query_terms(root)) {
+      print_error("query has no term of %d characters or more.",
+                  env->token_len);
+    } else if (!plan_query(&env->query.arena, root)) {
+      for (query_node_next_geq(scorer, root, 1);
+           root->document_id != INT_MAX;
+           query_node_next_geq(scorer, root, root->document_id + 1)) {
+        add_search_result(results, root->document_id, root->score, -1);
       }
+      rc = 0;
     }
-    free(cursors);
   }
-  free_inverted_index(tokens);
+  fin_query_term_cursors(root);
+  sort_search_results(results);
+  return rc;
+}
+
+/**
+ * 文書の本文で、正規表現に一致する箇所を数える。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] re コンパイル済みの正規表現
+ * @param[in] document_id 文書ID
+ * @return 一致した箇所の数。失敗した場合は-1
+ */
+static int
+count_regex_matches(wiser_env *env, const regex_t *re, const int document_id)
+{
+  int body_size, count = 0;
+  const char *body;
+  char *text, *p;
+  regmatch_t m;
 
-  HASH_SORT(*results, search_results_score_desc_sort);
+  if (db_get_document_body(env, document_id, &body, &body_size)) {
+    return -1;
+  }
+  /* regexecには終端文字が必要なため、本文を複製する */
+  if (!(text = malloc(body_size + 1))) {
+    print_error("cannot allocate memory for document body.");
+    return -1;
+  }
+  memcpy(text, body, body_size);
+  text[body_size] = '\0';
+  for (p = text; !regexec(re, p, 1, &m, p == text ? 0 : REG_NOTBOL);) {
+    count++;
+    if (m.rm_eo > m.rm_so) {
+      p += m.rm_eo;
+    } else if (p[m.rm_eo]) {
+      /* 空文字列に一致した場合は、1文字進める */
+      p += m.rm_eo + 1;
+      while ((*p & 0xc0) == 0x80) { p++; }
+    } else {
+      break;
+    }
+  }
+  free(text);
+  return count;
 }
 
 /**
- * クエリ文字列から、トークンの情報を取り出す
- * @param[in] env 環境
- * @param[in] text クエリ文字列
- * @param[in] text_len クエリ文字列の文字長
- * @param[in] n 何-gramか
- * @param[in,out] query_tokens トークンIDごとに位置情報列を保存する連想配列
- *                             NULLを指すポインタを渡すと新規作成
+ * 正規表現に一致する文書を検索する。
+ * 正規表現から取り出した文字列の条件を転置インデックスで評価して
+ * 候補の文書を絞り込み、その本文にだけ正規表現を適用する。
+ * スコアは、本文中で正規表現に一致した箇所の数とする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] scorer スコア計算の定数
+ * @param[in] results 検索結果を集める構造体
+ * @param[in] pattern POSIX拡張正規表現(UTF-8)
  * @retval 0 成功
  * @retval -1 失敗
  */
-int
-split_query_to_tokens(wiser_env *env,
-                      const UTF32Char *text,
-                      const unsigned int text_len,
-                      const int n, query_token_hash **query_tokens)
+static int
+search_regex_docs(wiser_env *env, const search_scorer *scorer,
+                  search_results_collector *results, const char *pattern)
+{
+  int err, rc = -1;
+  regex_t re;
+  query_node *root = NULL;
+
+  if ((err = regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE))) {
+    char message[256];
+    regerror(err, &re, message, sizeof(message));
+    print_error("invalid regex: %s", message);
+    return -1;
+  }
+  if (!parse_regex_query(&env->query.arena, pattern, strlen(pattern),
+                         env->token_len, &root)) {
+    if (!root) {
+      print_error("regex has no literal of %d characters to search with.",
+                  env->token_len);
+    } else if (!init_query_term_cursors(env, scorer, root) &&
+               !plan_query(&env->query.arena, root)) {
+      for (query_node_next_geq(scorer, root, 1);
+           root->document_id != INT_MAX;
+           query_node_next_geq(scorer, root, root->document_id + 1)) {
+        int count = count_regex_matches(env, &re, root->document_id);
+        if (count > 0) {
+          add_search_result(results, root->document_id, count, -1);
+        }
+      }
+      rc = 0;
+    }
+    if (root) { fin_query_term_cursors(root); }
+  }
+  regfree(&re);
+  sort_search_results(results);
+  return rc;
+}
+
+/**
+ * 検索結果のスニペットを作成する。
+ * 位置のチェックポイントから、スニペットを含む本文の一部だけを読み込む。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] document_id 文書ID
+ * @param[in] snippet_position スニペットを始めるトークンの位置。-1で文書の先頭
+ * @return スニペットの文字列(UTF-8)。呼び出し側で開放する。
+ *         作成できない場合はNULL
+ */
+static char *
+make_snippet(wiser_env *env, int document_id, int snippet_position)
+{
+  int i, offsets_count, first, last, body_size, body32_len,
+      position, begin = -1, end;
+  const int *offsets;
+  char *body, *snippet = NULL;
+  UTF32Char *body32;
+
+  /* チェックポイントがない文書では作成しない */
+  if (db_get_document_offsets(env, document_id, &offsets, &offsets_count) ||
+      !offsets_count) {
+    return NULL;
+  }
+  if (snippet_position < 0) { snippet_position = 0; }
+  first = snippet_position / POSITION_CHECKPOINT_INTERVAL;
+  if (first >= offsets_count) { first = offsets_count - 1; }
+  last = (snippet_position + SNIPPET_LENGTH) / POSITION_CHECKPOINT_INTERVAL
+         + 1;
+  if (db_read_document_body(env, document_id, offsets[first],
+                            (last < offsets_count) ?
+                            offsets[last] - offsets[first] : -1,
+                            &body, &body_size)) {
+    return NULL;
+  }
+  utf8toutf32(body, body_size, &body32, &body32_len);
+  free(body);
+  if (!body32) { return NULL; }
+  /* チェックポイントの位置から数えて、スニペットの範囲の文字を探す */
+  position = first * POSITION_CHECKPOINT_INTERVAL;
+  for (i = 0, end = body32_len; i < body32_len; i++) {
+    if (wiser_is_ignored_char(body32[i])) {
+      /* 改行などは空白として表示する */
+      body32[i] = ' ';
+      continue;
+    }
+    if (position == snippet_position) { begin = i; }
+    if (position++ == snippet_position + SNIPPET_LENGTH) {
+      end = i;
+      break;
+    }
+  }
+  if (begin >= 0) {
+    int snippet_size;
+    utf32toutf8(body32 + begin, end - begin, NULL, &snippet_size);
+    /* 前後に続きがあれば"..."を付けるので、その分も確保しておく */
+    if ((snippet = malloc(snippet_size + 7))) {
+      char *p = snippet;
+      if (begin || first) { p += sprintf(p, "..."); }
+      utf32toutf8(body32 + begin, end - begin, p, NULL);
+      p += snippet_size;
+      *p = '\0';
+      if (end < body32_len || last < offsets_count) { strcpy(p, "..."); }
+    }
+  }
+  free(body32);
+  return snippet;
+}
+
+/**
+ * 文字列を、JSONの文字列として引用符で囲んで表示する。
+ * @param[in] str 表示する文字列(UTF-8)
+ * @param[in] str_size 表示する文字列のバイト数
+ */
+static void
+print_json_string(const char *str, int str_size)
+{
+  int i;
+
+  putchar('"');
+  for (i = 0; i < str_size; i++) {
+    unsigned char c = (unsigned char)str[i];
+    switch (c) {
+    case '"':
+      fputs("\\\"", stdout);
+      break;
+    case '\\':
+      fputs("\\\\", stdout);
+      break;
+    case '\n':
+      fputs("\\n", stdout);
+      break;
+    case '\t':
+      fputs("\\t", stdout);
+      break;
+    default:
+      if (c < 0x20) {
+        printf("\\u%04x", c);
+      } else {
+        putchar(c);
+      }
+    }
+  }
+  putchar('"');
+}
+
+/**
+ * 検索結果を1件表示する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] result 検索結果のエントリ
+ * @param[in] title 文書のタイトル。取得しない場合はNULL
+ * @param[in] title_size タイトルのバイト数
+ */
+static void
+print_search_result(wiser_env *env, const search_result_entry *result,
+                    const char *title, int title_size)
+{
+  char *snippet = env->enable_snippets ?
+                  make_snippet(env, result->document_id,
+                               result->snippet_position) : NULL;
+
+  if (env->output_json) {
+    printf("{\"document_id\":%d,\"score\":%lf", result->document_id,
+           result->score);
+    if (title) {
+      fputs(",\"title\":", stdout);
+      print_json_string(title, title_size);
+    }
+    if (snippet) {
+      fputs(",\"snippet\":", stdout);
+      print_json_string(snippet, strlen(snippet));
+    }
+    puts("}");
+  } else {
+    printf("document_id: %d title: %.*s score: %lf\n",
+           result->document_id, title ? title_size : 0, title ? title : "",
+           result->score);
+    if (snippet) {
+      printf("  snippet: %s\n", snippet);
+    }
+  }
+  if (snippet) { free(snippet); }
+}
+
+/**
+ * 検索された文書数を表示する。
+ * JSON Linesで出力する場合は、検索結果より先に1行の概要として表示する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] query 検索クエリ
+ * @param[in] total_count 検索条件に一致した文書数
+ * @param[in] count_is_lower_bound total_countが下限値かどうか
+ */
+static void
+print_search_count(wiser_env *env, const char *query,
+                   int total_count, int count_is_lower_bound)
+{
+  if (env->output_json) {
+    fputs("{\"query\":", stdout);
+    print_json_string(query, strlen(query));
+    printf(",\"total\":%d,\"count_is_lower_bound\":%s}\n", total_count,
+           count_is_lower_bound ? "true" : "false");
+  } else if (count_is_lower_bound) {
+    printf("At least %u documents are found!\n", total_count);
+  } else {
+    printf("Total %u documents are found!\n", total_count);
+  }
+}
+
+/**
+ * 見積もった文書数を表示する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] query 検索クエリ
+ * @param[in] count 見積もった文書数
+ * @param[in] lower 95%信頼区間の下限
+ * @param[in] upper 95%信頼区間の上限。lowerと等しい場合、countは正確な値
+ */
+static void
+print_search_estimate(wiser_env *env, const char *query,
+                      int count, int lower, int upper)
+{
+  if (lower == upper) {
+    print_search_count(env, query, count, FALSE);
+  } else if (env->output_json) {
+    fputs("{\"query\":", stdout);
+    print_json_string(query, strlen(query));
+    printf(",\"total\":%d,\"count_is_lower_bound\":false,"
+           "\"estimated\":true,\"lower\":%d,\"upper\":%d}\n",
+           count, lower, upper);
+  } else {
+    printf("About %u documents are found! (95%% interval: %u - %u)\n",
+           count, lower, upper);
+  }
+}
+
+/**
+ * 表示するページの末尾が、先頭から何件目になるかを求める。
+ * INT_MAXを超える場合はINT_MAXとする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @return ページの末尾の位置。env->search_limitが正の場合に限り有効
+ */
+static int
+get_search_page_end(const wiser_env *env)
+{
+  if (env->search_offset > INT_MAX - env->search_limit) { return INT_MAX; }
+  return env->search_offset + env->search_limit;
+}
+
+/**
+ * スコアの降順に並べられた検索結果のうち、env->search_offset件目から
+ * env->search_limit件を表示する。
+ * タイトルは、DOCUMENT_TITLES_BATCH_SIZE件ずつまとめて取得し、
+ * 取得した分を表示するたびに出力を書き出す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] query 検索クエリ
+ * @param[in] results スコアの降順に並べられた検索結果
+ * @param[in] results_count 検索結果の件数
+ * @param[in] total_count 検索条件に一致した文書数
+ * @param[in] count_is_lower_bound total_countが下限値かどうか
+ */
+static void
+print_search_page(wiser_env *env, const char *query,
+                  const search_result_entry *results, int results_count,
+                  int total_count, int count_is_lower_bound)
 {
-  return text_to_postings_lists(env,
-                                0, /* document_id は 0とする */
-                                text, text_len, n,
-                                (inverted_index_hash **)query_tokens);
+  int i, j, end = results_count;
+
+  if (env->count_only || env->output_json) {
+    print_search_count(env, query, total_count, count_is_lower_bound);
+    if (env->count_only) { return; }
+  }
+
+  if (env->search_limit > 0 && get_search_page_end(env) < end) {
+    end = get_search_page_end(env);
+  }
+  for (i = env->search_offset; i < end; i += DOCUMENT_TITLES_BATCH_SIZE) {
+    int n = (end - i < DOCUMENT_TITLES_BATCH_SIZE) ?
+            end - i : DOCUMENT_TITLES_BATCH_SIZE;
+    int document_ids[DOCUMENT_TITLES_BATCH_SIZE];
+    int title_sizes[DOCUMENT_TITLES_BATCH_SIZE];
+    char *titles[DOCUMENT_TITLES_BATCH_SIZE];
+
+    for (j = 0; j < n; j++) {
+      document_ids[j] = results[i + j].document_id;
+      titles[j] = NULL;
+    }
+    if (env->show_titles) {
+      db_get_document_titles(env, document_ids, n, titles, title_sizes);
+    }
+    for (j = 0; j < n; j++) {
+      print_search_result(env, &results[i + j], titles[j], title_sizes[j]);
+      if (titles[j]) { free(titles[j]); }
+    }
+    fflush(stdout);
+  }
+  if (!env->output_json) {
+    print_search_count(env, query, total_count, count_is_lower_bound);
+  }
 }
 
 /**
  * 検索結果を表示する
  * @param[in] env アプリケーション環境を保存する構造体
- * @param[in] results 検索結果
+ * @param[in] query 検索クエリ
+ * @param[in] results スコアの降順に並べられた検索結果
  */
-void
-print_search_results(wiser_env *env, search_results *results)
+static void
+print_search_results(wiser_env *env, const char *query,
+                     search_results_collector *results)
 {
-  int num_search_results;
+  print_search_page(env, query, results->heap, results->heap_len,
+                    results->total_count, results->count_is_lower_bound);
+}
 
-  if (!results) { return; }
-  num_search_results = HASH_COUNT(results);
+/**
+ * キャッシュに保存された検索結果を表示する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] query 検索クエリ
+ * @param[in] entry 検索結果のキャッシュのエントリ
+ */
+static void
+print_cached_search_results(wiser_env *env, const char *query,
+                            const query_cache_entry *entry)
+{
+  print_search_page(env, query, entry->results, entry->results_count,
+                    entry->total_count, entry->count_is_lower_bound);
+}
 
-  while (results) {
-    int title_len;
-    const char *title;
-    search_results *r;
+/**
+ * 検索結果を集める件数を決める。
+ * ページを指定した場合は、そのページの末尾までの上位の文書があれば足りる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @return 上位何件の検索結果を集めるか。0以下の場合は無制限
+ */
+static int
+get_search_results_k(const wiser_env *env)
+{
+  int k = env->search_top_k;
 
-    r = results;
-    HASH_DEL(results, r);
-    db_get_document_title(env, r->document_id, &title, &title_len);
-    printf("document_id: %d title: %.*s score: %lf\n",
-           r->document_id, title_len, title, r->score);
-    free(r);
+  /* 文書数だけを数える場合は、上位k件に絞り込む必要もない */
+  if (env->count_only) { return 0; }
+  if (env->search_limit > 0 && (k <= 0 || get_search_page_end(env) < k)) {
+    k = get_search_page_end(env);
   }
+  /* 全文書より多くを集める必要はなく、その分の領域も確保しない */
+  if (k > env->indexed_count && env->indexed_count > 0) {
+    k = env->indexed_count;
+  }
+  return k;
+}
 
-  printf("Total %u documents are found!\n", num_search_results);
+/**
+ * 集めた検索結果をキャッシュに保存する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] key キャッシュのキー
+ * @param[in] generation 検索時のインデックスの世代
+ * @param[in] results スコアの降順に並べられた検索結果
+ */
+static void
+cache_search_results(wiser_env *env, const char *key, long long generation,
+                     const search_results_collector *results)
+{
+  put_query_cache(env, key, generation, results->heap, results->heap_len,
+                  results->total_count, results->count_is_lower_bound);
 }
 
 /**
@@ -343,22 +3675,131 @@ void
 search(wiser_env *env, const char *query)
 {
   int query32_len;
+  char *cache_key = NULL;
+  long long generation = 0;
   UTF32Char *query32;
+  arena *a = &env->query.arena;
+
+  reset_query_context(env);
+  /* インデックスが更新されていれば、キャッシュされたものは使えない */
+  if (env->query_cache_size > 0 || env->postings_cache.budget) {
+    generation = get_index_generation(env);
+    validate_postings_cache(env, generation);
+  }
+  /* 同じインデックスに対する同じ検索は、キャッシュから返す。
+     見積もった文書数はキャッシュしない */
+  if (env->query_cache_size > 0 && !env->estimate_count &&
+      (cache_key = make_query_cache_key(a, env, query))) {
+    const query_cache_entry *entry;
+    if ((entry = get_query_cache(env, cache_key, generation))) {
+      print_cached_search_results(env, query, entry);
+      return;
+    }
+  }
 
-  if (!utf8toutf32(query, strlen(query), &query32, &query32_len)) {
-    search_results *results = NULL;
+  if (!utf8toutf32_arena(a, query, strlen(query), &query32, &query32_len)) {
+    search_scorer scorer;
+    search_results_collector results;
+    query_scratch *scratch;
+    int estimated = FALSE, count, lower, upper;
 
-    if (query32_len < env->token_len) {
-      print_error("too short query.");
-    } else {
-      query_token_hash *query_tokens = NULL;
-      split_query_to_tokens(
-        env, query32, query32_len, env->token_len, &query_tokens);
-      search_docs(env, &results, query_tokens);
+    if ((scratch = get_query_scratch(env, 0)) &&
+        !init_search_results_collector(&results, &env->query.arena,
+                                       &env->query.accumulators,
+                                       scratch->documents,
+                                       get_search_results_k(env))) {
+      results.count_only = env->count_only;
+      if (query32_len < env->token_len) {
+        print_error("too short query.");
+      } else if (!init_search_scorer(env, &scorer)) {
+        int rc;
+        query_node *root = NULL;
+        query_token_hash *query_tokens = NULL;
+        if (env->fuzzy_distance > 0) {
+          /* あいまい検索では、演算子を使わずクエリ全体を1つの文字列とする */
+          split_query_to_tokens(
+            env, query32, query32_len, env->token_len, &query_tokens);
+          rc = search_docs_fuzzy(env, &scorer, &results, query_tokens,
+                                 query32, query32_len);
+        } else if (!(rc = parse_query(a, query, strlen(query), &root))) {
+          UTF32Char *term32;
+          int term32_len;
+          if ((root->type != query_node_term || root->is_phrase) &&
+              (env->enable_or_search || env->enable_impact_search ||
+               env->enable_two_phase_search || env->search_threads > 1)) {
+            /* 演算子木の検索は1つのスレッドで行い、これらの検索方法は
+               1語のクエリにしか使えない */
+            print_error("-o, -I, -V and -j apply only to a query "
+                        "of a single word.");
+            rc = -1;
+          } else if (root->type != query_node_term || root->is_phrase) {
+            /* 演算子木の文書数は見積もらず、正確に数えたものを示す */
+            if (!(rc = search_query(env, &scorer, &results, root)) &&
+                env->estimate_count) {
+              count = lower = upper = results.total_count;
+              estimated = TRUE;
+            }
+          } else if (!(rc = utf8toutf32_arena(a, root->term, root->term_size,
+                                              &term32, &term32_len)) &&
+                     !(rc = split_query_to_tokens(env, term32, term32_len,
+                                                  env->token_len,
+                                                  &query_tokens))) {
+            /* 演算子を含まない1語のクエリは、語のトークンをすべて含む文書を
+               検索する。-sを指定しなければ、トークンが語の通りに並ぶかも
+               確かめる */
+            if (env->estimate_count && !env->enable_or_search &&
+                !estimate_search_count(env, &scorer, &query_tokens,
+                                       &count, &lower, &upper)) {
+              /* 一致する文書数を見積もれた */
+              estimated = TRUE;
+            } else if (use_impact_search(env, query_tokens) &&
+                       !search_docs_impact(env, &scorer, &results,
+                                           query_tokens)) {
+              /* インパクト順のポスティングリストで検索できた */
+            } else if (env->enable_or_search) {
+              search_docs_or(env, &scorer, &results, query_tokens);
+            } else {
+              rc = search_docs(env, &scorer, &results, query_tokens);
+            }
+          }
+        }
+        if (!rc && cache_key) {
+          cache_search_results(env, cache_key, generation, &results);
+        }
+      }
+
+      if (estimated) {
+        print_search_estimate(env, query, count, lower, upper);
+      } else {
+        print_search_results(env, query, &results);
+      }
     }
+  }
+}
 
-    print_search_results(env, results);
+/**
+ * 正規表現で検索を実行する。
+ * LC_CTYPEは、呼び出し側でUTF-8のロケールに設定しておくこと。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] pattern POSIX拡張正規表現(UTF-8)
+ */
+void
+search_regex(wiser_env *env, const char *pattern)
+{
+  search_scorer scorer;
+  search_results_collector results;
+  query_scratch *scratch;
 
-    free(query32);
+  reset_query_context(env);
+  if ((scratch = get_query_scratch(env, 0)) &&
+      !init_search_results_collector(&results, &env->query.arena,
+                                     &env->query.accumulators,
+                                     scratch->documents,
+                                     get_search_results_k(env))) {
+    results.count_only = env->count_only;
+    if (!init_search_scorer(env, &scorer)) {
+      search_regex_docs(env, &scorer, &results, pattern);
+    }
+    print_search_results(env, pattern, &results);
   }
 }
@@ -4,5 +4,7 @@
 #include "wiser.h"
 
 void search(wiser_env *env, const char *query);
+void search_regex(wiser_env *env, const char *pattern);
+void fin_query_context(wiser_env *env);
 
 #endif /* __SEARCH_H__ */
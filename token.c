@@ -12,7 +12,7 @@
  * @retval 0 空白でない
  * @retval 1 空白
  */
-static int
+int
 wiser_is_ignored_char(const UTF32Char ustr)
 {
   switch (ustr) {
@@ -42,7 +42,7 @@ wiser_is_ignored_char(const UTF32Char ustr)
  * @param[out] start トークンの開始位置
  * @return 分解されたトークンの文字長
  */
-static int
+int
 ngram_next(const UTF32Char *ustr, const UTF32Char *ustr_end,
            unsigned int n, const UTF32Char **start)
 {
@@ -156,6 +156,27 @@ token_to_postings_list(wiser_env *env,
   return 0;
 }
 
+/**
+ * 1文書分のミニ転置インデックスが、エントリ以外に確保しているメモリ量を
+ * 計算する。
+ * @param[in] postings ミニ転置インデックス
+ * @return ポスティングリストと位置情報配列のバイト数
+ */
+static size_t
+postings_lists_footprint(const inverted_index_hash *postings)
+{
+  size_t size = 0;
+  const inverted_index_value *p;
+  for (p = postings; p; p = p->hh.next) {
+    const postings_list *pl;
+    LL_FOREACH(p->postings_list, pl) {
+      size += sizeof(postings_list) + sizeof(UT_array) +
+              pl->positions->n * pl->positions->icd.sz;
+    }
+  }
+  return size;
+}
+
 /**
  * 渡された文字列から、postings listを作成。
  * @param[in] env 環境
@@ -164,6 +185,7 @@ token_to_postings_list(wiser_env *env,
  * @param[in] text_len 入力文字列の文字長
  * @param[in] n 何-gramか
  * @param[in,out] postings ミニ転置インデックス。NULLを指すポインタを渡すと新規作成
+ * @param[out] tokens_count 文字列から取り出したトークン数。NULL指定可。
  * @retval 0 成功
  * @retval -1 失敗
  */
@@ -171,10 +193,11 @@ int
 text_to_postings_lists(wiser_env *env,
                        const int document_id, const UTF32Char *text,
                        const unsigned int text_len,
-                       const int n, inverted_index_hash **postings)
+                       const int n, inverted_index_hash **postings,
+                       int *tokens_count)
 {
   /* FIXME: now same document update is broken. */
-  int t_len, position = 0;
+  int t_len, position = 0, count = 0;
   const UTF32Char *t = text, *text_end = text + text_len;
 
   inverted_index_hash *buffer_postings = NULL;
@@ -190,10 +213,23 @@ text_to_postings_lists(wiser_env *env,
       retval = token_to_postings_list(env, document_id, t_8, t_8_size,
                                       position, &buffer_postings);
       if (retval) { return retval; }
+      count++;
     }
   }
+  if (tokens_count) { *tokens_count = count; }
 
-  if (*postings) {
+  /* 文書の場合は、更新用の転置インデックスのメモリ使用量を加算する */
+  if (document_id) {
+    int added;
+    size_t size = postings_lists_footprint(buffer_postings);
+    if (*postings) {
+      added = merge_inverted_index(*postings, buffer_postings);
+    } else {
+      added = HASH_COUNT(buffer_postings);
+      *postings = buffer_postings;
+    }
+    env->ii_buffer_size += size + added * sizeof(inverted_index_value);
+  } else if (*postings) {
     merge_inverted_index(*postings, buffer_postings);
   } else {
     *postings = buffer_postings;
@@ -202,6 +238,75 @@ text_to_postings_lists(wiser_env *env,
   return 0;
 }
 
+/**
+ * 文字列をN-gramに分解し、指定したトークンが出現する位置を取得する。
+ * 位置は、インデックス作成時と同じく、取り出したN-gramの通し番号とする。
+ * @param[in] text 入力文字列
+ * @param[in] text_len 入力文字列の文字長
+ * @param[in] n 何-gramか
+ * @param[in] token 探すトークン
+ * @param[in] token_len 探すトークンの文字長
+ * @param[out] positions トークンが出現する位置を追加する配列
+ * @return トークンが出現した回数
+ */
+int
+find_token_positions(const UTF32Char *text, const unsigned int text_len,
+                     const int n, const UTF32Char *token,
+                     const int token_len, UT_array *positions)
+{
+  int t_len, position = 0, count = 0;
+  const UTF32Char *t = text, *text_end = text + text_len;
+
+  for (; (t_len = ngram_next(t, text_end, n, &t)); t++, position++) {
+    if (t_len == token_len &&
+        !memcmp(t, token, sizeof(UTF32Char) * token_len)) {
+      utarray_push_back(positions, &position);
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * 文書中のトークンの位置から本文のバイト位置を引くための、チェックポイントを作る。
+ * トークンの位置は、空白などを除いた文字ごとに1つずつ増えるので、
+ * POSITION_CHECKPOINT_INTERVAL個ごとに、その文字のUTF-8でのバイト位置を記録する。
+ * @param[in] text 文書の本文(UTF-32)
+ * @param[in] text_len 本文の文字長
+ * @param[out] offsets バイト位置の配列。呼び出し側で開放する
+ * @param[out] offsets_count offsetsの要素数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+build_position_checkpoints(const UTF32Char *text, const unsigned int text_len,
+                           int **offsets, int *offsets_count)
+{
+  unsigned int i;
+  int position = 0, offset = 0, n = 0;
+
+  for (i = 0; i < text_len; i++) {
+    if (!wiser_is_ignored_char(text[i])) { n++; }
+  }
+  *offsets_count = (n + POSITION_CHECKPOINT_INTERVAL - 1) /
+                   POSITION_CHECKPOINT_INTERVAL;
+  if (!(*offsets = malloc(sizeof(int) * (*offsets_count ? *offsets_count : 1)))) {
+    print_error("cannot allocate memory for position checkpoints.");
+    return -1;
+  }
+  for (i = 0; i < text_len; i++) {
+    UTF32Char c = text[i];
+    if (!wiser_is_ignored_char(c)) {
+      if (!(position % POSITION_CHECKPOINT_INTERVAL)) {
+        (*offsets)[position / POSITION_CHECKPOINT_INTERVAL] = offset;
+      }
+      position++;
+    }
+    offset += (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+  }
+  return 0;
+}
+
 /**
  * tokenをダンプする。
  * @param[in] env 環境
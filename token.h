@@ -3,10 +3,20 @@
 
 #include "wiser.h"
 
+int wiser_is_ignored_char(const UTF32Char ustr);
+int ngram_next(const UTF32Char *ustr, const UTF32Char *ustr_end,
+               unsigned int n, const UTF32Char **start);
 int text_to_postings_lists(wiser_env *env,
                            const int document_id, const UTF32Char *text,
                            const unsigned int text_len,
-                           const int n, inverted_index_hash **postings);
+                           const int n, inverted_index_hash **postings,
+                           int *tokens_count);
+int find_token_positions(const UTF32Char *text, const unsigned int text_len,
+                         const int n, const UTF32Char *token,
+                         const int token_len, UT_array *positions);
+int build_position_checkpoints(const UTF32Char *text,
+                               const unsigned int text_len,
+                               int **offsets, int *offsets_count);
 void dump_token(wiser_env *env, int token_id);
 
 #endif /* __TOKEN_H__ */
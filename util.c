@@ -8,6 +8,8 @@
 #include "util.h"
 
 #define BUFFER_INIT_MIN 32 /* bufferを確保する際の初期バイト数 */
+#define ARENA_CHUNK_MIN (64 * 1024) /* アリーナのチャンクの最小バイト数 */
+#define ARENA_ALIGN sizeof(double)  /* アリーナから切り出す領域の境界 */
 
 /**
  * エラーを標準出力に出力する。
@@ -84,7 +86,7 @@ int
 append_buffer(buffer *buf, const void *data, unsigned int data_size)
 {
   if (buf->bit) { buf->curr++; buf->bit = 0; }
-  if (buf->curr + data_size > buf->tail) {
+  while (buf->curr + data_size > buf->tail) {
     if (enlarge_buffer(buf)) { return 0; }
   }
   if (data && data_size) {
@@ -121,6 +123,109 @@ free_buffer(buffer *buf)
   free(buf);
 }
 
+/**
+ * アリーナから領域を切り出す。
+ * 現在のチャンクに収まらない場合は、これまでの合計以上の大きさの
+ * チャンクを確保するので、arena_resetで1つにまとめた後は確保が起きなくなる。
+ * @param[in] a アリーナ
+ * @param[in] size 切り出すバイト数
+ * @return 切り出した領域。失敗した場合はNULL
+ */
+void *
+arena_alloc(arena *a, size_t size)
+{
+  void *p;
+  arena_chunk *c = a->chunks;
+
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (!c || c->used + size > c->size) {
+    size_t chunk_size = ARENA_CHUNK_MIN;
+    if (chunk_size < a->total) { chunk_size = a->total; }
+    if (chunk_size < size) { chunk_size = size; }
+    if (!(c = malloc(sizeof(arena_chunk) + chunk_size))) {
+      print_error("cannot allocate memory for arena.");
+      return NULL;
+    }
+    c->next = a->chunks;
+    c->size = chunk_size;
+    c->used = 0;
+    a->chunks = c;
+    a->total += chunk_size;
+  }
+  p = (char *)c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+/**
+ * アリーナから切り出した領域の大きさを変える。
+ * 最後に切り出した領域で、チャンクに余裕があればその場で広げる。
+ * それ以外は新しく切り出して内容を写し、元の領域はarena_resetまで残る。
+ * @param[in] a アリーナ
+ * @param[in] ptr 大きさを変える領域。NULLの場合は新しく切り出す
+ * @param[in] old_size ptrのバイト数
+ * @param[in] new_size 新しいバイト数
+ * @return 大きさを変えた領域。失敗した場合はNULL
+ */
+void *
+arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+  void *p;
+  arena_chunk *c = a->chunks;
+
+  if (ptr && c) {
+    size_t old_aligned =
+      (old_size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    size_t new_aligned =
+      (new_size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if ((char *)ptr + old_aligned == (char *)c->data + c->used &&
+        c->used - old_aligned + new_aligned <= c->size) {
+      c->used = c->used - old_aligned + new_aligned;
+      return ptr;
+    }
+  }
+  if (!(p = arena_alloc(a, new_size))) { return NULL; }
+  if (ptr) { memcpy(p, ptr, old_size < new_size ? old_size : new_size); }
+  return p;
+}
+
+/**
+ * アリーナから切り出した領域を、すべて再利用できるようにする。
+ * チャンクが複数ある場合は、合計の大きさの1つのチャンクにまとめる。
+ * @param[in] a アリーナ
+ */
+void
+arena_reset(arena *a)
+{
+  size_t total = a->total;
+
+  if (a->chunks && a->chunks->next) {
+    fin_arena(a);
+    /* 確保できなければ、次のarena_allocで改めて確保する */
+    if ((a->chunks = malloc(sizeof(arena_chunk) + total))) {
+      a->chunks->next = NULL;
+      a->chunks->size = total;
+      a->total = total;
+    }
+  }
+  if (a->chunks) { a->chunks->used = 0; }
+}
+
+/**
+ * アリーナが確保したチャンクをすべて解放する。
+ * @param[in] a アリーナ
+ */
+void
+fin_arena(arena *a)
+{
+  while (a->chunks) {
+    arena_chunk *c = a->chunks;
+    a->chunks = c->next;
+    free(c);
+  }
+  a->total = 0;
+}
+
 /**
  * UTF32CharをUTF-8化した場合に必要となるバイト数を計算する。
  * @param[in] ustr 入力文字列(UTF-32)
@@ -225,7 +330,7 @@ const static unsigned char utf8_skip_table[] = {
  * @param[in] str_size 入力文字列の文字長
  * @return utf-8でのバイト長
  **/
-static int
+int
 utf8_len(const char *str, int str_size)
 {
   int len = 0;
@@ -244,6 +349,36 @@ utf8_len(const char *str, int str_size)
   return len;
 }
 
+/**
+ * UTF-8の文字列を、呼び出し側のバッファにUTF-32文字列として書き込む。
+ * @param[in] str 入力文字列(UTF-8)
+ * @param[in] str_size 入力文字列のバイト長
+ * @param[out] ustr 変換した文字列(UTF-32)。utf8_lenの文字数分の領域が必要
+ */
+void
+utf8toutf32_buffer(const char *str, int str_size, UTF32Char *ustr)
+{
+  UTF32Char *u;
+  const char *str_end;
+  for (u = ustr, str_end = str + str_size; str < str_end;) {
+    if (*str >= 0) {
+      *u++ = *str;
+      str += 1;
+    } else {
+      unsigned char s = utf8_skip_table[*str + 0x80];
+      if (!s) { abort(); }
+      /* nバイトからなるUTF-8文字列の先頭から、下位(7 - n)bitを取り出す */
+      *u = *str & ((1 << (7 - s)) - 1);
+      /* 残りのUTF-8文字列から、6bitずつ取り出す */
+      for (str++, s--; s--; str++) {
+        *u = *u << 6;
+        *u |= *str & 0x3f;
+      }
+      u++;
+    }
+  }
+}
+
 /**
  * UTF-8の文字列を、UTF-32文字列に変換する。
  * UTF-32文字列は新しく確保されたバッファに格納される。
@@ -262,31 +397,35 @@ utf8toutf32(const char *str, int str_size, UTF32Char **ustr,
   if (ustr_len) { *ustr_len = ulen; }
   if (!ustr) { return 0; }
   if ((*ustr = malloc(sizeof(UTF32Char) * ulen))) {
-    UTF32Char *u;
-    const char *str_end;
-    for (u = *ustr, str_end = str + str_size; str < str_end;) {
-      if (*str >= 0) {
-        *u++ = *str;
-        str += 1;
-      } else {
-        unsigned char s = utf8_skip_table[*str + 0x80];
-        if (!s) { abort(); }
-        /* nバイトからなるUTF-8文字列の先頭から、下位(7 - n)bitを取り出す */
-        *u = *str & ((1 << (7 - s)) - 1);
-        /* 残りのUTF-8文字列から、6bitずつ取り出す */
-        for (str++, s--; s--; str++) {
-          *u = *u << 6;
-          *u |= *str & 0x3f;
-        }
-        u++;
-      }
-    }
+    utf8toutf32_buffer(str, str_size, *ustr);
   } else {
     print_error("cannot allocate memory on utf8toutf32.");
   }
   return 0;
 }
 
+/**
+ * UTF-8の文字列を、アリーナから切り出した領域にUTF-32文字列として変換する。
+ * @param[in] a アリーナ
+ * @param[in] str 入力文字列(UTF-8)
+ * @param[in] str_size 入力文字列のバイト長
+ * @param[out] ustr 変換した文字列(UTF-32)。アリーナが所有する
+ * @param[out] ustr_len 変換した文字列の文字長
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+int
+utf8toutf32_arena(arena *a, const char *str, int str_size, UTF32Char **ustr,
+                  int *ustr_len)
+{
+  *ustr_len = utf8_len(str, str_size);
+  if (!(*ustr = arena_alloc(a, sizeof(UTF32Char) * *ustr_len))) {
+    return -1;
+  }
+  utf8toutf32_buffer(str, str_size, *ustr);
+  return 0;
+}
+
 /**
  * struct timevalから時刻を表す文字列を作成する。
  * bufferの長さは37byte必要。
@@ -1,6 +1,7 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint32_t
@@ -14,6 +15,20 @@ typedef struct {
   int bit;          /* バッファの現在地（ビット単位） */
 } buffer;
 
+/* アリーナのチャンク。確保した領域を先頭から順に切り出す */
+typedef struct _arena_chunk {
+  struct _arena_chunk *next; /* 以前に確保したチャンク */
+  size_t size;               /* dataのバイト数 */
+  size_t used;               /* dataのうち切り出したバイト数 */
+  double data[];             /* 切り出す領域。doubleで境界を揃える */
+} arena_chunk;
+
+/* 個別に解放せず、まとめて再利用する領域 */
+typedef struct {
+  arena_chunk *chunks; /* 現在のチャンク。以前のチャンクが続く */
+  size_t total;        /* 確保したチャンクの合計バイト数 */
+} arena;
+
 #define BUFFER_PTR(b) ((b)->head) /* バッファの先頭を返す */
 #define BUFFER_SIZE(b) ((b)->curr - (b)->head) /* バッファのサイズを返す */
 
@@ -23,10 +38,18 @@ int append_buffer(buffer *buf, const void *data,
                   unsigned int data_size);
 void free_buffer(buffer *buf);
 void append_buffer_bit(buffer *buf, int bit);
+void *arena_alloc(arena *a, size_t size);
+void *arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(arena *a);
+void fin_arena(arena *a);
 char *utf32toutf8(const UTF32Char *ustr, int ustr_len, char *str,
                   int *str_size);
+int utf8_len(const char *str, int str_size);
+void utf8toutf32_buffer(const char *str, int str_size, UTF32Char *ustr);
 int utf8toutf32(const char *str, int str_size, UTF32Char **ustr,
                 int *ustr_len);
+int utf8toutf32_arena(arena *a, const char *str, int str_size,
+                      UTF32Char **ustr, int *ustr_len);
 void print_time_diff(void);
 
 #endif /* __UTIL_H__ */
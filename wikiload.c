@@ -26,8 +26,14 @@ typedef struct {
   int article_count;          /* 解析した記事の総数 */
   int max_article_count;      /* 解析する記事の最大数 */
   add_document_callback func; /* 解析後のドキュメントを渡す関数 */
+  XML_Parser xp;              /* XMLパーサ */
+  long long offset_delta;     /* パーサ上のバイト位置とファイル上の位置の差 */
+  long long page_offset;      /* 解析中の記事のファイル上のバイト位置 */
 } wikipedia_parser;
 
+/* 途中から読み込みを再開する際に、記事の前に補うルート要素 */
+#define RESUME_ROOT_TAG "<mediawiki>"
+
 /**
  * XMLタグの開始時に呼ばれる関数
  * @param[in] user_data Wikipediaパーサの環境
@@ -42,6 +48,8 @@ start(void *user_data, const XML_Char *el, const XML_Char *attr[])
   case IN_DOCUMENT:
     if (!strcmp(el, "page")) {
       p->status = IN_PAGE;
+      p->page_offset = (long long)XML_GetCurrentByteIndex(p->xp) +
+                       p->offset_delta;
     }
     break;
   case IN_PAGE:
@@ -103,8 +111,13 @@ end(void *user_data, const XML_Char *el)
   case IN_PAGE_REVISION_TEXT:
     if (!strcmp(el, "text")) {
       p->status = IN_PAGE_REVISION;
-      if (p->max_article_count < 0 ||
-          p->article_count < p->max_article_count) {
+      /* 書き出しやチェックポイントの保存に失敗した後は、文書を追加しない */
+      if ((p->max_article_count < 0 ||
+           p->article_count < p->max_article_count) &&
+          !p->env->ii_write_failed) {
+        /* チェックポイントとして記録できるように、記事の位置を渡す */
+        p->env->dump_offset = p->page_offset;
+        p->env->dump_article_count = p->article_count;
         p->func(p->env, utstring_body(p->title), utstring_body(p->body));
       }
       utstring_free(p->title);
@@ -148,6 +161,8 @@ element_data(void *user_data, const XML_Char *data, int data_size)
  * @param[in] path dumpファイルのpath
  * @param[in] func env, 記事タイトル, 記事本文の3引数を取る関数
  * @param[in] max_article_count 読み込む最大記事数
+ * @param[in] offset 読み込みを開始する記事のバイト位置。0の場合は先頭から
+ * @param[in] article_count offsetより前にある記事数
  * @retval 0 成功
  * @retval 1 メモリ確保に失敗
  * @retval 2 ファイルオープンに失敗
@@ -156,7 +171,8 @@ element_data(void *user_data, const XML_Char *data, int data_size)
  */
 int
 load_wikipedia_dump(wiser_env *env,
-                    const char *path, add_document_callback func, int max_article_count)
+                    const char *path, add_document_callback func, int max_article_count,
+                    long long offset, int article_count)
 {
   FILE *fp;
   int rc = 0;
@@ -167,9 +183,12 @@ load_wikipedia_dump(wiser_env *env,
     IN_DOCUMENT,       /* 初期状態 */
     NULL,              /* タイトルを一時保存する領域 */
     NULL,              /* 本文を一時保存する領域 */
-    0,                 /* 解析した記事の総数を初期化 */
+    article_count,     /* 解析した記事の総数を初期化 */
     max_article_count, /* 解析する記事の最大数 */
-    func               /* 解析後のドキュメントを渡す関数 */
+    func,              /* 解析後のドキュメントを渡す関数 */
+    NULL,              /* XMLパーサ */
+    0,                 /* パーサ上のバイト位置とファイル上の位置の差 */
+    0                  /* 解析中の記事のファイル上のバイト位置 */
   };
 
   if (!(xp = XML_ParserCreate("UTF-8"))) {
@@ -184,10 +203,28 @@ load_wikipedia_dump(wiser_env *env,
     goto exit;
   }
 
+  wp.xp = xp;
   XML_SetElementHandler(xp, start, end);
   XML_SetCharacterDataHandler(xp, element_data);
   XML_SetUserData(xp, (void *)&wp);
 
+  if (offset) {
+    /* 記事の途中から読み込むため、ルート要素を補ってから記事を渡す */
+    if (fseeko(fp, (off_t)offset, SEEK_SET)) {
+      print_error("cannot seek wikipedia dump xml file(%s).",
+                  strerror(errno));
+      rc = 3;
+      goto exit;
+    }
+    wp.offset_delta = offset - (long long)(sizeof(RESUME_ROOT_TAG) - 1);
+    if (XML_Parse(xp, RESUME_ROOT_TAG, sizeof(RESUME_ROOT_TAG) - 1, 0) ==
+        XML_STATUS_ERROR) {
+      print_error("wikipedia dump xml file parse error.");
+      rc = 4;
+      goto exit;
+    }
+  }
+
   while (1) {
     int buffer_len, done;
 
@@ -205,8 +242,9 @@ load_wikipedia_dump(wiser_env *env,
       goto exit;
     }
 
-    if (done || (max_article_count >= 0 &&
-                 max_article_count <= wp.article_count)) { break; }
+    if (done || env->ii_write_failed ||
+        (max_article_count >= 0 &&
+         max_article_count <= wp.article_count)) { break; }
   }
 exit:
   if (fp) {
@@ -8,6 +8,7 @@ typedef void (*add_document_callback)(wiser_env *env,
                                       const char *body);
 
 int load_wikipedia_dump(wiser_env *env, const char *path,
-                        add_document_callback func, int max_article_count);
+                        add_document_callback func, int max_article_count,
+                        long long offset, int article_count);
 
 #endif /* __WIKILOAD_H__ */
@@ -1,14 +1,375 @@
 #include <stdio.h>
+#include <locale.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "util.h"
 #include "token.h"
+#include "cache.h"
 #include "search.h"
 #include "postings.h"
 #include "database.h"
 #include "wikiload.h"
 
+/**
+ * ふたつのtokenについて、トークンIDを比較する
+ * @param[in] a トークンのエントリ
+ * @param[in] b トークンのエントリ
+ * @return トークンIDの大小関係
+ */
+static int
+inverted_index_token_id_asc_sort(inverted_index_value *a,
+                                 inverted_index_value *b)
+{
+  return a->token_id - b->token_id;
+}
+
+/* チェックポイントを保存する設定項目名 */
+#define CHECKPOINT_OFFSET_KEY "checkpoint_offset"
+#define CHECKPOINT_ARTICLE_COUNT_KEY "checkpoint_article_count"
+#define CHECKPOINT_RUNS_COUNT_KEY "checkpoint_runs_count"
+
+/* インデックス構築が完了したことを示すチェックポイントのバイト位置 */
+#define CHECKPOINT_COMPLETED -1
+
+/**
+ * 数値の設定情報を取得する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] key 設定項目名
+ * @param[in] default_value 設定が存在しなかった場合の値
+ * @return 設定内容
+ */
+static long long
+get_settings_number(const wiser_env *env, const char *key,
+                    long long default_value)
+{
+  int value_size = 0;
+  const char *value = NULL;
+  db_get_settings(env, key, strlen(key), &value, &value_size);
+  if (value && value_size) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*s", value_size, value);
+    return strtoll(buf, NULL, 10);
+  }
+  return default_value;
+}
+
+/**
+ * 数値の設定情報を上書き保存する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] key 設定項目名
+ * @param[in] value 設定内容
+ */
+static void
+replace_settings_number(const wiser_env *env, const char *key,
+                        long long value)
+{
+  char buf[32];
+  int buf_size;
+  buf_size = snprintf(buf, sizeof(buf), "%lld", value);
+  db_replace_settings(env, key, strlen(key), buf, buf_size);
+}
+
+/**
+ * 読み込み位置を記録してトランザクションをcommitし、
+ * 次のトランザクションを開始する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] offset 次に読み込む記事のダンプファイル中のバイト位置
+ * @param[in] article_count 次に読み込む記事より前にある記事数
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+save_checkpoint(wiser_env *env, long long offset, int article_count)
+{
+  replace_settings_number(env, CHECKPOINT_OFFSET_KEY, offset);
+  replace_settings_number(env, CHECKPOINT_ARTICLE_COUNT_KEY, article_count);
+  replace_settings_number(env, CHECKPOINT_RUNS_COUNT_KEY, env->runs_count);
+  /* 保存できなかった場合は、以降の文書を読み込まずに構築を中断する */
+  if (commit(env) != SQLITE_DONE) {
+    print_error("cannot commit checkpoint: %s", sqlite3_errmsg(env->db));
+    env->ii_write_failed = TRUE;
+    return -1;
+  }
+  if (begin(env) != SQLITE_DONE) {
+    print_error("cannot begin transaction: %s", sqlite3_errmsg(env->db));
+    env->ii_write_failed = TRUE;
+    return -1;
+  }
+  print_error("checkpoint saved. offset:%lld articles:%d",
+              offset, article_count);
+  return 0;
+}
+
+/**
+ * 文書長を記録する。データベースへはsave_document_lengthsでまとめて保存する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] document_id 文書ID
+ * @param[in] length 文書長(トークン数)
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+set_document_length(wiser_env *env, int document_id, int length)
+{
+  if (document_id >= env->document_lengths_count) {
+    int *l, count;
+    /* チャンク単位で拡張する */
+    count = (document_id / DOCUMENT_LENGTHS_CHUNK_SIZE + 1) *
+            DOCUMENT_LENGTHS_CHUNK_SIZE;
+    if (!(l = realloc(env->document_lengths, sizeof(int) * count))) {
+      print_error("cannot allocate memory for document lengths.");
+      return -1;
+    }
+    memset(l + env->document_lengths_count, 0,
+           sizeof(int) * (count - env->document_lengths_count));
+    env->document_lengths = l;
+    env->document_lengths_count = count;
+  }
+  env->document_lengths[document_id] = length;
+  if (!env->document_lengths_dirty_max) {
+    env->document_lengths_dirty_min = document_id;
+    env->document_lengths_dirty_max = document_id;
+  } else if (document_id < env->document_lengths_dirty_min) {
+    env->document_lengths_dirty_min = document_id;
+  } else if (document_id > env->document_lengths_dirty_max) {
+    env->document_lengths_dirty_max = document_id;
+  }
+  return 0;
+}
+
+/**
+ * 記録した文書長のうち、保存されていないものを含むチャンクを
+ * データベースに書き出す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+static void
+save_document_lengths(wiser_env *env)
+{
+  int chunk_id;
+
+  if (!env->document_lengths_dirty_max) { return; }
+  for (chunk_id = env->document_lengths_dirty_min / DOCUMENT_LENGTHS_CHUNK_SIZE;
+       chunk_id <= env->document_lengths_dirty_max / DOCUMENT_LENGTHS_CHUNK_SIZE;
+       chunk_id++) {
+    db_replace_document_lengths(env, chunk_id,
+                                env->document_lengths +
+                                chunk_id * DOCUMENT_LENGTHS_CHUNK_SIZE,
+                                DOCUMENT_LENGTHS_CHUNK_SIZE);
+  }
+  env->document_lengths_dirty_min = 0;
+  env->document_lengths_dirty_max = 0;
+}
+
+/**
+ * 更新用の転置インデックスをデータベースまたはランファイルに書き出し、解放する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] ii 書き出す転置インデックス
+ * @param[in] ii_count 書き出す転置インデックスの文書数
+ * @param[in] ii_size 書き出す転置インデックスのバイト数
+ * @param[in] documents_count インデックス化された文書数
+ */
+static void
+write_ii_buffer(wiser_env *env, inverted_index_hash *ii, int ii_count,
+                size_t ii_size, int documents_count)
+{
+  inverted_index_hash *p;
+
+  /* tokensテーブルのB-treeを先頭から順に読み書きするように、
+     トークンIDの昇順にソートしておく */
+  HASH_SORT(ii, inverted_index_token_id_asc_sort);
+
+  if (env->enable_bulk_build) {
+    /* ランファイルとして書き出し、最後にまとめてマージする。
+       失敗した場合は、以降のチェックポイントを保存しない */
+    if (write_postings_run(env, ii)) {
+      print_error("cannot write postings run(%d).", env->runs_count);
+      env->ii_write_failed = TRUE;
+    }
+  } else {
+    /* すべてのtokenについて、postingsを更新 */
+    for (p = ii; p != NULL; p = p->hh.next) {
+      update_postings(env, p, documents_count);
+    }
+  }
+  free_inverted_index(ii);
+  print_error("index flushed. (%d documents, %zu bytes)", ii_count, ii_size);
+}
+
+/**
+ * 書き出しスレッドの本体。依頼された転置インデックスを順に書き出す
+ * @param[in] arg アプリケーション環境を保存する構造体
+ * @return NULL
+ */
+static void *
+flush_thread_main(void *arg)
+{
+  wiser_env *env = (wiser_env *)arg;
+  ii_flusher *f = &env->flusher;
+
+  pthread_mutex_lock(&f->mutex);
+  for (;;) {
+    while (!f->ii && !f->exiting) {
+      pthread_cond_wait(&f->cond, &f->mutex);
+    }
+    if (!f->ii) { break; }
+    pthread_mutex_unlock(&f->mutex);
+
+    write_ii_buffer(env, f->ii, f->ii_count, f->ii_size, f->documents_count);
+
+    pthread_mutex_lock(&f->mutex);
+    f->ii = NULL;
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return NULL;
+}
+
+/**
+ * 書き出しスレッドを起動する。
+ * 起動できない場合は、文書の追加を止めて同期的に書き出す。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+static void
+start_flush_thread(wiser_env *env)
+{
+  ii_flusher *f = &env->flusher;
+
+  /* スレッド間でsqlite3の接続を共有できない場合は起動しない */
+  if (!sqlite3_threadsafe()) { return; }
+  pthread_mutex_init(&f->mutex, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->exiting = FALSE;
+  if (pthread_create(&f->thread, NULL, flush_thread_main, env)) {
+    print_error("cannot create flush thread. flush synchronously.");
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->mutex);
+    return;
+  }
+  f->running = TRUE;
+}
+
+/**
+ * 書き出し中の転置インデックスがあれば、その完了を待つ。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+static void
+wait_flush(wiser_env *env)
+{
+  ii_flusher *f = &env->flusher;
+
+  if (!f->running) { return; }
+  pthread_mutex_lock(&f->mutex);
+  while (f->ii) {
+    pthread_cond_wait(&f->cond, &f->mutex);
+  }
+  pthread_mutex_unlock(&f->mutex);
+}
+
+/**
+ * 書き出しの完了を待ってから、書き出しスレッドを終了させる。
+ * @param[in] env アプリケーション環境を保存する構造体
+ */
+static void
+stop_flush_thread(wiser_env *env)
+{
+  ii_flusher *f = &env->flusher;
+
+  if (!f->running) { return; }
+  pthread_mutex_lock(&f->mutex);
+  f->exiting = TRUE;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->mutex);
+  pthread_join(f->thread, NULL);
+  pthread_cond_destroy(&f->cond);
+  pthread_mutex_destroy(&f->mutex);
+  f->running = FALSE;
+  f->has_checkpoint = FALSE;
+}
+
+/**
+ * 更新用の転置インデックスを書き出す。
+ * 書き出しスレッドが起動していれば、書き出し中のものの完了を待ってから
+ * バッファを受け渡し、新しいバッファで文書の追加を続けられるようにする。
+ * 書き出し中のものは1つまでで、完了したものについてチェックポイントを保存する。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] final 最後の書き出しかどうか。最後の場合は完了まで待つ
+ */
+static void
+flush_ii_buffer(wiser_env *env, int final)
+{
+  ii_flusher *f = &env->flusher;
+
+  print_time_diff();
+
+  wait_flush(env);
+  /* 書き出しに失敗した転置インデックスの文書を含むチェックポイントは保存せず、
+     最後に保存したチェックポイントから再開できるようにする */
+  if (env->ii_write_failed) { f->has_checkpoint = FALSE; }
+  /* 文書長は、書き出す転置インデックスと同じトランザクションで保存する */
+  save_document_lengths(env);
+  /* 書き出しのたびに世代を進め、キャッシュされた検索結果を無効にする。
+     検索では設定を読み直さないので、envの世代も進める */
+  env->index_generation = get_index_generation(env) + 1;
+  replace_settings_number(env, INDEX_GENERATION_KEY, env->index_generation);
+  if (f->has_checkpoint && !final) {
+    save_checkpoint(env, f->offset, f->article_count);
+  }
+  f->has_checkpoint = FALSE;
+
+  if (f->running && !final) {
+    pthread_mutex_lock(&f->mutex);
+    f->ii = env->ii_buffer;
+    f->ii_count = env->ii_buffer_count;
+    f->ii_size = env->ii_buffer_size;
+    f->documents_count = env->indexed_count;
+    f->has_checkpoint = TRUE;
+    f->offset = env->dump_offset;
+    f->article_count = env->dump_article_count;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+  } else {
+    write_ii_buffer(env, env->ii_buffer, env->ii_buffer_count,
+                    env->ii_buffer_size, env->indexed_count);
+    if (!final && !env->ii_write_failed) {
+      save_checkpoint(env, env->dump_offset, env->dump_article_count);
+    }
+  }
+  env->ii_buffer = NULL;
+  env->ii_buffer_count = 0;
+  env->ii_buffer_size = 0;
+
+  print_time_diff();
+}
+
+/**
+ * 更新用の転置インデックスのバッファをflushすべきかどうかを判定する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @return flushすべきかどうか
+ */
+static int
+ii_buffer_is_full(const wiser_env *env)
+{
+  /* 文書数のしきい値。負の場合は文書数では判定しない */
+  if (env->ii_buffer_update_threshold >= 0 &&
+      env->ii_buffer_count > env->ii_buffer_update_threshold) {
+    return TRUE;
+  }
+  /* ハッシュのバケット配列を含めたメモリ使用量。
+     書き出しスレッドがあれば、書き出し中のバッファと合わせて予算に収まるよう、
+     それぞれのバッファには予算の半分ずつを割り当てる */
+  if (env->ii_buffer_mem_budget) {
+    size_t size = env->ii_buffer_size, budget = env->ii_buffer_mem_budget;
+    if (env->ii_buffer) {
+      size += env->ii_buffer->hh.tbl->num_buckets * sizeof(UT_hash_bucket);
+    }
+    if (env->flusher.running) { budget /= 2; }
+    if (size >= budget) { return TRUE; }
+  }
+  return FALSE;
+}
+
 /**
  * 文書をデータベースに追加し、転置インデックスを作成する
  * @param[in] env アプリケーション環境を保存する構造体
@@ -18,9 +379,15 @@
 static void
 add_document(wiser_env *env, const char *title, const char *body)
 {
+  /* バッファに所定の文書数がたまったら、文書を追加する前に更新を行う。
+     この時点では、これから追加する文書の位置から読み込みを再開できる */
+  if (env->ii_buffer && (ii_buffer_is_full(env) || !title)) {
+    flush_ii_buffer(env, !title);
+  }
+
   if (title && body) {
     UTF32Char *body32;
-    int body32_len, document_id;
+    int body32_len, document_id, tokens_count;
     unsigned int title_size, body_size;
 
     title_size = strlen(title);
@@ -34,55 +401,53 @@ add_document(wiser_env *env, const char *title, const char *body)
     if (!utf8toutf32(body, body_size, &body32, &body32_len)) {
       /* documentからposting_listを作成 */
       text_to_postings_lists(env, document_id, body32, body32_len,
-                             env->token_len, &env->ii_buffer);
+                             env->token_len, &env->ii_buffer, &tokens_count);
+      set_document_length(env, document_id, tokens_count);
+      /* スニペットを表示するための、位置とバイト位置の対応を保存する */
+      {
+        int *offsets, offsets_count;
+        if (!build_position_checkpoints(body32, body32_len,
+                                        &offsets, &offsets_count)) {
+          db_replace_document_offsets(env, document_id,
+                                      offsets, offsets_count);
+          free(offsets);
+        }
+      }
       env->ii_buffer_count++;
       free(body32);
     }
     env->indexed_count++;
     print_error("count:%d title: %s", env->indexed_count, title);
   }
-
-  /* バッファに所定の文書数がたまったら、更新を行う */
-  if (env->ii_buffer &&
-      (env->ii_buffer_count > env->ii_buffer_update_threshold || !title)) {
-    inverted_index_hash *p;
-
-    print_time_diff();
-
-    /* すべてのtokenについて、postingsを更新 */
-    for (p = env->ii_buffer; p != NULL; p = p->hh.next) {
-      update_postings(env, p);
-    }
-    free_inverted_index(env->ii_buffer);
-    print_error("index flushed.");
-    env->ii_buffer = NULL;
-    env->ii_buffer_count = 0;
-
-    print_time_diff();
-  }
 }
 
 /**
  * アプリケーション環境を設定する。
  * @param[in] env アプリケーション環境を保存する構造体
- * @param[in] ii_buffer_update_threshold 転置索引のバッファをflushするしきい値
+ * @param[in] ii_buffer_update_threshold 転置索引のバッファをflushする文書数
+ * @param[in] ii_buffer_mem_budget 転置索引のバッファをflushするバイト数
  * @param[in] enable_phrase_search フレーズ検索を有効にするかどうか
+ * @param[in] enable_bulk_build ランファイルを経由して一括構築するかどうか
  * @param[in] db_path データベースのパス
  * @return エラーコード
  * @retval 0 成功
  */
 static int
 init_env(wiser_env *env,
-         int ii_buffer_update_threshold, int enable_phrase_search,
+         int ii_buffer_update_threshold, size_t ii_buffer_mem_budget,
+         int enable_phrase_search, int enable_bulk_build,
          const char *db_path)
 {
   int rc;
   memset(env, 0, sizeof(wiser_env));
   rc = init_database(env, db_path);
   if (!rc) {
+    env->db_path = db_path;
     env->token_len = N_GRAM;
     env->ii_buffer_update_threshold = ii_buffer_update_threshold;
+    env->ii_buffer_mem_budget = ii_buffer_mem_budget;
     env->enable_phrase_search = enable_phrase_search;
+    env->enable_bulk_build = enable_bulk_build;
   }
   return rc;
 }
@@ -94,6 +459,10 @@ init_env(wiser_env *env,
 static void
 fin_env(wiser_env *env)
 {
+  if (env->document_lengths) { free(env->document_lengths); }
+  fin_query_cache(env);
+  fin_postings_cache(env);
+  fin_query_context(env);
   fin_database(env);
 }
 
@@ -136,6 +505,141 @@ parse_compress_method(wiser_env *env, const char *method,
   }
 }
 
+/**
+ * 検索結果のスコアの計算方法を解析する
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] method スコアの計算方法
+ */
+static void
+parse_scoring_method(wiser_env *env, const char *method)
+{
+  int method_size = method ? strlen(method) : 0;
+  if (!method_size || MEMSTRCMP(method, method_size, "tfidf")) {
+    env->scoring = scoring_tf_idf;
+  } else if (MEMSTRCMP(method, method_size, "bm25")) {
+    env->scoring = scoring_bm25;
+  } else {
+    print_error("invalid scoring method(%s). use tfidf instead.", method);
+    env->scoring = scoring_tf_idf;
+  }
+}
+
+/**
+ * K/M/Gの接尾辞が付いたバイト数を解析する
+ * @param[in] str バイト数を表す文字列
+ * @return バイト数。解析できなかった場合は0
+ */
+static size_t
+parse_size(const char *str)
+{
+  char *end;
+  unsigned long long size = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'G': case 'g':
+    size <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    size <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    size <<= 10;
+    break;
+  case '\0':
+    break;
+  default:
+    print_error("invalid size(%s).", str);
+    return 0;
+  }
+  return (size_t)size;
+}
+
+/**
+ * チェックポイントを読み込み、インデックス構築を再開する準備をする。
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] compress_method_str チェックポイントがない場合の圧縮方法
+ * @param[out] offset 読み込みを再開する記事のバイト位置
+ * @param[out] article_count offsetより前にある記事数
+ * @retval 0 成功
+ * @retval 1 インデックス構築はすでに完了している
+ */
+static int
+prepare_resume(wiser_env *env, const char *compress_method_str,
+               long long *offset, int *article_count)
+{
+  int cm_size = 0;
+  const char *cm = NULL;
+
+  *offset = get_settings_number(env, CHECKPOINT_OFFSET_KEY, 0);
+  *article_count = 0;
+  if (*offset == CHECKPOINT_COMPLETED) { return 1; }
+  if (!*offset) {
+    /* チェックポイントがないので、最初から構築する */
+    parse_compress_method(env, compress_method_str, -1);
+    return 0;
+  }
+  *article_count = get_settings_number(env, CHECKPOINT_ARTICLE_COUNT_KEY, 0);
+  env->runs_count = get_settings_number(env, CHECKPOINT_RUNS_COUNT_KEY, 0);
+  if (env->runs_count) { env->enable_bulk_build = TRUE; }
+  env->indexed_count = db_get_document_count(env);
+  if (db_get_document_lengths(env, &env->document_lengths,
+                              &env->document_lengths_count)) {
+    print_error("cannot load document lengths.");
+  }
+
+  /* 構築時の圧縮方法を引き継ぐ */
+  db_get_settings(env, "compress_method", sizeof("compress_method") - 1,
+                  &cm, &cm_size);
+  parse_compress_method(env, cm, cm_size);
+
+  print_error("resume from checkpoint. offset:%lld articles:%d documents:%d",
+              *offset, *article_count, env->indexed_count);
+  return 0;
+}
+
+/**
+ * ファイルから1行に1つずつ検索クエリを読み込み、順に全文検索を行う
+ * @param[in] env アプリケーション環境を保存する構造体
+ * @param[in] path 検索クエリのファイルのパス。"-"の場合は標準入力
+ * @retval 0 成功
+ * @retval -1 失敗
+ */
+static int
+search_queries(wiser_env *env, const char *path)
+{
+  FILE *fp;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+
+  if (!strcmp(path, "-")) {
+    fp = stdin;
+  } else if (!(fp = fopen(path, "r"))) {
+    print_error("cannot open queries file(%s).", path);
+    return -1;
+  }
+  while ((len = getline(&line, &line_size, fp)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (!len) { continue; }
+    /* JSON Linesでは、クエリは概要の行に含める */
+    if (!env->output_json) { printf("query: %s\n", line); }
+    search(env, line);
+    fflush(stdout);
+    /* 次のクエリを待つ間は読み込みのトランザクションを終えておき、
+       他の接続による書き込みを妨げず、次の検索でその更新を読めるようにする */
+    db_reset_statements(env);
+  }
+  free(line);
+  if (fp != stdin) { fclose(fp); }
+  print_error("query cache: %u hits, %u misses",
+              env->query_cache_hits, env->query_cache_misses);
+  print_error("postings cache: %u hits, %u misses, %zu bytes",
+              env->postings_cache.hits, env->postings_cache.misses,
+              env->postings_cache.size);
+  return 0;
+}
+
 /**
  * エントリポイント
  * @param[in] argc 引数の数
@@ -147,17 +651,60 @@ main(int argc, char *argv[])
   wiser_env env;
   extern int optind;
   int max_index_count = -1; /* 無制限 */
-  int ii_buffer_update_threshold = DEFAULT_II_BUFFER_UPDATE_THRESHOLD;
+  int ii_buffer_update_threshold = -1; /* 未指定 */
+  size_t ii_buffer_mem_budget = 0;     /* 無制限 */
   int enable_phrase_search = TRUE;
+  int enable_bulk_build = FALSE;
+  int resume = FALSE;
+  int search_top_k = 0; /* 無制限 */
+  int enable_two_phase_search = FALSE;
+  int enable_or_search = FALSE;
+  int search_threads = 0; /* オンラインのCPU数 */
+  int fuzzy_distance = 0; /* あいまい検索をしない */
+  int enable_snippets = FALSE;
+  int enable_impacts = FALSE;
+  int count_only = FALSE;
+  int estimate_count = FALSE;
+  int search_offset = 0;
+  int search_limit = 0; /* 無制限 */
+  int output_json = FALSE;
+  int show_titles = TRUE;
+  int query_cache_size = DEFAULT_QUERY_CACHE_SIZE;
+  size_t postings_cache_size = DEFAULT_POSTINGS_CACHE_SIZE;
   const char *compress_method_str = NULL, *wikipedia_dump_file = NULL,
-              *query = NULL;
+              *query = NULL, *scoring_method_str = NULL, *queries_file = NULL,
+              *regex = NULL;
   /* オプション文字列の解析 */
   {
     int ch;
     extern int opterr;
     extern char *optarg;
+    static const struct option long_options[] = {
+      {"resume", no_argument, NULL, 'r'},
+      {"mem-budget", required_argument, NULL, 'M'},
+      {"or", no_argument, NULL, 'o'},
+      {"scoring", required_argument, NULL, 'S'},
+      {"queries", required_argument, NULL, 'Q'},
+      {"query-cache", required_argument, NULL, 'C'},
+      {"postings-cache", required_argument, NULL, 'P'},
+      {"threads", required_argument, NULL, 'j'},
+      {"regex", required_argument, NULL, 'R'},
+      {"fuzzy", required_argument, NULL, 'F'},
+      {"snippets", no_argument, NULL, 'n'},
+      {"impacts", no_argument, NULL, 'I'},
+      {"count", no_argument, NULL, 'N'},
+      {"estimate", no_argument, NULL, 'E'},
+      {"offset", required_argument, NULL, 'O'},
+      {"limit", required_argument, NULL, 'L'},
+      {"json", no_argument, NULL, 'J'},
+      {"no-titles", no_argument, NULL, 'T'},
+      {"two-phase", no_argument, NULL, 'V'},
+      {NULL, 0, NULL, 0}
+    };
 
-    while ((ch = getopt(argc, argv, "c:x:q:m:t:s")) != -1) {
+    while ((ch = getopt_long(argc, argv,
+                             "c:x:q:m:t:sbrM:k:oS:Q:C:P:j:R:F:nINEO:L:JTV",
+                             long_options, NULL)) != -1) {
       switch (ch) {
       case 'c':
         compress_method_str = optarg;
@@ -177,8 +724,75 @@ main(int argc, char *argv[])
       case 's':
         enable_phrase_search = FALSE;
         break;
+      case 'b':
+        enable_bulk_build = TRUE;
+        break;
+      case 'r':
+        resume = TRUE;
+        break;
+      case 'M':
+        ii_buffer_mem_budget = parse_size(optarg);
+        break;
+      case 'k':
+        search_top_k = atoi(optarg);
+        break;
+      case 'o':
+        enable_or_search = TRUE;
+        break;
+      case 'S':
+        scoring_method_str = optarg;
+        break;
+      case 'Q':
+        queries_file = optarg;
+        break;
+      case 'C':
+        query_cache_size = atoi(optarg);
+        break;
+      case 'P':
+        postings_cache_size = parse_size(optarg);
+        break;
+      case 'j':
+        search_threads = atoi(optarg);
+        break;
+      case 'R':
+        regex = optarg;
+        break;
+      case 'F':
+        fuzzy_distance = atoi(optarg);
+        break;
+      case 'n':
+        enable_snippets = TRUE;
+        break;
+      case 'I':
+        enable_impacts = TRUE;
+        break;
+      case 'N':
+        count_only = TRUE;
+        break;
+      case 'E':
+        estimate_count = TRUE;
+        break;
+      case 'O':
+        search_offset = atoi(optarg);
+        break;
+      case 'L':
+        search_limit = atoi(optarg);
+        break;
+      case 'J':
+        output_json = TRUE;
+        break;
+      case 'T':
+        show_titles = FALSE;
+        break;
+      case 'V':
+        enable_two_phase_search = TRUE;
+        break;
       }
     }
+    /* メモリ量でflushする場合は、文書数は指定されたときのみ上限とする */
+    if (ii_buffer_update_threshold < 0 && !ii_buffer_mem_budget) {
+      ii_buffer_update_threshold = DEFAULT_II_BUFFER_UPDATE_THRESHOLD;
+    }
   }
 
   /* 解析したオプションを用いて実行 */
@@ -190,13 +804,56 @@ main(int argc, char *argv[])
       "  -c compress_method            : compress method for postings list\n"
       "  -x wikipedia_dump_xml         : wikipedia dump xml path for indexing\n"
       "  -q search_query               : query for search\n"
+      "  -Q, --queries queries_file    : search each line of the file (\"-\" for stdin)\n"
+      "  -R, --regex pattern           : search document bodies with an extended regex\n"
+      "                                  containing a literal of 2 or more characters\n"
+      "  -C, --query-cache size        : max number of cached search results\n"
+      "                                  for -Q (0 to disable)\n"
+      "  -P, --postings-cache size     : max bytes of decoded postings lists\n"
+      "                                  cached for -Q (e.g. 64M, 0 to disable)\n"
       "  -m max_index_count            : max count for indexing document\n"
       "  -t ii_buffer_update_threshold : inverted index buffer merge threshold\n"
+      "  -M, --mem-budget size         : merge inverted index buffers when they\n"
+      "                                  use this many bytes in total (e.g. 512M)\n"
       "  -s                            : don't use tokens' positions for search\n"
+      "  -k top_k                      : show only top k search results\n"
+      "  -V, --two-phase               : with -k, check phrases only in the top-scoring\n"
+      "                                  candidates. the total becomes a lower bound\n"
+      "  -o, --or                      : rank documents matching any of the query's tokens\n"
+      "  -F, --fuzzy distance          : find documents containing a substring within\n"
+      "                                  this edit distance of the query\n"
+      "  -n, --snippets                : show a snippet of each search result\n"
+      "  -N, --count                   : show only the number of matching documents\n"
+      "  -E, --estimate                : show an estimated number of matching documents\n"
+      "                                  with a 95%% confidence interval, checking\n"
+      "                                  a bounded, evenly spaced sample of documents\n"
+      "  -O, --offset num              : skip the first num search results\n"
+      "  -L, --limit num               : show at most num search results\n"
+      "  -J, --json                    : print search results as JSON lines, after\n"
+      "                                  a line with the query and the total count\n"
+      "  -T, --no-titles               : don't look up the titles of search results\n"
+      "  -I, --impacts                 : build impact-ordered postings when indexing,\n"
+      "                                  and use them for top-k search of one or two\n"
+      "                                  tokens (with -k)\n"
+      "  -j, --threads num             : threads to search one query with\n"
+      "                                  (default: number of online CPUs)\n"
+      "  -S, --scoring scoring_method  : scoring method for search results\n"
+      "  -b                            : build index with sorted runs and a single final merge\n"
+      "  -r, --resume                  : resume indexing from the last checkpoint\n"
       "\n"
       "compress_methods:\n"
       "  none   : don't compress.\n"
-      "  golomb : Golomb-Rice coding(default).\n",
+      "  golomb : Golomb-Rice coding(default).\n"
+      "\n"
+      "scoring_methods:\n"
+      "  tfidf  : TF-IDF(default).\n"
+      "  bm25   : Okapi BM25. uses document lengths.\n"
+      "\n"
+      "search_query:\n"
+      "  words separated by spaces must all appear. \"quoted phrase\" must\n"
+      "  appear as is. combine them with AND, OR, NOT (or -word) and ( ).\n"
+      "  -o, -I, -V and -j apply only to a query of a single word. with -E,\n"
+      "  such a query shows its exact number of matching documents.\n",
       argv[0]);
     return -1;
   }
@@ -204,34 +861,78 @@ main(int argc, char *argv[])
   /* インデックス作成モードのときに、すでに既存のdbがあればエラーを出す */
   {
     struct stat st;
-    if (wikipedia_dump_file && !stat(argv[optind], &st)) {
+    if (wikipedia_dump_file && !resume && !stat(argv[optind], &st)) {
       printf("%s is already exists.\n", argv[optind]);
       return -2;
     }
   }
 
   {
-    int rc = init_env(&env, ii_buffer_update_threshold, enable_phrase_search,
-                  argv[optind]);
+    int rc = init_env(&env, ii_buffer_update_threshold, ii_buffer_mem_budget,
+                      enable_phrase_search, enable_bulk_build, argv[optind]);
     if (!rc) {
       print_time_diff();
 
       /* Wikipediaの記事データを読み込む */
       if (wikipedia_dump_file) {
-        parse_compress_method(&env, compress_method_str, -1);
-        begin(&env);
-        if (!load_wikipedia_dump(&env, wikipedia_dump_file, add_document,
-                                 max_index_count)) {
-          /* バッファをflushする */
-          add_document(&env, NULL, NULL);
-          commit(&env);
-        } else {
-          rollback(&env);
+        long long offset = 0;
+        int article_count = 0;
+
+        if (!resume) {
+          parse_compress_method(&env, compress_method_str, -1);
+        } else if (prepare_resume(&env, compress_method_str,
+                                  &offset, &article_count)) {
+          print_error("indexing is already completed.");
+          wikipedia_dump_file = NULL;
+        }
+        if (wikipedia_dump_file) {
+          int load_rc;
+
+          begin(&env);
+          start_flush_thread(&env);
+          load_rc = load_wikipedia_dump(&env, wikipedia_dump_file, add_document,
+                                        max_index_count, offset, article_count);
+          if (!load_rc && !env.ii_write_failed) {
+            /* バッファをflushする */
+            add_document(&env, NULL, NULL);
+          }
+          stop_flush_thread(&env);
+          if (!load_rc && env.ii_write_failed) {
+            print_error("cannot write inverted index. resume with -r.");
+            load_rc = -1;
+          }
+          if (!load_rc && env.enable_bulk_build) {
+            /* ランファイルをマージし、各トークンのpostingsを一度だけ書き込む。
+               失敗した場合は、ランファイルとチェックポイントを残しておく */
+            if (merge_postings_runs(&env)) {
+              print_error("cannot merge postings runs. resume with -r.");
+              load_rc = -1;
+            }
+            print_time_diff();
+          }
+          if (!load_rc) {
+            /* インパクト順のポスティングリストは、古くならないよう作り直すか消す */
+            if (enable_impacts) {
+              if (build_impact_postings(&env)) {
+                print_error("cannot build impact-ordered postings.");
+              }
+              print_time_diff();
+            } else {
+              db_clear_impacts(&env);
+            }
+            replace_settings_number(&env, CHECKPOINT_OFFSET_KEY,
+                                    CHECKPOINT_COMPLETED);
+            commit(&env);
+            remove_postings_runs(&env);
+          } else {
+            /* 最後のチェックポイントまでの内容は保存されている */
+            rollback(&env);
+          }
         }
       }
 
       /* 検索を行う */
-      if (query) {
+      if (query || queries_file || regex) {
         int cm_size;
         const char *cm;
         db_get_settings(&env,
@@ -239,7 +940,37 @@ main(int argc, char *argv[])
                         &cm, &cm_size);
         parse_compress_method(&env, cm, cm_size);
         env.indexed_count = db_get_document_count(&env);
-        search(&env, query);
+        env.search_top_k = search_top_k;
+        env.enable_two_phase_search = enable_two_phase_search;
+        env.enable_or_search = enable_or_search;
+        env.fuzzy_distance = fuzzy_distance;
+        env.enable_snippets = enable_snippets;
+        env.enable_impact_search = enable_impacts;
+        /* 見積もれないクエリでは、正確な文書数を数える */
+        env.count_only = count_only || estimate_count;
+        env.estimate_count = estimate_count;
+        env.search_offset = (search_offset > 0) ? search_offset : 0;
+        env.search_limit = search_limit;
+        env.output_json = output_json;
+        env.show_titles = show_titles;
+        env.search_threads = (search_threads > 0) ? search_threads : 0;
+        parse_scoring_method(&env, scoring_method_str);
+        if (query) {
+          search(&env, query);
+        }
+        if (regex) {
+          /* 文書はUTF-8で保存されているので、正規表現もUTF-8の文字単位で
+             扱う。ロケールは、検索の前に1度だけ設定する */
+          if (!setlocale(LC_CTYPE, "C.UTF-8")) {
+            setlocale(LC_CTYPE, "");
+          }
+          search_regex(&env, regex);
+        }
+        if (queries_file) {
+          env.query_cache_size = query_cache_size;
+          env.postings_cache.budget = postings_cache_size;
+          search_queries(&env, queries_file);
+        }
       }
       fin_env(&env);
 
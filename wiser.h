@@ -1,11 +1,14 @@
 #ifndef __WISER_H__
 #define __WISER_H__
 
+#include <pthread.h>
 #include <utlist.h>
 #include <uthash.h>
 #include <utarray.h>
 #include <sqlite3.h>
 
+#include "util.h"
+
 /* bi-gram */
 #define N_GRAM 2
 
@@ -17,6 +20,25 @@ typedef struct _postings_list {
   struct _postings_list *next; /* 次のpostings_listへのリンク */
 } postings_list;
 
+/* ポスティングリストを区切るブロックの文書数 */
+#define POSTINGS_BLOCK_SIZE 128
+/* 文書数がnのポスティングリストのブロックの数 */
+#define POSTINGS_BLOCKS_COUNT(n) \
+  (((n) + POSTINGS_BLOCK_SIZE - 1) / POSTINGS_BLOCK_SIZE)
+
+/* ポスティングリストのブロックごとの情報。スコアの上限の計算に用いる */
+typedef struct {
+  int last_document_id;    /* ブロック内の最後の文書ID */
+  int max_positions_count; /* ブロック内の文書でのトークンの最大出現数 */
+} postings_block;
+
+/* ポスティングリストのブロックごとの、符号化されたバイト列での読み込み位置。
+   ブロックごとの情報の配列の後に、同じ数だけ続けて保存する */
+typedef struct {
+  int docs_offset;      /* ブロックの最初の文書の文書IDのビット位置 */
+  int positions_offset; /* ブロックの最初の文書の位置情報のバイト位置 */
+} postings_block_offset;
+
 /* 転置インデックス */
 typedef struct {
   int token_id;                 /* トークンID */
@@ -32,6 +54,182 @@ typedef enum {
   compress_golomb /* golomb符号での圧縮 */
 } compress_method;
 
+/* ポスティングリストのバイト列を読み進めるときに、一度に読み込むバイト数 */
+#define POSTINGS_READER_BUFFER_SIZE 4096
+
+/* ポスティングリストのバイト列を、一部ずつ読み込みながら読み進める */
+typedef struct {
+  sqlite3_blob *blob;      /* 読み込むバイト列 */
+  int size;                /* バイト列全体のバイト数 */
+  int base;                /* bufの先頭の、バイト列全体でのバイト位置 */
+  int len;                 /* bufに読み込んだバイト数 */
+  int pos;                 /* bufの中で、次に読むバイトの位置 */
+  unsigned char bit;       /* 次に読むビットのマスク */
+  char buf[POSTINGS_READER_BUFFER_SIZE]; /* 読み込んだバイト列の一部 */
+} postings_reader;
+
+/* ポスティングリストの文書IDの列を、先頭から必要な分だけ復号するストリーム */
+typedef struct {
+  compress_method compress;  /* 圧縮方法 */
+  postings_reader docs;      /* 文書IDの列を読み進める位置 */
+  postings_reader positions; /* 位置情報を読み進める位置 */
+  postings_reader blocks;    /* ブロックごとの情報を読み進める位置 */
+  int blocks_count;          /* ブロックの数。読み込み位置がなければ0 */
+  int blocks_read;           /* blocksから読んだブロックの数 */
+  int block_last_document_id; /* 最後に読んだブロックの最後の文書ID */
+  int prev_last_document_id; /* その前のブロックの最後の文書ID */
+  int docs_count;            /* 文書数 */
+  int index;                 /* 現在の文書の添字 */
+  int positions_index;       /* positionsで次に位置情報を読む文書の添字 */
+  int entry_offset;          /* 圧縮なしの場合の、現在の文書のバイト位置 */
+  int m, b, t;               /* 文書IDの列のGolomb符号のパラメータ */
+  postings_list entry;       /* 現在の文書。位置情報は
+                                postings_stream_positionsで読む */
+} postings_stream;
+
+/* 検索結果のスコアの計算方法 */
+typedef enum {
+  scoring_tf_idf, /* TF-IDF */
+  scoring_bm25    /* Okapi BM25 */
+} scoring_method;
+
+/* 文書長の配列を、データベースに分割して保存する単位の文書数 */
+#define DOCUMENT_LENGTHS_CHUNK_SIZE 1024
+
+/* インパクト順のポスティングリストのセグメントの見出し。
+   トークンの出現数を2のべき乗で量子化した値ごとに、文書をまとめる */
+typedef struct {
+  int max_positions_count; /* セグメント内の文書でのトークンの最大出現数 */
+  int min_document_length; /* セグメント内の文書の最小の文書長。0で不明 */
+  int postings_count;      /* セグメント内の文書数 */
+} impact_segment;
+
+/* インパクト順のポスティングリストの要素。セグメント内では文書IDの昇順に並ぶ */
+typedef struct {
+  int document_id;         /* 文書のID */
+  int positions_count;     /* 文書中でのトークンの出現数 */
+} impact_posting;
+
+/* インパクト順のポスティングリストを作成する、トークンの最小の文書数 */
+#define IMPACT_POSTINGS_MIN_DOCS POSTINGS_BLOCK_SIZE
+
+/* 何トークンの位置ごとに、文書中のバイト位置を記録するか */
+#define POSITION_CHECKPOINT_INTERVAL 64
+
+/* 更新用の転置インデックスをバックグラウンドで書き出すための状態 */
+typedef struct {
+  pthread_t thread;        /* 書き出しスレッド */
+  pthread_mutex_t mutex;   /* 以下のメンバを保護する */
+  pthread_cond_t cond;     /* 書き出しの依頼と完了を通知する */
+  int running;             /* 書き出しスレッドが起動しているか */
+  int exiting;             /* 書き出しスレッドを終了させるか */
+  inverted_index_hash *ii; /* 書き出し中の転置インデックス */
+  int ii_count;            /* 書き出し中の転置インデックスの文書数 */
+  size_t ii_size;          /* 書き出し中の転置インデックスのバイト数 */
+  int documents_count;     /* 依頼時点のインデックス化された文書数 */
+  int has_checkpoint;      /* 書き出し完了後に保存するチェックポイントがあるか */
+  long long offset;        /* 書き出し中のバッファの次の記事のバイト位置 */
+  int article_count;       /* 同上の記事より前にある記事数 */
+} ii_flusher;
+
+/* スコアの降順に並べた検索結果のエントリ */
+typedef struct {
+  int document_id;           /* 検索された文書ID */
+  double score;              /* 検索スコア */
+  int snippet_position;      /* スニペットを始めるトークンの位置。-1で文書の先頭 */
+} search_result_entry;
+
+/* 文書IDを添字とする検索スコアのアキュムレータ。検索の間で使い回す */
+typedef struct {
+  search_result_entry *entries; /* 文書IDを添字とする検索結果 */
+  unsigned int *seen;           /* 文書ごとの、スコアを加えたトークンのビット集合 */
+  unsigned int *stamps;         /* 要素を最後に書き込んだ検索の番号 */
+  int capacity;                 /* 各配列の要素数 */
+  unsigned int stamp;           /* 現在の検索の番号 */
+} score_accumulators;
+
+/* 範囲ごとの検索で使い回す、要素数の変わる作業用の配列 */
+typedef struct {
+  UT_array *documents;    /* kが無制限の場合の、スコアを加えた文書IDの列 */
+  UT_array *candidates;   /* 2段階評価での候補の文書 */
+  UT_array *snippet_hits; /* スニペットの位置を選ぶためのトークンの出現 */
+  UT_array *body;         /* UTF-32に変換した候補の文書の本文 */
+  UT_array *deferred_positions; /* 後回しにしたトークンごとの出現位置 */
+} query_scratch;
+
+/* 検索の実行状態。検索の間で使い回し、検索を始めるたびにリセットする */
+typedef struct {
+  arena arena;                     /* 1回の検索の間だけ使う領域 */
+  score_accumulators accumulators; /* 件数を制限しない検索でのスコアの集計 */
+  query_scratch *scratches;        /* 作業用の配列。先頭は範囲に分けない検索用 */
+  int scratches_count;             /* scratchesの要素数 */
+} query_context;
+
+/* ブール検索クエリの演算子木のノードの種類 */
+typedef enum {
+  query_node_term, /* 語。空白で区切られた文字列か、引用符で囲まれたフレーズ */
+  query_node_and,  /* すべての子ノードに一致 */
+  query_node_or,   /* いずれかの子ノードに一致 */
+  query_node_not   /* 子ノードに一致しない。ANDの子ノードとしてのみ使える */
+} query_node_type;
+
+/* ブール検索クエリの演算子木のノード */
+typedef struct _query_node {
+  query_node_type type;          /* ノードの種類 */
+  char *term;                    /* 語の文字列(UTF-8) */
+  int term_size;                 /* 語の文字列のバイト数 */
+  int is_phrase;                 /* 引用符で囲まれたフレーズかどうか */
+  struct _query_node **children; /* 子ノードの配列 */
+  int children_count;            /* 子ノードの数 */
+  int cost;                      /* 一致する文書数の見積もり */
+  void *data;                    /* 検索時の語ごとの状態 */
+  int document_id;               /* 検索時に一致している文書ID */
+  double score;                  /* 検索時に一致している文書のスコア */
+} query_node;
+
+/* 検索結果のキャッシュのエントリ */
+typedef struct {
+  char *key;                    /* 正規化したクエリと検索オプション */
+  long long generation;         /* 検索時のインデックスの世代 */
+  int total_count;              /* 検索条件に一致した文書数 */
+  int count_is_lower_bound;     /* total_countが下限値かどうか */
+  int results_count;            /* resultsの件数 */
+  search_result_entry *results; /* スコアの降順に並べた検索結果 */
+  UT_hash_handle hh;            /* ハッシュの要素。古く参照されたものから並ぶ */
+} query_cache_entry;
+
+/* デコード済みのポスティングリストのキャッシュのエントリ */
+typedef struct _postings_cache_entry {
+  int token_id;                 /* トークンID */
+  postings_list *postings;      /* デコード済みのポスティングリスト */
+  int postings_len;             /* ポスティングリストのエントリ数 */
+  postings_list **entries;      /* ポスティングリストの各要素を指す配列 */
+  int *document_ids;            /* ポスティングリストの各要素の文書ID */
+  postings_block *blocks;       /* ブロックごとの情報 */
+  int blocks_count;             /* ブロックの数 */
+  size_t size;                  /* エントリが使用しているバイト数 */
+  struct _postings_cache_entry *next; /* 追い出されたエントリのリスト */
+  UT_hash_handle hh;            /* ハッシュの要素。古く参照されたものから並ぶ */
+} postings_cache_entry;
+
+/* TinyLFUで頻度を数えるcount-min sketchの行数と列数 */
+#define POSTINGS_CACHE_SKETCH_DEPTH 4
+#define POSTINGS_CACHE_SKETCH_WIDTH 4096
+
+/* デコード済みのポスティングリストのキャッシュ */
+typedef struct {
+  postings_cache_entry *entries; /* トークンIDをキーとするキャッシュ */
+  postings_cache_entry *evicted; /* 検索中に追い出され、開放を待つエントリ */
+  size_t size;                   /* キャッシュが使用しているバイト数 */
+  size_t budget;                 /* キャッシュの最大バイト数。0で無効 */
+  long long generation;          /* キャッシュしたときのインデックスの世代 */
+  unsigned char sketch[POSTINGS_CACHE_SKETCH_DEPTH]
+                      [POSTINGS_CACHE_SKETCH_WIDTH]; /* 参照頻度の推定 */
+  unsigned int sketch_additions; /* sketchを半減させてから数えた参照回数 */
+  unsigned int hits;             /* キャッシュから返した回数 */
+  unsigned int misses;           /* キャッシュになかった回数 */
+} postings_cache;
+
 /* アプリケーション全体の設定 */
 typedef struct _wiser_env {
   const char *db_path;            /* データベースのパス。*/
@@ -39,17 +237,58 @@ typedef struct _wiser_env {
   int token_len;                  /* トークンの長さ。N-gramのN。 */
   compress_method compress;       /* postings list等の圧縮方法 */
   int enable_phrase_search;       /* フレーズ検索をするかどうか */
+  int enable_two_phase_search;    /* 上位k件のフレーズ検索で、スコアの高い候補
+                                     だけフレーズを確かめるかどうか */
+  int search_top_k;               /* 上位何件の検索結果を取得するか。0以下で無制限 */
+  scoring_method scoring;         /* 検索結果のスコアの計算方法 */
+  int enable_or_search;           /* いずれかのトークンを含む文書を検索するかどうか */
+  int search_threads;             /* 1つのクエリを並列に検索するスレッド数。
+                                     0の場合はオンラインのCPU数 */
+  int fuzzy_distance;             /* あいまい検索で許す編集距離。0で無効 */
+  int enable_snippets;            /* 検索結果にスニペットを表示するかどうか */
+  int enable_impact_search;       /* インパクト順のポスティングリストを使うか */
+  int count_only;                 /* 一致した文書数だけを表示するか */
+  int estimate_count;             /* 一致した文書数を見積もって表示するか */
+  int search_offset;              /* 検索結果を何件目(0始まり)から表示するか */
+  int search_limit;               /* 表示する最大件数。0以下で無制限 */
+  int output_json;                /* 検索結果をJSON Linesで出力するかどうか */
+  int show_titles;                /* 検索結果にタイトルを表示するかどうか */
 
   inverted_index_hash *ii_buffer; /* 更新用の転置インデックスバッファ */
   int ii_buffer_count;            /* 更新用の転置インデックスの文書数 */
   int ii_buffer_update_threshold; /* 更新用の転置インデックスの文書数 */
+  size_t ii_buffer_size;          /* 更新用の転置インデックスのバイト数 */
+  size_t ii_buffer_mem_budget;    /* 更新用の転置インデックスの最大バイト数 */
   int indexed_count;              /* インデックス化された文書数 */
+  int enable_bulk_build;          /* ランファイルを経由して一括構築するか */
+  int runs_count;                 /* 書き出したランファイルの数 */
+  long long dump_offset;          /* 読み込み中の記事のダンプ中のバイト位置 */
+  int dump_article_count;         /* 読み込み中の記事より前にある記事数 */
+  ii_flusher flusher;             /* バックグラウンドでの書き出し */
+  int ii_write_failed;            /* 転置インデックスの書き出しに失敗したか */
+  int *document_lengths;          /* 文書IDを添字とする文書長(トークン数)の配列 */
+  int document_lengths_count;     /* document_lengthsの要素数 */
+  int document_lengths_dirty_min; /* 保存されていない文書長の最小の文書ID */
+  int document_lengths_dirty_max; /* 保存されていない文書長の最大の文書ID */
+  double avg_document_length;     /* 平均文書長 */
+  query_cache_entry *query_cache; /* 検索結果のキャッシュ */
+  long long index_generation;     /* インデックスの世代 */
+  int index_generation_loaded;    /* index_generationを設定から読み込んだか */
+  int data_version;               /* index_generationを読み込んだ時点の
+                                     データベースのdata_version */
+  int query_cache_size;           /* キャッシュする検索結果の最大件数。0で無効 */
+  unsigned int query_cache_hits;  /* キャッシュから検索結果を返した回数 */
+  unsigned int query_cache_misses; /* キャッシュになかった回数 */
+  postings_cache postings_cache;  /* デコード済みのポスティングリストのキャッシュ */
+  query_context query;            /* 検索の実行状態 */
 
   /* sqlite3関連 */
   sqlite3 *db; /* インスタンス */
   /* sqlite3のプリペアドステートメント */
   sqlite3_stmt *get_document_id_st;
   sqlite3_stmt *get_document_title_st;
+  sqlite3_stmt *get_document_titles_st;
+  sqlite3_stmt *get_document_body_st;
   sqlite3_stmt *insert_document_st;
   sqlite3_stmt *update_document_st;
   sqlite3_stmt *get_token_id_st;
@@ -59,7 +298,14 @@ typedef struct _wiser_env {
   sqlite3_stmt *update_postings_st;
   sqlite3_stmt *get_settings_st;
   sqlite3_stmt *replace_settings_st;
+  sqlite3_stmt *get_document_lengths_st;
+  sqlite3_stmt *replace_document_lengths_st;
+  sqlite3_stmt *get_document_offsets_st;
+  sqlite3_stmt *replace_document_offsets_st;
+  sqlite3_stmt *replace_impacts_st;
+  sqlite3_stmt *get_max_token_id_st;
   sqlite3_stmt *get_document_count_st;
+  sqlite3_stmt *get_data_version_st;
   sqlite3_stmt *begin_st;
   sqlite3_stmt *commit_st;
   sqlite3_stmt *rollback_st;
@@ -72,5 +318,10 @@ typedef struct _wiser_env {
 #endif
 
 #define DEFAULT_II_BUFFER_UPDATE_THRESHOLD 2048
+#define DEFAULT_QUERY_CACHE_SIZE 1024
+#define DEFAULT_POSTINGS_CACHE_SIZE (64 * 1024 * 1024)
+
+/* 検索結果の文書のタイトルを、まとめて取得する件数 */
+#define DOCUMENT_TITLES_BATCH_SIZE 64
 
 #endif /* __WISER_H__ */